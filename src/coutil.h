@@ -0,0 +1,111 @@
+#ifndef coutil_h
+#define coutil_h
+
+
+#include <uv.h>
+#include <lua.h>
+
+
+#define LCU_APIVERSION	1  /* incremented on incompatible changes */
+
+#ifndef LCULIB_API
+#define LCULIB_API LUALIB_API
+#endif
+
+
+typedef struct lcu_Scheduler lcu_Scheduler;
+
+typedef struct lcu_Operation lcu_Operation;
+
+LCULIB_API int lcu_apiversion (void);
+
+LCULIB_API lcu_Scheduler *lcu_checkscheduler (lua_State *L);
+
+LCULIB_API uv_loop_t *lcu_schedloop (lcu_Scheduler *sched);
+
+/*
+ * Setup functions start the operation in 'request' or 'handle', and return -1
+ * to suspend the coroutine or the number of values to return immediately.
+ * For handles, 'loop' is NULL when the handle of a previous call with the same
+ * type is reused (a negative 'type' prevents reuse).
+ */
+
+typedef int (*lcu_RequestSetup) (lua_State *L,
+                                 uv_req_t *request,
+                                 uv_loop_t *loop,
+                                 lcu_Operation *op);
+
+typedef int (*lcu_HandleSetup) (lua_State *L,
+                                uv_handle_t *handle,
+                                uv_loop_t *loop,
+                                lcu_Operation *op);
+
+/*
+ * Await functions must be returned by C functions called from a coroutine.
+ * When resumed by the callback, 'results' is called with the arguments of the
+ * call followed by the values pushed by the callback, and returns the number
+ * of results. When resumed by other means, 'cancel' is called with the values
+ * given, and returns whether the operation shall be canceled. By default, the
+ * operation is canceled and all values given are returned.
+ */
+
+/* request operations */
+
+LCULIB_API int lcu_awaitreq (lua_State *L,
+                             lcu_Scheduler *sched,
+                             uv_req_type type,
+                             lcu_RequestSetup setup,
+                             lua_CFunction results,
+                             lua_CFunction cancel);
+
+LCULIB_API void lcu_armreq (lua_State *L,
+                            uv_loop_t *loop,
+                            lcu_Operation *op,
+                            int err);
+
+LCULIB_API lua_State *lcu_endreq (uv_loop_t *loop, uv_req_t *request);
+
+LCULIB_API void lcu_resumereq (uv_loop_t *loop, uv_req_t *request, int narg);
+
+/* handle operations */
+
+LCULIB_API int lcu_awaithdl (lua_State *L,
+                             lcu_Scheduler *sched,
+                             uv_handle_type type,
+                             lcu_HandleSetup setup,
+                             lua_CFunction results,
+                             lua_CFunction cancel);
+
+LCULIB_API int lcu_armhdl (lua_State *L, lcu_Operation *op, int err);
+
+LCULIB_API int lcu_endhdl (uv_handle_t *handle);
+
+LCULIB_API void lcu_resumehdl (uv_handle_t *handle, int narg);
+
+/* work functions */
+
+#define LCU_WORKMAXARGS	8
+
+typedef union lcu_WorkValue {
+	lua_Integer integer;  /* 'i' */
+	lua_Number number;  /* 'n' */
+	struct {
+		char *data;  /* must not be changed for 's' */
+		size_t size;
+	} buffer;  /* 's' or 'b' */
+} lcu_WorkValue;
+
+/*
+ * Work functions are executed by threads of libuv, so they must not use any
+ * Lua state. They return a non-negative integer as result, or an error code
+ * of libuv.
+ */
+
+typedef lua_Integer (*lcu_WorkFunction) (lcu_WorkValue *values, int nvalues);
+
+LCULIB_API void lcu_pushworkf (lua_State *L,
+                               lcu_WorkFunction func,
+                               const char *format);
+
+
+#endif
@@ -0,0 +1,215 @@
+#include "larenaux.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+
+/*
+ * Each system thread allocates small blocks from its own arena, which keeps
+ * a free list for each size class and carves new blocks from slabs obtained
+ * from the system. Every block has a header with its arena, so a block freed
+ * by another system thread is placed in a list of remote blocks of its arena,
+ * which the owning thread takes when its own free list of the class is empty.
+ * Arenas and their slabs are never released, but reused by new threads once
+ * released by old ones, so they can be used by any state that might outlive
+ * its thread. Thus the memory of arenas is kept for the process lifetime.
+ */
+typedef struct Arena Arena;
+
+typedef union BlockHeader {
+	struct {
+		Arena *arena;  /* arena of the block, or NULL for large blocks */
+		size_t size;  /* usable size of the block */
+	} info;
+	double align1;
+	void *align2;
+	long align3;
+} BlockHeader;
+
+typedef union FreeBlock {
+	BlockHeader header;
+	struct {
+		BlockHeader header;
+		union FreeBlock *next;
+	} free;
+} FreeBlock;
+
+#define GRAIN	sizeof(BlockHeader)
+#define NUMCLASSES	((LCU_ARENAMAXSMALL+GRAIN-1)/GRAIN)
+
+#define toclass(S)	(((S)+GRAIN-1)/GRAIN-1)
+#define classsize(C)	(((C)+1)*GRAIN)
+#define toheader(P)	(((BlockHeader *)(P))-1)
+#define tomemory(H)	((void *)(((BlockHeader *)(H))+1))
+
+struct Arena {
+	Arena *next;
+	int inuse;  /* is assigned to a system thread */
+	FreeBlock *local[NUMCLASSES];  /* only used by the owning thread */
+	FreeBlock *volatile remote[NUMCLASSES];  /* protected by 'mutex' */
+	uv_mutex_t mutex;
+	char *slab;  /* unused memory of the current slab */
+	size_t left;  /* bytes left in 'slab' */
+};
+
+static uv_once_t once = UV_ONCE_INIT;
+static uv_key_t arenakey;
+static uv_mutex_t mutex;
+static Arena *arenas = NULL;
+
+static void initarenas (void) {
+	if (uv_key_create(&arenakey) || uv_mutex_init(&mutex)) abort();
+}
+
+static Arena *acquirearena (void) {
+	Arena *arena;
+	uv_mutex_lock(&mutex);
+	for (arena = arenas; arena && arena->inuse; arena = arena->next);
+	if (arena == NULL) {
+		arena = (Arena *)malloc(sizeof(Arena));
+		if (arena) {
+			if (uv_mutex_init(&arena->mutex)) {
+				free(arena);
+				arena = NULL;
+			} else {
+				memset(arena->local, 0, sizeof(arena->local));
+				memset((void *)arena->remote, 0, sizeof(arena->remote));
+				arena->slab = NULL;
+				arena->left = 0;
+				arena->next = arenas;
+				arenas = arena;
+			}
+		}
+	}
+	if (arena) arena->inuse = 1;
+	uv_mutex_unlock(&mutex);
+	uv_key_set(&arenakey, arena);
+	return arena;
+}
+
+static FreeBlock *takeremote (Arena *arena, size_t class) {
+	FreeBlock *block;
+	if (arena->remote[class] == NULL) return NULL;  /* hint read without lock */
+	uv_mutex_lock(&arena->mutex);
+	block = arena->remote[class];
+	arena->remote[class] = NULL;
+	uv_mutex_unlock(&arena->mutex);
+	return block;
+}
+
+static FreeBlock *carveblock (Arena *arena, size_t size) {
+	FreeBlock *block;
+	if (arena->left < size) {
+		char *slab = (char *)malloc(LCU_ARENASLABSIZE);
+		if (slab == NULL) return NULL;
+		while (arena->left >= GRAIN+GRAIN) {  /* keep what is left in the old slab */
+			size_t class = toclass(arena->left-GRAIN);
+			if (class >= NUMCLASSES) class = NUMCLASSES-1;
+			block = (FreeBlock *)arena->slab;
+			block->header.info.arena = arena;
+			block->header.info.size = classsize(class);
+			block->free.next = arena->local[class];
+			arena->local[class] = block;
+			arena->slab += GRAIN+classsize(class);
+			arena->left -= GRAIN+classsize(class);
+		}
+		arena->slab = slab;
+		arena->left = LCU_ARENASLABSIZE;
+	}
+	block = (FreeBlock *)arena->slab;
+	arena->slab += size;
+	arena->left -= size;
+	return block;
+}
+
+static void *allocsmall (size_t nsize) {
+	size_t class = toclass(nsize);
+	Arena *arena = (Arena *)uv_key_get(&arenakey);
+	FreeBlock *block;
+	if (arena == NULL && (arena = acquirearena()) == NULL) return NULL;
+	block = arena->local[class];
+	if (block == NULL) block = takeremote(arena, class);
+	if (block) {
+		arena->local[class] = block->free.next;
+	} else {
+		block = carveblock(arena, GRAIN+classsize(class));
+		if (block == NULL) return NULL;
+		block->header.info.arena = arena;
+		block->header.info.size = classsize(class);
+	}
+	return tomemory(block);
+}
+
+static void *alloclarge (size_t nsize) {
+	BlockHeader *header = (BlockHeader *)malloc(GRAIN+nsize);
+	if (header == NULL) return NULL;
+	header->info.arena = NULL;
+	header->info.size = nsize;
+	return tomemory(header);
+}
+
+static void freeblock (void *ptr) {
+	FreeBlock *block = (FreeBlock *)toheader(ptr);
+	Arena *arena = block->header.info.arena;
+	if (arena == NULL) {
+		free(block);
+	} else {
+		size_t class = toclass(block->header.info.size);
+		if (arena == (Arena *)uv_key_get(&arenakey)) {
+			block->free.next = arena->local[class];
+			arena->local[class] = block;
+		} else {
+			uv_mutex_lock(&arena->mutex);
+			block->free.next = arena->remote[class];
+			arena->remote[class] = block;
+			uv_mutex_unlock(&arena->mutex);
+		}
+	}
+}
+
+static void *reallocblock (void *ptr, size_t nsize) {
+	BlockHeader *header = toheader(ptr);
+	size_t size = header->info.size;
+	void *memory;
+	if (header->info.arena == NULL && nsize > LCU_ARENAMAXSMALL) {
+		header = (BlockHeader *)realloc(header, GRAIN+nsize);
+		if (header == NULL) return NULL;
+		header->info.size = nsize;
+		return tomemory(header);
+	}
+	if (header->info.arena && nsize <= size && toclass(nsize) == toclass(size))
+		return ptr;
+	memory = nsize > LCU_ARENAMAXSMALL ? alloclarge(nsize) : allocsmall(nsize);
+	if (memory == NULL) return nsize <= size ? ptr : NULL;  /* shrink never fails */
+	memcpy(memory, ptr, nsize < size ? nsize : size);
+	freeblock(ptr);
+	return memory;
+}
+
+LCUI_FUNC void lcuAR_init (void) {
+	uv_once(&once, initarenas);
+}
+
+LCUI_FUNC void *lcuAR_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+	(void)ud;
+	(void)osize;
+	if (nsize == 0) {
+		if (ptr) freeblock(ptr);
+		return NULL;
+	}
+	if (ptr) return reallocblock(ptr, nsize);
+	return nsize > LCU_ARENAMAXSMALL ? alloclarge(nsize) : allocsmall(nsize);
+}
+
+LCUI_FUNC void lcuAR_releasethread (void) {
+	Arena *arena;
+	uv_once(&once, initarenas);
+	arena = (Arena *)uv_key_get(&arenakey);
+	if (arena) {
+		uv_key_set(&arenakey, NULL);
+		uv_mutex_lock(&mutex);
+		arena->inuse = 0;
+		uv_mutex_unlock(&mutex);
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef larenaux_h
+#define larenaux_h
+
+
+#include "lcuconf.h"
+
+#include <stddef.h>
+
+
+LCUI_FUNC void lcuAR_init (void);
+
+LCUI_FUNC void *lcuAR_alloc (void *ud, void *ptr, size_t osize, size_t nsize);
+
+LCUI_FUNC void lcuAR_releasethread (void);
+
+
+#endif
@@ -24,7 +24,6 @@ static LuaChannel *chklchannel(lua_State *L, int arg) {
 static int channelclose (lua_State *L, LuaChannel *channel) {
 	lcu_ChannelMap *map = lcuCS_tochannelmap(L);
 	if (lua_getiuservalue(L, 1, 1) == LUA_TSTRING) {
-		const char *name = lua_tostring(L, -1);
 		if (channel->handle) {
 			/* whole lua_State is closing, but still waiting on channel */
 			lua_State *cL;
@@ -42,7 +41,7 @@ static int channelclose (lua_State *L, LuaChannel *channel) {
 			}
 		}
 		lua_close(channel->L);
-		lcuCS_freechsync(map, name);
+		lcuCS_freechsync(map, channel->sync);
 		lua_pop(L, 1);  /* channel name */
 		/* DEBUG: channel->sync = NULL; */
 		/* DEBUG: channel->L = NULL; */
@@ -116,7 +115,7 @@ static int cancelsynced (lua_State *L) {
 		return 1;
 	}
 	lua_pushvalue(L, 1);
-	lcu_setopvalue(L);
+	lcu_setopvalue(L, lcu_getsched(L));
 	return 0;
 }
 
@@ -135,11 +134,11 @@ static void uv_onsynced (uv_async_t *async) {
 	if (lcuU_endcohdl(handle)) lcuU_resumecohdl(handle, 0);
 	else {
 		LuaChannel *canceled;
-		lcu_pushopvalue(thread);
+		lcuU_pushhdlvalue(handle);
 		canceled = (LuaChannel *)lua_touserdata(thread, -1);
 		lua_pop(thread, 1);
 		lua_pushnil(thread);
-		lcu_setopvalue(thread);
+		lcuU_sethdlvalue(handle);
 		restorechannel(canceled);
 	}
 }
@@ -253,7 +252,7 @@ static int channel_create (lua_State *L) {
 	lcu_ChannelMap *map = lcuCS_tochannelmap(L);
 	const char *name = luaL_checkstring(L, 1);
 	void *allocud;
-	lua_Alloc allocf = lua_getallocf(L, &allocud);
+	lua_Alloc allocf = lcuL_getallocf(L, &allocud);
 	LuaChannel *channel = (LuaChannel *)lua_newuserdatauv(L, sizeof(LuaChannel), 1);
 	lcu_ChannelTask *channeltask;
 
@@ -212,6 +212,8 @@ LCUI_FUNC int lcuCS_matchchsync (lcu_ChannelSync *sync,
 	} else if (sync->expected&endpoint) {
 		lua_State *match = lcuCS_dequeuestateq(&sync->queue);
 		uv_mutex_unlock(&sync->mutex);
+		lcu_log(sync, L, "matched channel");
+		lcu_probe3(chmatch, sync, L, match);
 		swapvalues(L, base, narg, match);  /* 'match' may be a task or a channel */
 		match = getsuspendedtask(match);  /* if a channel, gets its task */
 		if (match) lcuTP_resumetask(match);
@@ -226,6 +228,7 @@ LCUI_FUNC int lcuCS_matchchsync (lcu_ChannelSync *sync,
 		lua_pushinteger(L, narg);
 	}
 	lcuCS_enqueuestateq(&sync->queue, L);
+	lcu_log(sync, L, "awaiting channel");
 
 	match_end:
 	uv_mutex_unlock(&sync->mutex);
@@ -259,7 +262,7 @@ static int channelmap_gc (lua_State *L) {
 	lua_settop(L, 0);  /* remove global table */
 	uv_mutex_unlock(&map->mutex);
 
-	while ((L = lcuCS_dequeuestateq(&queue))) lua_close(L);
+	while ((L = lcuCS_dequeuestateq(&queue))) lcuL_closestate(L);
 
 	uv_mutex_destroy(&map->mutex);
 	lua_close(map->L);
@@ -273,7 +276,7 @@ LCUI_FUNC lcu_ChannelMap *lcuCS_tochannelmap (lua_State *L) {
 	int type = lua_getfield(L, LUA_REGISTRYINDEX, LCU_CHANNELSREGKEY);
 	if (type == LUA_TNIL) {
 		void *allocud;
-		lua_Alloc allocf = lua_getallocf(L, &allocud);
+		lua_Alloc allocf = lcuL_getallocf(L, &allocud);
 		map = (lcu_ChannelMap *)lua_newuserdatauv(L, sizeof(lcu_ChannelMap), 0);
 		map->L = NULL;
 		lcuL_setfinalizer(L, channelmap_gc);
@@ -308,8 +311,11 @@ LCUI_FUNC lcu_ChannelSync *lcuCS_getchsync (lcu_ChannelMap *map,
 			sync->refcount = 1;
 			sync->expected = 0;
 			lcuCS_initstateq(&sync->queue);;
+			lua_pushglobaltable(L);
+			sync->name = lua_pushstring(L, name);  /* valid while it is a key */
 			lua_pushlightuserdata(L, sync);
-			lua_setglobal(L, name);
+			lua_rawset(L, -3);
+			lua_pop(L, 1);  /* globals */
 		}
 	}
 	lua_pop(L, 1);
@@ -317,22 +323,17 @@ LCUI_FUNC lcu_ChannelSync *lcuCS_getchsync (lcu_ChannelMap *map,
 	return sync;
 }
 
-LCUI_FUNC void lcuCS_freechsync (lcu_ChannelMap *map, const char *name) {
+LCUI_FUNC void lcuCS_freechsync (lcu_ChannelMap *map, lcu_ChannelSync *sync) {
 	lua_State *L = map->L;
-	lcu_ChannelSync *sync = NULL;
 	uv_mutex_lock(&map->mutex);
-	if (lua_getglobal(L, name) == LUA_TLIGHTUSERDATA) {
-		sync = (lcu_ChannelSync *)lua_touserdata(L, -1);
-		if (--sync->refcount == 0 && lcuCS_emptystateq(&sync->queue)) {
-			void *allocud;
-			lua_Alloc allocf = lua_getallocf(L, &allocud);
-			uv_mutex_destroy(&sync->mutex);
-			allocf(allocud, sync, sizeof(lcu_ChannelSync), 0);
-			lua_pushnil(L);
-			lua_setglobal(L, name);
-		}
+	if (--sync->refcount == 0 && lcuCS_emptystateq(&sync->queue)) {
+		void *allocud;
+		lua_Alloc allocf = lua_getallocf(L, &allocud);
+		lua_pushnil(L);
+		lua_setglobal(L, sync->name);
+		uv_mutex_destroy(&sync->mutex);
+		allocf(allocud, sync, sizeof(lcu_ChannelSync), 0);
 	}
-	lua_pop(L, 1);
 	uv_mutex_unlock(&map->mutex);
 }
 
@@ -49,7 +49,7 @@ LCUI_FUNC lcu_ChannelMap *lcuCS_tochannelmap (lua_State *L);
 LCUI_FUNC lcu_ChannelSync *lcuCS_getchsync (lcu_ChannelMap *map,
                                             const char *name);
 
-LCUI_FUNC void lcuCS_freechsync (lcu_ChannelMap *map, const char *name);
+LCUI_FUNC void lcuCS_freechsync (lcu_ChannelMap *map, lcu_ChannelSync *sync);
 
 
 #define LCU_CHANNELTASKCLS	LCU_PREFIX"lcu_ChannelTask"
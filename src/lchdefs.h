@@ -10,6 +10,7 @@
 
 struct lcu_ChannelSync {
 	uv_mutex_t mutex;
+	const char *name;  /* key in the globals of 'lcu_ChannelMap.L' */
 	int refcount;
 	int expected;
 	lcu_StateQ queue;
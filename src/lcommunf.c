@@ -4,6 +4,7 @@
 #include "lttyaux.h"
 
 #include <string.h>
+#include <errno.h>
 #include <luamem.h>
 
 
@@ -539,7 +540,7 @@ static int k_setupfindaddr (lua_State *L,
 }
 static int system_findaddr (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
-	return lcuT_resetcoreqk(L, sched, k_setupfindaddr, returnfound, NULL);
+	return lcuT_resetcoreqk(L, UV_GETADDRINFO, sched, k_setupfindaddr, returnfound, NULL);
 }
 
 /* name [, service] = system.nameaddr (address [, mode]) */
@@ -645,7 +646,9 @@ static int k_setupnameaddr (lua_State *L,
 }
 static int system_nameaddr (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
-	return lcuT_resetcoreqk(L, sched, k_setupnameaddr, NULL, NULL);
+	uv_req_type type = lua_type(L, 1) == LUA_TSTRING ? UV_GETADDRINFO
+	                                                  : UV_GETNAMEINFO;
+	return lcuT_resetcoreqk(L, type, sched, k_setupnameaddr, NULL, NULL);
 }
 
 
@@ -881,6 +884,28 @@ static int ipsock_getdomain (lua_State *L) {
 	return 1;
 }
 
+static int setbusypoll (lua_State *L, uv_handle_t *handle, int arg) {
+	int usecs = 0;
+	if (lua_toboolean(L, arg)) {
+		lua_Number secs = luaL_checknumber(L, arg);
+		luaL_argcheck(L, secs > 0 && secs*1e6 <= INT_MAX, arg, "out of range");
+		usecs = (int)(secs*1e6);
+	}
+#ifdef SO_BUSY_POLL
+	{
+		uv_os_fd_t fd;
+		int err = uv_fileno(handle, &fd);
+		if (!err && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)))
+			err = uv_translate_sys_error(errno);
+		return err;
+	}
+#else
+	(void)handle;
+	(void)usecs;
+	return UV_ENOTSUP;
+#endif
+}
+
 static void completereqop (uv_loop_t *loop, uv_req_t *request, int err) {
 	lua_State *thread = lcuU_endcoreq(loop, request);
 	if (thread) {
@@ -925,7 +950,8 @@ static int udp_bind (lua_State *L) {
 static int udp_setoption (lua_State *L) {
 	static const char * const options[] = { "mcastleave", "mcastjoin",
 	                                        "mcastiface", "mcastttl",
-	                                        "mcastloop", "broadcast", NULL };
+	                                        "mcastloop", "broadcast",
+	                                        "busypoll", NULL };
 	lcu_UdpSocket *udp = openedudp(L);
 	uv_udp_t *handle = lcu_ud2hdl(udp);
 	int opt = luaL_checkoption(L, 2, NULL, options);
@@ -957,6 +983,9 @@ static int udp_setoption (lua_State *L) {
 			int enabled = lua_toboolean(L, 3);
 			err = uv_udp_set_broadcast(handle, enabled);
 		}; break;
+		case 6: {  /* busypoll */
+			err = setbusypoll(L, (uv_handle_t *)handle, 3);
+		}; break;
 		default: return 0;
 	}
 	return lcuL_pushresults(L, 0, err);
@@ -1003,7 +1032,7 @@ static int udp_write (lua_State *L) {
 	lcu_UdpSocket *udp = openedudp(L);
 	uv_udp_t *handle = (uv_udp_t *)lcu_ud2hdl(udp);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setupsend, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_UDP_SEND, sched, k_setupsend, NULL, NULL);
 }
 
 
@@ -1052,7 +1081,11 @@ static void uv_ongetbuffer (uv_handle_t *handle,
 	(void)suggested_size;
 	lua_State *thread = (lua_State *)handle->data;
 	lcu_assert(thread);
-	lcu_getoutputbuf(thread, 2, buf);
+	lcuU_pushudhdlarg(handle, 2);  /* buffer */
+	lcuU_pushudhdlarg(handle, 3);  /* i */
+	lcuU_pushudhdlarg(handle, 4);  /* j */
+	lcu_getoutputbuf(thread, -3, buf);  /* kept alive by the awaiting call */
+	lua_pop(thread, 3);
 	lcu_assert(buf->len);
 	lcu_assert(buf->base);
 }
@@ -1097,7 +1130,7 @@ static int active_shutdown (lua_State *L) {
 	lcu_UdataHandle *udhdl = lcu_openedudhdl(L, 1, toclass(L));
 	uv_handle_t *handle = lcu_ud2hdl(udhdl);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setupshutdown, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_SHUTDOWN, sched, k_setupshutdown, NULL, NULL);
 }
 
 
@@ -1124,7 +1157,7 @@ static int active_write (lua_State *L) {
 	lcu_UdataHandle *udhdl = lcu_openedudhdl(L, 1, toclass(L));
 	uv_handle_t *handle = lcu_ud2hdl(udhdl);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setupwrite, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_WRITE, sched, k_setupwrite, NULL, NULL);
 }
 
 
@@ -1173,7 +1206,7 @@ static int pipe_write (lua_State *L) {
 	lcu_UdataHandle *udhdl = lcu_openedudhdl(L, 1, LCU_PIPESHARECLS);
 	uv_handle_t *handle = lcu_ud2hdl(udhdl);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setupwriteobj, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_WRITE, sched, k_setupwriteobj, NULL, NULL);
 }
 
 /* bytes [, errmsg] = stream:read(buffer [, i [, j]]) */
@@ -1392,7 +1425,7 @@ static int tcp_bind (lua_State *L) {
 }
 
 
-static const char * const TcpOptions[] = {"keepalive", "nodelay", NULL};
+static const char * const TcpOptions[] = {"keepalive", "nodelay", "busypoll", NULL};
 
 /* succ [, errmsg] = tcp:setoption(name, value) */
 static int tcp_setoption (lua_State *L) {
@@ -1412,6 +1445,9 @@ static int tcp_setoption (lua_State *L) {
 		case 1: {  /* nodelay */
 			err = uv_tcp_nodelay(lcu_ud2hdl(tcp), enabled);
 		}; break;
+		case 2: {  /* busypoll */
+			err = setbusypoll(L, (uv_handle_t *)lcu_ud2hdl(tcp), 3);
+		}; break;
 		default: return 0;
 	}
 	return lcuL_pushresults(L, 0, err);
@@ -1438,7 +1474,7 @@ static int tcp_connect (lua_State *L) {
 	lcu_TcpSocket *tcp = openedtcp(L, LCU_TCPACTIVECLS);
 	uv_tcp_t *handle = lcu_ud2hdl(tcp);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setuptcpconn, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_CONNECT, sched, k_setuptcpconn, NULL, NULL);
 }
 
 
@@ -1546,7 +1582,7 @@ static int pipe_connect (lua_State *L) {
 	lcu_PipeSocket *pipe = openedpipe(L, toclass(L));
 	uv_pipe_t *handle = lcu_ud2hdl(pipe);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
-	return lcuT_resetcoreqk(L, sched, k_setuppipeconn, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_CONNECT, sched, k_setuppipeconn, NULL, NULL);
 }
 
 
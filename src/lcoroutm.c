@@ -6,11 +6,15 @@
 #include "lchaux.h"
 
 #include <luamem.h>
+#include <limits.h>
 
 
 typedef struct StateCoro {
 	lua_CFunction results;
 	lua_CFunction cancel;
+	int anchor;
+	int priority;
+	uint64_t started;
 	uv_work_t work;
 	lua_State *L;
 } StateCoro;
@@ -119,6 +123,44 @@ static int coroutine_status(lua_State *L) {
 }
 
 
+static int warmstates_gc (lua_State *L) {
+	lcu_WarmStates **ref = (lcu_WarmStates **)lua_touserdata(L, 1);
+	if (*ref) {
+		lcuL_freewarmstates(*ref);
+		*ref = NULL;
+	}
+	return 0;
+}
+
+/* true [, errmsg] = coroutine.warmstates([size [, refill]]) */
+static int coroutine_warmstates (lua_State *L) {
+	lua_Integer size = luaL_optinteger(L, 1, 0);
+	lua_Integer refill = luaL_optinteger(L, 2, size);
+	lcu_WarmStates **ref;
+	int err = 0;
+	luaL_argcheck(L, size >= 0, 1, "size cannot be negative");
+	luaL_argcheck(L, refill >= 0, 2, "refill cannot be negative");
+	lua_settop(L, 2);
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_WARMSTATESREGKEY);
+	ref = (lcu_WarmStates **)lua_touserdata(L, 3);
+	if (ref == NULL) {
+		if (size == 0) return lcuL_pushresults(L, 0, 0);
+		ref = (lcu_WarmStates **)lua_newuserdatauv(L, sizeof(lcu_WarmStates *), 0);
+		*ref = NULL;
+		lcuL_setfinalizer(L, warmstates_gc);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_WARMSTATESREGKEY);
+	}
+	if (*ref == NULL) {
+		void *allocud;
+		lua_Alloc allocf = lcuL_getallocf(L, &allocud);
+		err = lcuL_newwarmstates(ref, allocf, allocud);
+	}
+	if (!err) err = lcuL_setwarmstates(*ref, size < INT_MAX ? (int)size : INT_MAX,
+	                                         refill < INT_MAX ? (int)refill : INT_MAX);
+	return lcuL_pushresults(L, 0, err);
+}
+
+
 /* succ [, errmsg] = system.resume(coroutine) */
 static int returnvalues (lua_State *L) {
 	return lua_gettop(L)-1;  /* return all except the coroutine (arg #1) */
@@ -243,6 +285,7 @@ LCUMOD_API int luaopen_coutil_coroutine (lua_State *L) {
 		{"loadfile", coroutine_loadfile},
 		{"close", coroutine_close},
 		{"status", coroutine_status},
+		{"warmstates", coroutine_warmstates},
 		{NULL, NULL}
 	};
 	(void)lcuTY_tostdiofd(L);  /* must be available to be copied to new threads */
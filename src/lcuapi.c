@@ -0,0 +1,172 @@
+#define LUA_LIB
+
+#include "lmodaux.h"
+#include "loperaux.h"
+
+#include <string.h>
+#include <luamem.h>
+
+
+LCULIB_API int lcu_apiversion (void) {
+	return LCU_APIVERSION;
+}
+
+static lcu_Scheduler *pushsched (lua_State *L) {
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_SCHEDULERREGKEY) != LUA_TUSERDATA)
+		luaL_error(L, "module 'coutil.system' not loaded");
+	return (lcu_Scheduler *)lua_touserdata(L, -1);
+}
+
+LCULIB_API lcu_Scheduler *lcu_checkscheduler (lua_State *L) {
+	lcu_Scheduler *sched = pushsched(L);
+	lua_pop(L, 1);  /* kept alive by the registry */
+	return sched;
+}
+
+LCULIB_API uv_loop_t *lcu_schedloop (lcu_Scheduler *sched) {
+	return lcu_toloop(sched);
+}
+
+
+/*
+ * request operations
+ */
+
+LCULIB_API int lcu_awaitreq (lua_State *L,
+                             lcu_Scheduler *sched,
+                             uv_req_type type,
+                             lcu_RequestSetup setup,
+                             lua_CFunction results,
+                             lua_CFunction cancel) {
+	return lcuT_resetcoreqk(L, type, sched, setup, results, cancel);
+}
+
+LCULIB_API void lcu_armreq (lua_State *L,
+                            uv_loop_t *loop,
+                            lcu_Operation *op,
+                            int err) {
+	lcuT_armcoreq(L, loop, op, err);
+}
+
+LCULIB_API lua_State *lcu_endreq (uv_loop_t *loop, uv_req_t *request) {
+	return lcuU_endcoreq(loop, request);
+}
+
+LCULIB_API void lcu_resumereq (uv_loop_t *loop, uv_req_t *request, int narg) {
+	lcuU_resumecoreq(loop, request, narg);
+}
+
+
+/*
+ * handle operations
+ */
+
+LCULIB_API int lcu_awaithdl (lua_State *L,
+                             lcu_Scheduler *sched,
+                             uv_handle_type type,
+                             lcu_HandleSetup setup,
+                             lua_CFunction results,
+                             lua_CFunction cancel) {
+	return lcuT_resetcohdlk(L, type, sched, setup, results, cancel);
+}
+
+LCULIB_API int lcu_armhdl (lua_State *L, lcu_Operation *op, int err) {
+	return lcuT_armcohdl(L, op, err);
+}
+
+LCULIB_API int lcu_endhdl (uv_handle_t *handle) {
+	return lcuU_endcohdl(handle);
+}
+
+LCULIB_API void lcu_resumehdl (uv_handle_t *handle, int narg) {
+	lcuU_resumecohdl(handle, narg);
+}
+
+
+/*
+ * work functions
+ */
+
+typedef struct WorkRequest {
+	uv_work_t work;
+	lcu_WorkFunction func;
+	lua_Integer result;
+	int nvalues;
+	lcu_WorkValue values[LCU_WORKMAXARGS];
+} WorkRequest;
+
+/* fails to compile if 'LCU_WORKMAXARGS' does not fit in an operation */
+typedef char WorkRequestFits[sizeof(WorkRequest) <= sizeof(union uv_any_req) ? 1 : -1];
+
+static void dowork (uv_work_t *work) {
+	WorkRequest *workreq = (WorkRequest *)work;
+	workreq->result = workreq->func(workreq->values, workreq->nvalues);
+}
+static void uv_onworked (uv_work_t *work, int err) {
+	WorkRequest *workreq = (WorkRequest *)work;
+	uv_loop_t *loop = work->loop;
+	uv_req_t *request = (uv_req_t *)work;
+	lua_State *thread = lcuU_endcoreq(loop, request);
+	if (thread) {
+		lua_pushinteger(thread, err < 0 ? err : workreq->result);
+		lcuU_resumecoreq(loop, request, 1);
+	}
+}
+static int returnworked (lua_State *L) {
+	lua_Integer result = lua_tointeger(L, -1);
+	if (result < 0) return lcuL_pusherrres(L, (int)result);
+	return 1;
+}
+static int cancelwork (lua_State *L) {
+	int i, n = (int)lua_rawlen(L, lua_upvalueindex(3));
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_pushvalue(L, i);
+		lua_rawseti(L, -2, i);
+	}
+	lcu_setopvalue(L, lcu_getsched(L));  /* keep buffers while the work runs */
+	return 1;
+}
+static int k_setupwork (lua_State *L,
+                        uv_req_t *request,
+                        uv_loop_t *loop,
+                        lcu_Operation *op) {
+	WorkRequest *workreq = (WorkRequest *)request;
+	const char *format = lua_tostring(L, lua_upvalueindex(3));
+	int i, err;
+	for (i = 0; format[i]; i++) {
+		lcu_WorkValue *value = &workreq->values[i];
+		switch (format[i]) {
+			case 'i': value->integer = luaL_checkinteger(L, i+1); break;
+			case 'n': value->number = luaL_checknumber(L, i+1); break;
+			case 's': value->buffer.data = (char *)luamem_checkarray(L, i+1,
+			                                                          &value->buffer.size); break;
+			case 'b': value->buffer.data = luamem_checkmemory(L, i+1,
+			                                                  &value->buffer.size); break;
+		}
+	}
+	workreq->nvalues = i;
+	workreq->func = (lcu_WorkFunction)lua_touserdata(L, lua_upvalueindex(2));
+	err = uv_queue_work(loop, &workreq->work, dowork, uv_onworked);
+	lcuT_armcoreq(L, loop, op, err);
+	if (err < 0) return lcuL_pusherrres(L, err);
+	return -1;  /* yield on success */
+}
+static int callwork (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	lua_settop(L, (int)lua_rawlen(L, lua_upvalueindex(3)));
+	/* 'UV_UNKNOWN_REQ' gets the size of the largest request */
+	return lcuT_resetcoreqk(L, UV_UNKNOWN_REQ, sched, k_setupwork, returnworked, cancelwork);
+}
+
+LCULIB_API void lcu_pushworkf (lua_State *L,
+                               lcu_WorkFunction func,
+                               const char *format) {
+	size_t len = strlen(format);
+	if (len > LCU_WORKMAXARGS) luaL_error(L, "too many work arguments");
+	if (strspn(format, "insb") != len) luaL_error(L, "invalid work format");
+	(void)pushsched(L);
+	lua_pushlightuserdata(L, (void *)func);
+	lua_pushstring(L, format);
+	lua_pushcclosure(L, callwork, 3);
+}
@@ -13,6 +13,14 @@
 #define LCULIB_API LUALIB_API
 #endif
 
+#ifndef LCUI_DDEC
+#define LCUI_DDEC(dec)	LCUI_FUNC dec
+#endif
+
+#ifndef LCUI_DDEF
+#define LCUI_DDEF	/* empty */
+#endif
+
 #ifndef LCUMOD_API
 #define LCUMOD_API LUAMOD_API
 #endif
@@ -33,6 +41,46 @@
 #define LCU_EXECARGCOUNT	255
 #endif
 
+#ifndef LCU_ANCHORCHUNK
+#define LCU_ANCHORCHUNK	8192
+#endif
+
+#ifndef LCU_WHEELTICKMS
+#define LCU_WHEELTICKMS	10
+#endif
+
+#ifndef LCU_STALLLOGSIZE
+#define LCU_STALLLOGSIZE	32
+#endif
+
+#ifndef LCU_TRACERINGSIZE
+#define LCU_TRACERINGSIZE	4096
+#endif
+
+#ifndef LCU_PROFSTACKSIZE
+#define LCU_PROFSTACKSIZE	2048
+#endif
+
+#ifndef LCU_PROFMAXDEPTH
+#define LCU_PROFMAXDEPTH	64
+#endif
+
+#ifndef LCU_PROFHOOKCOUNT
+#define LCU_PROFHOOKCOUNT	1000
+#endif
+
+#ifndef LCU_ARENASLABSIZE
+#define LCU_ARENASLABSIZE	65536
+#endif
+
+#ifndef LCU_ARENAMAXSMALL
+#define LCU_ARENAMAXSMALL	512
+#endif
+
+#ifndef LCU_TPOOLLOCALRUNS
+#define LCU_TPOOLLOCALRUNS	61
+#endif
+
 #ifndef LCU_NETHOSTNAMESZ
 #ifndef NI_MAXHOST
 #define LCU_NETHOSTNAMESZ	1025
@@ -61,8 +109,23 @@
 #endif
 
 
+#if defined(LCU_USDT)
+#include <sys/sdt.h>
+#define lcu_probe2(N,A,B)	DTRACE_PROBE2(coutil, N, A, B)
+#define lcu_probe3(N,A,B,C)	DTRACE_PROBE3(coutil, N, A, B, C)
+#else
+#define lcu_probe2(N,A,B)	((void)0)
+#define lcu_probe3(N,A,B,C)	((void)0)
+#endif
+
+
 #if !defined(lcu_log)
-#define lcu_log(O,L,M)	((void)(O),(void)(L),(void)(M))
+#include "ltraceaux.h"
+#if defined(LCU_USDT)
+#define lcu_log(O,L,M)	do { lcu_probe3(log, O, L, M); lcuTR_trace(O,L,M); } while (0)
+#else
+#define lcu_log(O,L,M)	lcuTR_trace(O,L,M)
+#endif
 #endif
 
 
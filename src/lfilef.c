@@ -628,7 +628,7 @@ static int yieldfileinfo (lua_State *L) {
 	int bits = lua_tointeger(L, 3);
 	if (bits&INFO_SRCMASK) {
 		lcu_Scheduler *sched = lcu_getsched(L);
-		return lcuT_resetcoreqk(L, sched, k_setupfileinfo, returnfileinfo, NULL);
+		return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfileinfo, returnfileinfo, NULL);
 	}
 	return lua_gettop(L)-4;
 }
@@ -726,7 +726,7 @@ static int system_touchfile (lua_State *L) {
 	lua_pushinteger(L, bits);
 	lua_pushnumber(L, atime);
 	lua_pushnumber(L, mtime);
-	return lcuT_resetcoreqk(L, sched, k_setupfiletouch, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfiletouch, returntrueover1, NULL);
 }
 
 
@@ -766,7 +766,7 @@ static int system_ownfile (lua_State *L) {
 	}
 	lua_settop(L, 3);
 	lua_pushinteger(L, bits);
-	return lcuT_resetcoreqk(L, sched, k_setupfileown, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfileown, returntrueover1, NULL);
 }
 
 
@@ -796,7 +796,7 @@ static int system_grantfile (lua_State *L) {
 	}
 	lua_settop(L, 1);
 	lua_pushinteger(L, perm);
-	return lcuT_resetcoreqk(L, sched, k_setupfilegrant, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfilegrant, returntrueover1, NULL);
 }
 
 
@@ -842,7 +842,7 @@ static int system_linkfile (lua_State *L) {
 	lua_settop(L, 2);
 	if (bits&MKLNK_SYMBOLIC) lua_pushinteger(L, flags);
 	else lua_pushnil(L);
-	return lcuT_resetcoreqk(L, sched, k_setupmklnk, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupmklnk, returntrueover1, NULL);
 }
 
 
@@ -870,7 +870,7 @@ static int system_movefile (lua_State *L) {
 		int err = uv_fs_rename(loop, &filereq, src, dst, NULL);
 		return lcuL_pushresults(L, 0, err);
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupmvfile, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupmvfile, returntrueover1, NULL);
 }
 
 
@@ -913,7 +913,7 @@ static int system_copyfile (lua_State *L) {
 	}
 	lua_settop(L, 2);
 	lua_pushinteger(L, flags);
-	return lcuT_resetcoreqk(L, sched, k_setupcpfile, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupcpfile, returntrueover1, NULL);
 }
 
 
@@ -953,7 +953,7 @@ static int system_removefile (lua_State *L) {
 	}
 	lua_settop(L, 1);
 	lua_pushboolean(L, bits&RMFILE_DIRECTORY);
-	return lcuT_resetcoreqk(L, sched, k_setuprmfile, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setuprmfile, returntrueover1, NULL);
 }
 
 
@@ -1065,7 +1065,7 @@ static int system_maketemp (lua_State *L) {
 		lua_pushlightuserdata(L, &filereq);
 		return returnmktmp(L);
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupmktmp, returnmktmp, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupmktmp, returnmktmp, NULL);
 }
 
 
@@ -1097,12 +1097,15 @@ static int system_makedir (lua_State *L) {
 		int err = uv_fs_mkdir(loop, &filereq, path, perm, NULL);
 		return lcuL_pushresults(L, 0, err);
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupmkdir, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupmkdir, returntrueover1, NULL);
 }
 
 typedef struct DirectoryList {
 	lua_CFunction results;
 	lua_CFunction cancel;
+	int anchor;
+	int priority;
+	uint64_t started;
 	uv_fs_t filereq;
 } DirectoryList;
 
@@ -1280,7 +1283,7 @@ static int system_openfile (lua_State *L) {
 	}
 	lua_pushinteger(L, flags);
 	lua_pushinteger(L, perm);
-	return lcuT_resetcoreqk(L, sched, k_setupfile, returnopenfile, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfile, returnopenfile, NULL);
 }
 
 #define checkfile(L)	((uv_file *)luaL_checkudata(L, 1, LCU_FILECLS))
@@ -1337,7 +1340,7 @@ static int file_close (lua_State *L) {
 		lua_pushboolean(L, 1);
 		return 1;
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupclosef, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupclosef, returntrueover1, NULL);
 }
 
 /* bytes [, err] = file:read(buffer [, i [, j [, offset [, mode]]]]) */
@@ -1373,7 +1376,7 @@ static int file_read (lua_State *L) {
 		lua_pushinteger(L, filereq.result);
 		return 1;
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupreadfile, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupreadfile, NULL, NULL);
 }
 
 /* bytes [, err] = file:write(data [, i [, j [, offset [, mode]]]]) */
@@ -1417,7 +1420,7 @@ static int file_write (lua_State *L) {
 		lua_pushinteger(L, filereq.result);
 		return 1;
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupwritefile, NULL, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupwritefile, NULL, NULL);
 }
 
 /* true = file:resize (length [, mode]) */
@@ -1444,7 +1447,7 @@ static int file_resize (lua_State *L) {
 		int err = uv_fs_ftruncate(loop, &filereq, file, length, NULL);
 		return lcuL_pushresults(L, 0, err);
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupfresize, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfresize, returntrueover1, NULL);
 }
 
 /* true = file:flush ([mode]) */
@@ -1482,7 +1485,7 @@ static int file_flush (lua_State *L) {
 	}
 	lua_settop(L, 1);
 	lua_pushboolean(L, bits&FLUSH_DATAONLY);
-	return lcuT_resetcoreqk(L, sched, k_setupfobjflush, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfobjflush, returntrueover1, NULL);
 }
 
 /* ... = file:info(mode) */
@@ -1523,7 +1526,7 @@ static int file_info (lua_State *L) {
 		return lua_gettop(L)-2;
 	}
 	lua_pushlightuserdata(L, (void *)mode);
-	return lcuT_resetcoreqk(L, sched, k_setupfobjinfo, returnfobjinfo, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfobjinfo, returnfobjinfo, NULL);
 }
 
 /* true = file:touch ([mode, times...]) */
@@ -1556,7 +1559,7 @@ static int file_touch (lua_State *L) {
 	lua_settop(L, 1);
 	lua_pushnumber(L, atime);
 	lua_pushnumber(L, mtime);
-	return lcuT_resetcoreqk(L, sched, k_setupfobjtouch, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfobjtouch, returntrueover1, NULL);
 }
 
 /* true = file:own (user, group [, mode]) */
@@ -1585,7 +1588,7 @@ static int file_own (lua_State *L) {
 		int err = uv_fs_fchown(loop, &filereq, file, uid, gid, NULL);
 		return lcuL_pushresults(L, 0, err);
 	}
-	return lcuT_resetcoreqk(L, sched, k_setupfobjown, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfobjown, returntrueover1, NULL);
 }
 
 /* true = file:grant (perm [, mode]) */
@@ -1614,7 +1617,7 @@ static int file_grant (lua_State *L) {
 	}
 	lua_settop(L, 1);
 	lua_pushinteger(L, perm);
-	return lcuT_resetcoreqk(L, sched, k_setupfobjgrant, returntrueover1, NULL);
+	return lcuT_resetcoreqk(L, UV_FS, sched, k_setupfobjgrant, returntrueover1, NULL);
 }
 
 
@@ -254,7 +254,7 @@ static int system_random (lua_State *L) {
 		return lcuL_pushresults(L, 1, err);
 	} else {
 		lcu_Scheduler *sched = lcu_getsched(L);
-		return lcuT_resetcoreqk(L, sched, k_setuprand, returnrand, NULL);
+		return lcuT_resetcoreqk(L, UV_RANDOM, sched, k_setuprand, returnrand, NULL);
 	}
 }
 
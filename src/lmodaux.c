@@ -1,6 +1,10 @@
 #include "lmodaux.h"
+#include "lchaux.h"
+#include "larenaux.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <lualib.h>
 #include <luamem.h>
 
@@ -122,11 +126,60 @@ static const luaL_Reg stdlibs[] = {
 	{NULL, NULL}
 };
 
-static int writer (lua_State *L, const void *b, size_t size, void *B) {
-	(void)L;
-	luaL_addlstring((luaL_Buffer *) B, (const char *)b, size);
+typedef struct DumpWriter {
+	int init;
+	luaL_Buffer b;
+} DumpWriter;
+
+static int writer (lua_State *L, const void *b, size_t size, void *ud) {
+	DumpWriter *dump = (DumpWriter *)ud;
+	if (!dump->init) {  /* as in 'string.dump', buffer goes above the function */
+		dump->init = 1;
+		luaL_buffinit(L, &dump->b);
+	}
+	luaL_addlstring(&dump->b, (const char *)b, size);
 	return 0;
-};
+}
+
+/* dumps functions of 'package.preload' not dumped yet, which are kept in a
+   table of weak keys so replaced or removed functions are discarded */
+static void dumppreload (lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_PRELOADDUMPSREGKEY) == LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_PRELOADDUMPSREGKEY);
+	}
+	lua_pushnil(L);  /* first key */
+	while (lua_next(L, -3) != 0) {
+		if (lua_type(L, -1) == LUA_TFUNCTION && !lua_iscfunction(L, -1)) {
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, -4) == LUA_TNIL) {
+				DumpWriter dump;
+				dump.init = 0;
+				lua_pushvalue(L, -2);
+				if (lua_dump(L, writer, &dump, 0) == 0 && dump.init) {
+					luaL_pushresult(&dump.b);  /* replaces the buffer */
+					lua_remove(L, -2);  /* remove function copy */
+					lua_pushvalue(L, -3);  /* function as key */
+					lua_insert(L, -2);
+					lua_rawset(L, -6);
+				} else {
+					if (dump.init) luaL_pushresult(&dump.b);
+					lua_pop(L, 1+dump.init);
+				}
+			}
+			lua_pop(L, 1);  /* remove dump or 'nil' */
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);  /* remove 'LUA_PRELOAD_TABLE' and dumps */
+}
 
 static void copylightud (lua_State *L, lua_State *NL, const void *field) {
 	if (lua_getfield(L, LUA_REGISTRYINDEX, field) != LUA_TNIL) {
@@ -141,7 +194,6 @@ static void warnf (void *ud, const char *message, int tocont);
 
 static int initluastate (lua_State *NL) {
 	const luaL_Reg *lib;
-	lua_State *L = lua_touserdata(NL, 1);
 	int *warnstate = (int *)lua_newuserdatauv(NL, sizeof(int), 0);
 	*warnstate = 0;  /* default is warnings off */
 	luaL_ref(NL, LUA_REGISTRYINDEX);  /* make sure it won't be collected */
@@ -150,18 +202,28 @@ static int initluastate (lua_State *NL) {
 	lua_settop(NL, 0);
 	lua_newthread(NL);  /* thread to be used to execute code */
 
-	copylightud(L, NL, LCU_CHANNELSREGKEY);  /* copy channel map reference */
-	copylightud(L, NL, LCU_STDIOFDREGKEY);  /* copy duplicated stdio files */
-
 	luaL_requiref(NL, LUA_LOADLIBNAME, luaopen_package, 0);
 	luaL_getsubtable(NL, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
-	lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
 
 	/* add standard libraries to 'package.preload' */
 	for (lib = stdlibs; lib->func; lib++) {
 		lua_pushcfunction(NL, lib->func);
 		lua_setfield(NL, -2, lib->name);
 	}
+	lua_pop(NL, 2);  /* remove 'package' and 'LUA_PRELOAD_TABLE' */
+
+	return 1;  /* return the thread to be used to execute code */
+}
+
+static int copyparent (lua_State *NL) {
+	lua_State *L = lua_touserdata(NL, 1);
+
+	copylightud(L, NL, LCU_CHANNELSREGKEY);  /* copy channel map reference */
+	copylightud(L, NL, LCU_STDIOFDREGKEY);  /* copy duplicated stdio files */
+
+	luaL_getsubtable(NL, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_PRELOADDUMPSREGKEY);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
 
 	/* copy 'package.preload' */
 	lua_pushnil(L);  /* first key */
@@ -174,55 +236,210 @@ static int initluastate (lua_State *NL) {
 				lua_CFunction loader = lua_tocfunction(L, -1);
 				lua_pushcfunction(NL, loader);
 			} else {
-				luaL_Buffer b;
-				int err;
-				luaL_buffinit(NL, &b);
-				err = lua_dump(L, writer, &b, 0);
-				luaL_pushresult(&b);
-				if (err) {
-					lua_pop(NL, 1);
-					lua_pushnil(NL);
-				} else {
+				lua_pushvalue(L, -1);
+				if (lua_rawget(L, -5) == LUA_TSTRING) {
 					size_t l;
-					const char *bytecodes = lua_tolstring(NL, -1, &l);
+					const char *bytecodes = lua_tolstring(L, -1, &l);
 					int status = luaL_loadbufferx(NL, bytecodes, l, NULL, "b");
 					lcu_assert(status == LUA_OK);
-					lua_remove(NL, -2);
+				} else {
+					lua_pushnil(NL);
 				}
+				lua_pop(L, 1);
 			}
 			lua_settable(NL, -3);
 		}
 		lua_pop(L, 1);
 	}
-	lua_pop(NL, 2);  /* remove 'package' and 'LUA_PRELOAD_TABLE' */
-	lua_pop(L, 1);  /* remove 'LUA_PRELOAD_TABLE' */
+	lua_pop(NL, 1);  /* remove 'LUA_PRELOAD_TABLE' */
+	lua_pop(L, 2);  /* remove 'LUA_PRELOAD_TABLE' and dumps */
 
-	return 1;  /* return the thread to be used to execute code */
+	return 0;
 }
 
-LCUI_FUNC lua_State *lcuL_newstate (lua_State *L) {
-	void *allocud;
-	lua_Alloc allocf = lua_getallocf(L, &allocud);
-	lua_CFunction panic = lua_atpanic(L, NULL);  /* changes panic function */
-	lua_State *NL = lua_newstate(allocf, allocud);
-	int status;
+static void raisenewerr (lua_State *L, lua_State *NL) {
+	if (lcuL_pushfrom(NULL, L, NL, -1, "error") != LUA_OK) {
+		lcu_log(NULL, L, "failure: unable copy error of a new Lua state!");
+		lcuL_warnmsg(L, "discarded error", lua_tostring(NL, -1));
+	}
+	lua_close(NL);
+	lua_error(L);
+}
 
+static lua_State *setupstate (lua_State *L, lua_State *NL) {
+	lua_CFunction panic = lua_atpanic(L, NULL);  /* changes panic function */
 	lua_atpanic(L, panic);  /* restore panic function */
 	lua_atpanic(NL, panic);
 
-	lua_pushcfunction(NL, initluastate);
+	lua_pushcfunction(NL, copyparent);
 	lua_pushlightuserdata(NL, L);
-	status = lua_pcall(NL, 1, 1, 0);
-	if (status != LUA_OK) {
-		if (lcuL_pushfrom(NULL, L, NL, -1, "error") != LUA_OK) {
-			lcu_log(NULL, L, "failure: unable copy error of a new Lua state!");
-			lcuL_warnmsg(L, "discarded error", lua_tostring(NL, -1));
-		}
+	if (lua_pcall(NL, 1, 0, 0) != LUA_OK) raisenewerr(L, NL);
+
+	return lua_tothread(NL, 1);  /* returns the thread instead of the created state */
+}
+
+static lua_State *newstate (lua_State *L, lua_Alloc allocf, void *allocud) {
+	lua_State *NL = lua_newstate(allocf, allocud);
+	if (NL == NULL) lcu_error(L, UV_ENOMEM);
+	lua_pushcfunction(NL, initluastate);
+	if (lua_pcall(NL, 0, 1, 0) != LUA_OK) raisenewerr(L, NL);
+	return setupstate(L, NL);
+}
+
+struct lcu_WarmStates {
+	lua_Alloc allocf;
+	void *allocud;
+	uv_mutex_t mutex;
+	uv_cond_t onneed;
+	int size;  /* maximum number of warm states, or -1 when freed */
+	int refill;  /* refill once less than this number of warm states are left */
+	int count;  /* number of states in 'states' */
+	int filling;  /* 'filler' shall create states up to 'size' */
+	int started;  /* 'filler' was created */
+	uv_thread_t filler;
+	lcu_StateQ states;  /* initialized states not used yet */
+};
+
+static lua_State *newbarestate (lua_Alloc allocf, void *allocud) {
+	lua_State *NL = lua_newstate(allocf, allocud);
+	if (NL == NULL) return NULL;
+	lua_pushcfunction(NL, initluastate);
+	if (lua_pcall(NL, 0, 1, 0) != LUA_OK) {
 		lua_close(NL);
-		lua_error(L);
+		return NULL;
 	}
+	return lua_tothread(NL, 1);
+}
 
-	return lua_tothread(NL, 1);  /* returns the thread instead of the created state */
+static void closestates (lcu_StateQ *queue) {
+	lua_State *L;
+	while ((L = lcuCS_dequeuestateq(queue))) lua_close(lcuL_tomain(L));
+}
+
+static void fillwarmstates (void *arg) {
+	lcu_WarmStates *warm = (lcu_WarmStates *)arg;
+	uv_mutex_lock(&warm->mutex);
+	while (warm->size >= 0) {
+		if (warm->filling && warm->count < warm->size) {
+			lua_State *L;
+			uv_mutex_unlock(&warm->mutex);
+			L = newbarestate(warm->allocf, warm->allocud);
+			uv_mutex_lock(&warm->mutex);
+			if (L == NULL) {
+				warm->filling = 0;  /* try again when more states are needed */
+			} else if (warm->count < warm->size) {
+				lcuCS_enqueuestateq(&warm->states, L);
+				warm->count++;
+			} else {
+				lua_close(lcuL_tomain(L));
+			}
+		} else {
+			warm->filling = 0;
+			uv_cond_wait(&warm->onneed, &warm->mutex);
+		}
+	}
+	uv_mutex_unlock(&warm->mutex);
+	lcuAR_releasethread();
+}
+
+static void checkrefill_mx (lcu_WarmStates *warm) {
+	if (!warm->filling && warm->count < warm->refill) {
+		warm->filling = 1;
+		uv_cond_signal(&warm->onneed);
+	}
+}
+
+LCUI_FUNC int lcuL_newwarmstates (lcu_WarmStates **ref,
+                                  lua_Alloc allocf,
+                                  void *allocud) {
+	int err;
+	lcu_WarmStates *warm = (lcu_WarmStates *)allocf(allocud, NULL, 0,
+	                                               sizeof(lcu_WarmStates));
+	if (warm == NULL) return UV_ENOMEM;
+	err = uv_mutex_init(&warm->mutex);
+	if (err) goto mutex_err;
+	err = uv_cond_init(&warm->onneed);
+	if (err) goto cond_err;
+	warm->allocf = allocf;
+	warm->allocud = allocud;
+	warm->size = 0;
+	warm->refill = 0;
+	warm->count = 0;
+	warm->filling = 0;
+	warm->started = 0;
+	lcuCS_initstateq(&warm->states);
+	*ref = warm;
+	return 0;
+
+	cond_err:
+	uv_mutex_destroy(&warm->mutex);
+	mutex_err:
+	allocf(allocud, warm, sizeof(lcu_WarmStates), 0);
+	return err;
+}
+
+LCUI_FUNC void lcuL_freewarmstates (lcu_WarmStates *warm) {
+	uv_mutex_lock(&warm->mutex);
+	warm->size = -1;
+	uv_cond_signal(&warm->onneed);
+	uv_mutex_unlock(&warm->mutex);
+	if (warm->started) uv_thread_join(&warm->filler);
+	closestates(&warm->states);
+	uv_cond_destroy(&warm->onneed);
+	uv_mutex_destroy(&warm->mutex);
+	warm->allocf(warm->allocud, warm, sizeof(lcu_WarmStates), 0);
+}
+
+LCUI_FUNC int lcuL_setwarmstates (lcu_WarmStates *warm, int size, int refill) {
+	lcu_StateQ extra;
+	int err = 0;
+	lcuCS_initstateq(&extra);
+	uv_mutex_lock(&warm->mutex);
+	if (size > 0 && !warm->started) {
+		err = uv_thread_create(&warm->filler, fillwarmstates, warm);
+		if (err) size = 0;
+		else warm->started = 1;
+	}
+	warm->size = size;
+	warm->refill = refill < size ? refill : size;
+	for (; warm->count > size; warm->count--)
+		lcuCS_enqueuestateq(&extra, lcuCS_dequeuestateq(&warm->states));
+	if (size > warm->count) {  /* warm-up */
+		warm->filling = 1;
+		uv_cond_signal(&warm->onneed);
+	}
+	uv_mutex_unlock(&warm->mutex);
+	closestates(&extra);
+	return err;
+}
+
+LCUI_FUNC lua_State *lcuL_newstatew (lua_State *L, lcu_WarmStates *warm) {
+	lua_State *NL;
+	dumppreload(L);
+	uv_mutex_lock(&warm->mutex);
+	NL = lcuCS_dequeuestateq(&warm->states);
+	if (NL) warm->count--;
+	checkrefill_mx(warm);
+	uv_mutex_unlock(&warm->mutex);
+	if (NL == NULL) return newstate(L, warm->allocf, warm->allocud);
+	return setupstate(L, lcuL_tomain(NL));
+}
+
+LCUI_FUNC lua_State *lcuL_newstate (lua_State *L) {
+	void *allocud;
+	lua_Alloc allocf = lcuL_getallocf(L, &allocud);
+	lcu_WarmStates **ref;
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_WARMSTATESREGKEY);
+	ref = (lcu_WarmStates **)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (ref && *ref && (*ref)->allocf == allocf && (*ref)->allocud == allocud)
+		return lcuL_newstatew(L, *ref);
+	return lcuL_newstatef(L, allocf, allocud);
+}
+
+LCUI_FUNC lua_State *lcuL_newstatef (lua_State *L, lua_Alloc allocf, void *allocud) {
+	dumppreload(L);
+	return newstate(L, allocf, allocud);
 }
 
 LCUI_FUNC lua_State *lcuL_tomain (lua_State *L) {
@@ -234,6 +451,57 @@ LCUI_FUNC lua_State *lcuL_tomain (lua_State *L) {
 	return main;
 }
 
+static void *accountalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+	lcu_MemAccount *account = (lcu_MemAccount *)ud;
+	size_t used = ptr ? osize : 0;
+	void *block;
+	if (nsize > used && account->bytes-used+nsize > account->limit)
+		return NULL;  /* Lua collects garbage and tries again, or raises an error */
+	block = account->allocf(account->allocud, ptr, osize, nsize);
+	if (block || nsize == 0) {
+		account->bytes = account->bytes-used+nsize;
+		if (ptr == NULL && nsize > 0) account->count++;
+	}
+	return block;
+}
+
+LCUI_FUNC int lcuL_setmemaccount (lua_State *L, size_t limit) {
+	void *allocud;
+	lua_Alloc allocf = lua_getallocf(L, &allocud);
+	lcu_MemAccount *account;
+	lcu_assert(allocf != accountalloc);
+	account = (lcu_MemAccount *)allocf(allocud, NULL, 0, sizeof(lcu_MemAccount));
+	if (account == NULL) return UV_ENOMEM;
+	account->allocf = allocf;
+	account->allocud = allocud;
+	account->limit = limit;
+	account->bytes = (size_t)lua_gc(L, LUA_GCCOUNT)*1024+lua_gc(L, LUA_GCCOUNTB);
+	account->count = 0;
+	account->reported = 0;
+	account->counted = 0;
+	lua_setallocf(L, accountalloc, account);
+	return 0;
+}
+
+LCUI_FUNC lcu_MemAccount *lcuL_tomemaccount (lua_State *L) {
+	void *allocud;
+	lua_Alloc allocf = lua_getallocf(L, &allocud);
+	return allocf == accountalloc ? (lcu_MemAccount *)allocud : NULL;
+}
+
+LCUI_FUNC lua_Alloc lcuL_getallocf (lua_State *L, void **allocud) {
+	lcu_MemAccount *account = lcuL_tomemaccount(L);
+	if (account == NULL) return lua_getallocf(L, allocud);
+	*allocud = account->allocud;
+	return account->allocf;
+}
+
+LCUI_FUNC void lcuL_closestate (lua_State *L) {
+	lcu_MemAccount *account = lcuL_tomemaccount(L);
+	lua_close(L);
+	if (account) account->allocf(account->allocud, account, sizeof(lcu_MemAccount), 0);
+}
+
 #define doerrmsg(F,L,I,M,T) (I > 0 ? \
 	F(L, "unable to transfer %s #%d (got %s)", M, I, T) : \
 	F(L, "unable to transfer %s (got %s)", M, T))
@@ -369,6 +637,75 @@ LCUI_FUNC void lcuM_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 }
 
 
+/*
+ * Usage accounting
+ */
+
+LCUI_FUNC uint64_t lcuL_cputime (void) {
+	uv_rusage_t rusage;
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return (uint64_t)ts.tv_sec*1000000000+(uint64_t)ts.tv_nsec;
+#endif
+	if (uv_getrusage(&rusage)) return 0;  /* whole process as a fallback */
+	return ((uint64_t)rusage.ru_utime.tv_sec+(uint64_t)rusage.ru_stime.tv_sec)*1000000000
+	     + ((uint64_t)rusage.ru_utime.tv_usec+(uint64_t)rusage.ru_stime.tv_usec)*1000;
+}
+
+LCUI_FUNC lcu_Usage *lcuL_getusage (lua_State *L, int idx, int create) {
+	lcu_Usage *usage = NULL;
+	idx = lua_absindex(L, idx);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY) == LUA_TTABLE) {
+		lua_pushvalue(L, idx);
+		if (lua_rawget(L, -2) == LUA_TUSERDATA) usage = (lcu_Usage *)lua_touserdata(L, -1);
+		else if (create) {
+			usage = (lcu_Usage *)lua_newuserdatauv(L, sizeof(lcu_Usage), 0);
+			memset(usage, 0, sizeof(lcu_Usage));
+			lua_pushvalue(L, idx);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, -5);
+			lua_pop(L, 1);  /* discard new usage */
+		}
+		lua_pop(L, 1);  /* discard usage or nil */
+	}
+	lua_pop(L, 1);  /* discard usage table */
+	return usage;
+}
+
+static int newusage (lua_State *L) {
+	lcuL_getusage(L, 1, 1);
+	return 0;
+}
+
+LCUI_FUNC void lcuL_addusage (lua_State *L,
+                              lua_State *thread,
+                              int create,
+                              uint64_t wall,
+                              uint64_t cpu) {
+	lcu_Usage *usage;
+	if (!lua_checkstack(L, 4) || (thread != L && !lua_checkstack(thread, 1))) return;
+	if (thread == L) lua_pushthread(L);
+	else {
+		lua_pushthread(thread);
+		lua_xmove(thread, L, 1);
+	}
+	usage = lcuL_getusage(L, -1, 0);
+	if (usage == NULL && create) {
+		lua_pushcfunction(L, newusage);  /* avoid memory errors */
+		lua_pushvalue(L, -2);
+		if (lua_pcall(L, 1, 0, 0) == LUA_OK) usage = lcuL_getusage(L, -1, 0);
+		else lua_pop(L, 1);  /* discard error */
+	}
+	lua_pop(L, 1);  /* discard thread */
+	if (usage) {
+		usage->wall += wall;
+		usage->cpu += cpu;
+		usage->resumes++;
+	}
+}
+
+
 /*
  * Debugging
  */
@@ -13,6 +13,12 @@
 #define LCU_CHANNELTASKREGKEY	LCU_PREFIX"ChannelTask channelTask"
 #define LCU_CHANNELSREGKEY	LCU_PREFIX"ChannelMap channelMap"
 #define LCU_STDIOFDREGKEY	LCU_PREFIX"int stdiofd[3]"
+#define LCU_PRIORITIESREGKEY	LCU_PREFIX"int threadPriorities[]"
+#define LCU_STALLSREGKEY	LCU_PREFIX"StallRecord stallLog[]"
+#define LCU_USAGEREGKEY	LCU_PREFIX"Usage threadUsages[]"
+#define LCU_SCHEDULERREGKEY	LCU_PREFIX"Scheduler scheduler"
+#define LCU_WARMSTATESREGKEY	LCU_PREFIX"WarmStates *warmStates"
+#define LCU_PRELOADDUMPSREGKEY	LCU_PREFIX"string preloadDumps[function]"
 
 
 #define lcu_time2sec(T)	((T).tv_sec+((lua_Number)((T).tv_usec)*1e-6))
@@ -46,8 +52,40 @@ LCUI_FUNC void lcu_pushstrout(lua_State *L, lcu_GetStringFunc getter);
 
 LCUI_FUNC lua_State *lcuL_newstate (lua_State *L);
 
+LCUI_FUNC lua_State *lcuL_newstatef (lua_State *L, lua_Alloc allocf, void *allocud);
+
 LCUI_FUNC lua_State *lcuL_tomain (lua_State *L);
 
+typedef struct lcu_WarmStates lcu_WarmStates;
+
+LCUI_FUNC int lcuL_newwarmstates (lcu_WarmStates **ref,
+                                  lua_Alloc allocf,
+                                  void *allocud);
+
+LCUI_FUNC void lcuL_freewarmstates (lcu_WarmStates *warm);
+
+LCUI_FUNC int lcuL_setwarmstates (lcu_WarmStates *warm, int size, int refill);
+
+LCUI_FUNC lua_State *lcuL_newstatew (lua_State *L, lcu_WarmStates *warm);
+
+typedef struct lcu_MemAccount {
+	lua_Alloc allocf;  /* allocator used to allocate the memory accounted */
+	void *allocud;
+	size_t limit;  /* maximum of 'bytes' */
+	size_t bytes;  /* currently allocated */
+	size_t count;  /* number of allocations */
+	size_t reported;  /* 'bytes' added to the totals of a thread pool */
+	size_t counted;  /* 'count' added to the totals of a thread pool */
+} lcu_MemAccount;
+
+LCUI_FUNC int lcuL_setmemaccount (lua_State *L, size_t limit);
+
+LCUI_FUNC lcu_MemAccount *lcuL_tomemaccount (lua_State *L);
+
+LCUI_FUNC lua_Alloc lcuL_getallocf (lua_State *L, void **allocud);
+
+LCUI_FUNC void lcuL_closestate (lua_State *L);
+
 LCUI_FUNC int lcuL_canmove (lua_State *L,
                             int n,
                             const char *msg);
@@ -66,6 +104,22 @@ LCUI_FUNC int lcuL_movefrom (lua_State *L,
 
 LCUI_FUNC void lcuM_setfuncs (lua_State *L, const luaL_Reg *l, int nup);
 
+typedef struct lcu_Usage {
+	uint64_t wall;  /* nanoseconds executing */
+	uint64_t cpu;  /* nanoseconds of CPU time of the executing system thread */
+	lua_Integer resumes;
+} lcu_Usage;
+
+LCUI_FUNC uint64_t lcuL_cputime (void);
+
+LCUI_FUNC lcu_Usage *lcuL_getusage (lua_State *L, int idx, int create);
+
+LCUI_FUNC void lcuL_addusage (lua_State *L,
+                              lua_State *thread,
+                              int create,
+                              uint64_t wall,
+                              uint64_t cpu);
+
 LCUI_FUNC void lcuL_printstack (uv_thread_t tid,
                                 lua_State *L,
                                 const char *file,
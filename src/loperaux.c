@@ -1,5 +1,6 @@
 #include "lmodaux.h"
 #include "loperaux.h"
+#include "lprofaux.h"
 
 #include <string.h>
 
@@ -8,32 +9,831 @@
 #define FLAG_THRSAVED  0x02
 #define FLAG_PENDING  0x04
 #define FLAG_CLEANUP  0x08
+#define FLAG_PARKED  0x10
+#define FLAG_GROUPED  0x20
 
 #define torequest(O) ((uv_req_t *)&((O)->kind.request))
 #define tohandle(O) ((uv_handle_t *)&((O)->kind.handle))
+#define opthread(O) ((lua_State *)torequest(O)->data)
+#define tooperation(R) ((lcu_Operation *)((char *)(R)-offsetof(lcu_Operation, kind)))
+
+struct lcu_Operation {
+	int flags;
+	int anchor;  /* slot anchoring the thread while 'FLAG_THRSAVED' */
+	int value;  /* slot anchoring the operation value, or -1 */
+	int sizecls;  /* size class of 'kind' */
+	int priority;  /* class of the thread, cached while 'FLAG_THRSAVED' */
+	uint64_t started;  /* when the coroutine started awaiting, or 0 */
+	lcu_Operation *next;  /* next free operation */
+	lua_CFunction results;
+	lua_CFunction cancel;
+	union {  /* allocated only up to the size of 'sizecls' */
+		union uv_any_req request;
+		union uv_any_handle handle;
+	} kind;
+};
+
+#define OPSIZEGRAIN	32
+#define opsizecls(S)	((int)(((S)+OPSIZEGRAIN-1)/OPSIZEGRAIN))
+#define opclssize(C)	(offsetof(lcu_Operation, kind)+(size_t)(C)*OPSIZEGRAIN)
+#define NUMOPSIZECLS	(opsizecls(sizeof(((lcu_Operation *)NULL)->kind))+1)
+
+typedef struct TimerWheel TimerWheel;
+typedef struct WheelEntry WheelEntry;
+typedef struct ReadyQueue ReadyQueue;
+typedef struct LoopStats LoopStats;
+typedef struct OpLatencies OpLatencies;
+typedef struct AwaitGroup AwaitGroup;
+
+#define NUMREQKINDS	(UV_REQ_TYPE_MAX+2)  /* includes 'LCU_WHEELREQ' */
 
 struct lcu_Scheduler {
 	uv_loop_t loop;
 	int nasync;  /* number of active 'uv_async_t' handles */
 	int nactive;  /* number of all active handles */
+	lua_Alloc allocf;
+	void *allocud;
+	lua_State **anchors;  /* threads whose stack slots anchor values in use */
+	int nanchors;  /* number of threads in 'anchors' */
+	int freeslot;  /* first free slot in 'anchors', or -1 */
+	lcu_Operation **opmap;  /* operations with a saved thread, by thread */
+	size_t opmapsz;  /* number of entries in 'opmap' (power of 2) */
+	size_t nops;  /* number of operations in 'opmap' */
+	lcu_Operation *spareop;  /* operation being started */
+	lcu_Operation *current;  /* grouped operation being set up or finished, or NULL */
+	AwaitGroup *arming;  /* group of operations being armed, or NULL */
+	void *waking;  /* operation or object handle resuming a thread, or NULL */
+	lcu_Operation *freeops[NUMOPSIZECLS];  /* operations not in use, by size class */
+	TimerWheel *wheel;  /* timers of coarse precision, created on first use */
+	WheelEntry *expired;  /* deadlines expired while their threads were not awaiting */
+	ReadyQueue *ready;  /* threads parked by priority, created when priorities are set */
+	uv_timer_t budget;  /* bounds waits of budgeted runs, 'data' is NULL until used */
+	int halted;  /* 'lcu_haltsched' was called */
+	size_t nresumes;  /* number of coroutines resumed */
+	uint64_t stallns;  /* resumes taking longer are recorded, or 0 */
+	int stallwarn;  /* emit warnings of recorded stalls */
+	int accounting;  /* accounts usage of resumed coroutines */
+	LoopStats *stats;  /* loop phase timings, created when first read */
+	OpLatencies *latencies;  /* operation latencies, created when first started */
+	size_t reqresumes[NUMREQKINDS];  /* resumes by request type */
+	size_t hdlresumes[UV_HANDLE_TYPE_MAX];  /* resumes by handle type */
+};
+
+
+/*
+ * anchor slots
+ */
+
+#define slotthread(S,I)	((S)->anchors[(I)/LCU_ANCHORCHUNK])
+#define slotindex(I)	((I)%LCU_ANCHORCHUNK+2)  /* index 1 holds the next thread */
+
+static void *allocmem (lua_State *L, lcu_Scheduler *sched, void *p, size_t osz, size_t nsz) {
+	p = sched->allocf(sched->allocud, p, osz, nsz);
+	if (p == NULL && nsz > 0) luaL_error(L, "not enough memory");
+	return p;
+}
+
+static void growanchors (lua_State *L, lcu_Scheduler *sched) {
+	lua_State *A = sched->anchors[sched->nanchors-1];
+	int used = lua_gettop(A)-1;
+	int i, grow;
+	if (used == LCU_ANCHORCHUNK) {  /* last thread is full */
+		size_t sz = sizeof(lua_State *)*sched->nanchors;
+		if (!lua_checkstack(A, 1)) luaL_error(L, "not enough memory");
+		sched->anchors = (lua_State **)allocmem(L, sched, sched->anchors, sz,
+		                                        sz+sizeof(lua_State *));
+		lua_newthread(L);
+		lua_xmove(L, A, 1);
+		A = lua_tothread(A, -1);
+		lua_replace(sched->anchors[sched->nanchors-1], 1);
+		lua_pushnil(A);  /* no next thread yet */
+		sched->anchors[sched->nanchors++] = A;
+		used = 0;
+	}
+	grow = used > LUA_MINSTACK ? used : LUA_MINSTACK;
+	if (grow > LCU_ANCHORCHUNK-used) grow = LCU_ANCHORCHUNK-used;
+	if (!lua_checkstack(A, grow+1)) luaL_error(L, "not enough memory");
+	used += (sched->nanchors-1)*LCU_ANCHORCHUNK;
+	for (i = 1; i < grow; i++) lua_pushinteger(A, used+i);
+	lua_pushinteger(A, -1);
+	sched->freeslot = used;
+}
+
+#define reserveslot(L,S)	if ((S)->freeslot < 0) growanchors(L, S)
+
+static int anchorvalue (lua_State *L, lcu_Scheduler *sched) {
+	lua_State *A;
+	int slot;
+	reserveslot(L, sched);
+	slot = sched->freeslot;
+	A = slotthread(sched, slot);
+	sched->freeslot = (int)lua_tointeger(A, slotindex(slot));
+	lua_xmove(L, A, 1);
+	lua_replace(A, slotindex(slot));
+	return slot;
+}
+
+static void pushanchored (lua_State *L, lcu_Scheduler *sched, int slot) {
+	lua_State *A = slotthread(sched, slot);
+	lua_pushvalue(A, slotindex(slot));
+	lua_xmove(A, L, 1);
+}
+
+static void freeanchor (lcu_Scheduler *sched, int slot) {
+	lua_State *A = slotthread(sched, slot);
+	lua_pushinteger(A, sched->freeslot);
+	lua_replace(A, slotindex(slot));
+	sched->freeslot = slot;
+}
+
+/*
+ * timer wheel
+ */
+
+#define WHEELBITS	6
+#define WHEELSIZE	(1<<WHEELBITS)
+#define WHEELMASK	(WHEELSIZE-1)
+#define WHEELLEVELS	4
+#define WHEELSPAN	((uint64_t)1<<(WHEELBITS*WHEELLEVELS))  /* ticks covered */
+
+#define levelticks(V)	((uint64_t)1<<(WHEELBITS*(V)))
+#define levelslot(T,V)	(((T)>>(WHEELBITS*(V)))&WHEELMASK)
+
+typedef void (*WheelExpired) (uv_loop_t *loop, WheelEntry *entry);
+
+struct WheelEntry {
+	WheelEntry *next;
+	WheelEntry **prev;  /* link pointing to this entry */
+	uint64_t due;  /* tick of expiration, or 0 when not in the wheel slots */
+	WheelExpired expired;
+};
+
+struct TimerWheel {
+	uv_timer_t timer;
+	uint64_t tick;  /* last tick processed */
+	uint64_t next;  /* tick 'timer' is set to */
+	size_t count;  /* number of entries in 'slots' */
+	WheelEntry *ready;  /* entries to notify on next 'timer' callback */
+	WheelEntry *slots[WHEELLEVELS][WHEELSIZE];
+};
+
+static void linkentry (WheelEntry **list, WheelEntry *entry) {
+	entry->next = *list;
+	entry->prev = list;
+	if (*list) (*list)->prev = &entry->next;
+	*list = entry;
+}
+
+static void unlinkentry (WheelEntry *entry) {
+	*entry->prev = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+}
+
+static void insertentry (TimerWheel *wheel, WheelEntry *entry) {
+	uint64_t due = entry->due;
+	int level = 0;
+	if (due < wheel->tick) due = wheel->tick;  /* expires on current tick */
+	else if (due-wheel->tick >= WHEELSPAN) due = wheel->tick+WHEELSPAN-1;
+	while (level < WHEELLEVELS-1 && due-wheel->tick >= levelticks(level+1)) level++;
+	linkentry(&wheel->slots[level][levelslot(due, level)], entry);
+}
+
+static uint64_t nexttick (TimerWheel *wheel) {
+	uint64_t tick = wheel->tick;
+	uint64_t next = tick+WHEELSPAN;
+	int level;
+	for (level = 0; level < WHEELLEVELS; level++) {
+		int shift = WHEELBITS*level;
+		uint64_t base = tick>>shift;
+		int i;
+		if (((base+1)<<shift) >= next) break;  /* no earlier tick in upper levels */
+		for (i = 1; i <= WHEELSIZE; i++) {
+			if (wheel->slots[level][(base+i)&WHEELMASK]) {
+				if (((base+i)<<shift) < next) next = (base+i)<<shift;
+				break;
+			}
+		}
+	}
+	return next;
+}
+
+static void expirelist (uv_loop_t *loop, WheelEntry *list) {
+	WheelEntry *entry;
+	if (list) list->prev = &list;  /* detached from wheel */
+	while ((entry = list) != NULL) {
+		unlinkentry(entry);
+		entry->expired(loop, entry);
+	}
+}
+
+static void settimer (TimerWheel *wheel, uint64_t tick, uint64_t now);
+
+static void uv_onwheel (uv_timer_t *timer) {
+	uv_loop_t *loop = timer->loop;
+	TimerWheel *wheel = (TimerWheel *)timer;
+	uint64_t now = uv_now(loop)/LCU_WHEELTICKMS;
+	WheelEntry *list = wheel->ready;
+	WheelEntry *entry;
+	wheel->ready = NULL;
+	expirelist(loop, list);
+	while (wheel->count > 0) {
+		uint64_t tick = nexttick(wheel);
+		int level;
+		if (tick > now) break;
+		wheel->tick = tick;
+		for (level = WHEELLEVELS-1; level > 0; level--) {  /* cascade to lower levels */
+			if ((tick&(levelticks(level)-1)) == 0) {
+				WheelEntry **slot = &wheel->slots[level][levelslot(tick, level)];
+				while ((entry = *slot) != NULL) {
+					unlinkentry(entry);
+					insertentry(wheel, entry);
+				}
+			}
+		}
+		list = wheel->slots[0][levelslot(tick, 0)];
+		wheel->slots[0][levelslot(tick, 0)] = NULL;
+		for (entry = list; entry; entry = entry->next) {
+			entry->due = 0;  /* no longer in 'slots' */
+			wheel->count--;
+		}
+		expirelist(loop, list);
+	}
+	if (wheel->ready) settimer(wheel, wheel->tick, now);
+	else if (wheel->count > 0) settimer(wheel, nexttick(wheel), now);
+	else {
+		uv_timer_stop(timer);
+		wheel->tick = now;
+	}
+}
+
+static void settimer (TimerWheel *wheel, uint64_t tick, uint64_t now) {
+	uint64_t msecs = tick > now ? (tick-now)*LCU_WHEELTICKMS : 0;
+	uint64_t past = uv_now(wheel->timer.loop)%LCU_WHEELTICKMS;
+	if (msecs > past) msecs -= past;
+	wheel->next = tick;
+	uv_timer_start(&wheel->timer, uv_onwheel, msecs, 0);
+}
+
+static TimerWheel *getwheel (lua_State *L, lcu_Scheduler *sched) {
+	TimerWheel *wheel = sched->wheel;
+	if (wheel == NULL) {
+		wheel = (TimerWheel *)allocmem(L, sched, NULL, 0, sizeof(TimerWheel));
+		memset(wheel, 0, sizeof(TimerWheel));
+		uv_timer_init(lcu_toloop(sched), &wheel->timer);
+		wheel->tick = uv_now(lcu_toloop(sched))/LCU_WHEELTICKMS;
+		sched->wheel = wheel;
+	}
+	return wheel;
+}
+
+static void startentry (TimerWheel *wheel, WheelEntry *entry, uint64_t msecs) {
+	uint64_t now = uv_now(wheel->timer.loop);
+	uint64_t due = (now+msecs+LCU_WHEELTICKMS-1)/LCU_WHEELTICKMS;
+	now /= LCU_WHEELTICKMS;
+	if (wheel->count == 0 && wheel->tick < now) wheel->tick = now;
+	if (due <= wheel->tick) due = wheel->tick+1;
+	entry->due = due;
+	insertentry(wheel, entry);
+	wheel->count++;
+	if (!uv_is_active((uv_handle_t *)&wheel->timer) || due < wheel->next)
+		settimer(wheel, due, now);
+}
+
+typedef struct WheelRequest {
+	uv_req_t request;
+	uv_loop_t *loop;
+	WheelEntry entry;
+	lcu_WheelCallback callback;
+} WheelRequest;
+
+#define towheelreq(E)	((WheelRequest *)((char *)(E)-offsetof(WheelRequest, entry)))
+
+static void expiredreq (uv_loop_t *loop, WheelEntry *entry) {
+	WheelRequest *wheelreq = towheelreq(entry);
+	wheelreq->callback(loop, &wheelreq->request);
+}
+
+static void stopentry (TimerWheel *wheel, WheelEntry *entry) {
+	unlinkentry(entry);
+	if (entry->due) {
+		entry->due = 0;
+		wheel->count--;
+	}
+}
+
+static void cancelentry (TimerWheel *wheel, WheelEntry *entry) {
+	stopentry(wheel, entry);
+	linkentry(&wheel->ready, entry);
+	if (wheel->next > wheel->tick || !uv_is_active((uv_handle_t *)&wheel->timer)) {
+		wheel->next = wheel->tick;
+		uv_timer_start(&wheel->timer, uv_onwheel, 0, 0);
+	}
+}
+
+static void detachentries (WheelEntry *list) {  /* so finalizers do not unlink them */
+	for (; list; list = list->next) list->prev = NULL;
+}
+
+
+/*
+ * ready queues
+ */
+
+#define NUMPRIORITIES	3  /* "high", "normal" and "low" */
+#define DEFPRIORITY	1
+
+typedef struct ReadyEntry {
+	struct ReadyEntry *next;
+	struct ReadyEntry **prev;  /* NULL when not in a queue */
+	lcu_Scheduler *sched;
+	int priority;
+	int anchor;  /* slot anchoring the parked thread */
+	int base;  /* stack index below the results */
+	int top;  /* stack index of the last result */
+} ReadyEntry;
+
+struct ReadyQueue {
+	uv_check_t check;  /* resumes parked threads after polling */
+	uv_idle_t idle;  /* avoids blocking while there are parked threads */
+	size_t count;  /* number of parked threads */
+	size_t classes[NUMPRIORITIES];  /* number of threads of each class */
+	int enabled;  /* some thread has a non-default priority */
+	int highest;  /* highest class in use, threads of lower classes are parked */
+	ReadyEntry *spare;  /* entries not in use */
+	ReadyEntry *first[NUMPRIORITIES];
+	ReadyEntry **last[NUMPRIORITIES];
 };
 
+static void pushentry (ReadyQueue *queue, ReadyEntry *entry) {
+	entry->next = NULL;
+	entry->prev = queue->last[entry->priority];
+	*entry->prev = entry;
+	queue->last[entry->priority] = &entry->next;
+	queue->count++;
+}
+
+static void popentry (ReadyQueue *queue, ReadyEntry *entry) {
+	*entry->prev = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else queue->last[entry->priority] = entry->prev;
+	entry->prev = NULL;
+	queue->count--;
+}
+
+/* class of a thread, collected with the thread to update the counts of classes */
+typedef struct PriorityTag {
+	lcu_Scheduler *sched;  /* NULL when not counted */
+	int priority;
+} PriorityTag;
+
+static void updateclasses (ReadyQueue *queue) {
+	int i;
+	queue->enabled = 0;
+	queue->highest = DEFPRIORITY;
+	for (i = 0; i < NUMPRIORITIES; i++) {
+		if (i != DEFPRIORITY && queue->classes[i] > 0) {
+			queue->enabled = 1;
+			if (i < queue->highest) queue->highest = i;
+		}
+	}
+}
 
-static void pushopmap (lua_State *L) {
-	lua_pushlightuserdata(L, pushopmap);
-	if (lua_gettable(L, LUA_REGISTRYINDEX) != LUA_TTABLE) {
+static int prioritytag_gc (lua_State *L) {
+	PriorityTag *tag = (PriorityTag *)lua_touserdata(L, 1);
+	if (tag->sched && tag->sched->ready) {
+		tag->sched->ready->classes[tag->priority]--;
+		updateclasses(tag->sched->ready);
+	}
+	return 0;
+}
+
+static int getpriority (lua_State *L, int idx) {
+	int priority = DEFPRIORITY;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_PRIORITIESREGKEY) == LUA_TTABLE) {
+		lua_pushvalue(L, idx < 0 ? idx-1 : idx);
+		if (lua_rawget(L, -2) == LUA_TUSERDATA)
+			priority = ((PriorityTag *)lua_touserdata(L, -1))->priority;
 		lua_pop(L, 1);
-		lua_newtable(L);
-		lua_pushlightuserdata(L, pushopmap);
-		lua_pushvalue(L, -2);
-		lua_createtable(L, 0, 1);
-		lua_pushliteral(L, "k");
-		lua_setfield(L, -2, "__mode");
-		lua_setmetatable(L, -2);
-		lua_settable(L, LUA_REGISTRYINDEX);
 	}
+	lua_pop(L, 1);
+	return priority;
+}
+
+static int threadclass (lua_State *L, lcu_Scheduler *sched) {
+	int priority = DEFPRIORITY;
+	if (sched->ready != NULL && sched->ready->enabled) {
+		luaL_checkstack(L, 3, NULL);
+		lua_pushthread(L);
+		priority = getpriority(L, -1);
+		lua_pop(L, 1);
+	}
+	return priority;
+}
+
+static void freeready (lcu_Scheduler *sched) {
+	ReadyQueue *queue = sched->ready;
+	if (queue) {
+		int i;
+		for (i = 0; i < NUMPRIORITIES; i++) {
+			while (queue->first[i]) {
+				ReadyEntry *entry = queue->first[i];
+				popentry(queue, entry);
+				entry->next = queue->spare;
+				queue->spare = entry;
+			}
+		}
+		while (queue->spare) {
+			ReadyEntry *entry = queue->spare;
+			queue->spare = entry->next;
+			sched->allocf(sched->allocud, entry, sizeof(ReadyEntry), 0);
+		}
+		sched->allocf(sched->allocud, queue, sizeof(ReadyQueue), 0);
+		sched->ready = NULL;
+	}
+}
+
+
+/*
+ * statistics
+ */
+
+struct LoopStats {
+	uv_prepare_t prepare;  /* marks the start of polling */
+	uv_check_t check;  /* marks the end of polling */
+	uint64_t iterations;
+	uint64_t polled;  /* time spent polling for events */
+	uint64_t busy;  /* time spent processing events */
+	uint64_t lag;  /* time processing events in previous iteration */
+	uint64_t mark;  /* when last polling started or ended */
+};
+
+static void uv_onprepare (uv_prepare_t *prepare) {
+	LoopStats *stats = (LoopStats *)prepare;
+	uint64_t now = uv_hrtime();
+	stats->lag = now-stats->mark;
+	stats->busy += stats->lag;
+	stats->iterations++;
+	stats->mark = now;
+}
+
+static void uv_oncheck (uv_check_t *check) {
+	LoopStats *stats = (LoopStats *)((char *)check-offsetof(LoopStats, check));
+	uint64_t now = uv_hrtime();
+	stats->polled += now-stats->mark;
+	stats->mark = now;
+}
+
+static LoopStats *getstats (lua_State *L, lcu_Scheduler *sched) {
+	LoopStats *stats = sched->stats;
+	if (stats == NULL) {
+		uv_loop_t *loop = lcu_toloop(sched);
+		stats = (LoopStats *)allocmem(L, sched, NULL, 0, sizeof(LoopStats));
+		memset(stats, 0, sizeof(LoopStats));
+		uv_prepare_init(loop, &stats->prepare);
+		uv_check_init(loop, &stats->check);
+		uv_prepare_start(&stats->prepare, uv_onprepare);
+		uv_check_start(&stats->check, uv_oncheck);
+		uv_unref((uv_handle_t *)&stats->prepare);
+		uv_unref((uv_handle_t *)&stats->check);
+		stats->mark = uv_hrtime();
+		sched->stats = stats;
+	}
+	return stats;
+}
+
+#define setfieldnum(L,K,V)	(lua_pushnumber(L, V), lua_setfield(L, -2, K))
+#define setfieldint(L,K,V)	(lua_pushinteger(L, (lua_Integer)(V)), lua_setfield(L, -2, K))
+
+LCUI_FUNC void lcu_pushstats (lua_State *L, lcu_Scheduler *sched, int idx) {
+	uv_loop_t *loop = lcu_toloop(sched);
+	LoopStats *stats = getstats(L, sched);
+	int i;
+	if (lua_istable(L, idx)) lua_pushvalue(L, idx);
+	else lua_createtable(L, 0, 12);
+	setfieldint(L, "iterations", stats->iterations);
+	setfieldnum(L, "polling", (lua_Number)stats->polled*1e-9);
+	setfieldnum(L, "processing", (lua_Number)stats->busy*1e-9);
+	setfieldnum(L, "lag", (lua_Number)stats->lag*1e-9);
+	setfieldnum(L, "idle", (lua_Number)uv_metrics_idle_time(loop)*1e-9);
+	setfieldint(L, "resumes", sched->nresumes);
+	setfieldint(L, "active", sched->nactive);
+	setfieldint(L, "handles", loop->active_handles);
+	setfieldint(L, "requests", loop->active_reqs.count);
+	if (lua_getfield(L, -1, "operations") != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, 0, NUMREQKINDS+UV_HANDLE_TYPE_MAX);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "operations");
+	}
+	for (i = UV_UNKNOWN_REQ+1; i < UV_REQ_TYPE_MAX; i++) {
+		const char *name = uv_req_type_name((uv_req_type)i);
+		if (name) setfieldint(L, name, sched->reqresumes[i]);
+	}
+	setfieldint(L, "wheel", sched->reqresumes[LCU_WHEELREQ]);
+	for (i = UV_UNKNOWN_HANDLE+1; i < UV_HANDLE_TYPE_MAX; i++) {
+		const char *name = uv_handle_type_name((uv_handle_type)i);
+		if (name) setfieldint(L, name, sched->hdlresumes[i]);
+	}
+	lua_pop(L, 1);  /* discard 'operations' */
+}
+
+#define LATENCYBUCKETS	32
+#define NUMOPKINDS	(NUMREQKINDS+UV_HANDLE_TYPE_MAX)
+#define reqkind(T)	((int)(T))
+#define hdlkind(T)	(NUMREQKINDS+(int)(T))
+
+typedef struct Latency {
+	size_t total;
+	uint64_t max;
+	size_t counts[LATENCYBUCKETS];  /* below 1us, then up to 2^(i-1)us */
+} Latency;
+
+struct OpLatencies {
+	int enabled;
+	Latency kinds[NUMOPKINDS];
+};
+
+#define measuring(S)	((S)->latencies != NULL && (S)->latencies->enabled)
+
+static void startlatency (lcu_Scheduler *sched, uint64_t *started) {
+	*started = measuring(sched) ? uv_hrtime() : 0;
+}
+
+static void endlatency (lcu_Scheduler *sched, uint64_t *started, int kind) {
+	if (*started && measuring(sched)) {
+		Latency *latency = &sched->latencies->kinds[kind];
+		uint64_t nsecs = uv_hrtime()-*started;
+		uint64_t usecs = nsecs/1000;
+		int bucket = 0;
+		while (usecs > 0 && bucket < LATENCYBUCKETS-1) {
+			usecs >>= 1;
+			bucket++;
+		}
+		latency->counts[bucket]++;
+		latency->total++;
+		if (nsecs > latency->max) latency->max = nsecs;
+	}
+	*started = 0;
+}
+
+static lua_Number percentile (Latency *latency, double fraction) {
+	size_t count = 0, rank = (size_t)(fraction*(double)latency->total);
+	lua_Number bound = 1e-6;
+	int i;
+	for (i = 0; i < LATENCYBUCKETS-1; i++, bound *= 2) {
+		count += latency->counts[i];
+		if (count > rank) break;
+	}
+	if (bound > (lua_Number)latency->max*1e-9) bound = (lua_Number)latency->max*1e-9;
+	return bound;
+}
+
+static void pushlatency (lua_State *L, Latency *latency) {
+	int i;
+	lua_createtable(L, 0, 6);
+	setfieldint(L, "count", latency->total);
+	setfieldnum(L, "p50", percentile(latency, .5));
+	setfieldnum(L, "p90", percentile(latency, .9));
+	setfieldnum(L, "p99", percentile(latency, .99));
+	setfieldnum(L, "max", (lua_Number)latency->max*1e-9);
+	lua_createtable(L, LATENCYBUCKETS, 0);
+	for (i = 0; i < LATENCYBUCKETS; i++) {
+		lua_pushinteger(L, (lua_Integer)latency->counts[i]);
+		lua_rawseti(L, -2, i+1);
+	}
+	lua_setfield(L, -2, "buckets");
+}
+
+static const char *kindname (int kind) {
+	if (kind < NUMREQKINDS) {
+		if (kind == reqkind(LCU_WHEELREQ)) return "wheel";
+		return uv_req_type_name((uv_req_type)kind);
+	}
+	return uv_handle_type_name((uv_handle_type)(kind-NUMREQKINDS));
+}
+
+LCUI_FUNC void lcu_setlatencies (lua_State *L, lcu_Scheduler *sched, int enabled) {
+	if (sched->latencies == NULL) {
+		if (!enabled) return;
+		sched->latencies = (OpLatencies *)allocmem(L, sched, NULL, 0, sizeof(OpLatencies));
+		memset(sched->latencies, 0, sizeof(OpLatencies));
+	}
+	sched->latencies->enabled = enabled;
+}
+
+LCUI_FUNC void lcu_resetlatencies (lcu_Scheduler *sched) {
+	if (sched->latencies) memset(sched->latencies->kinds, 0, sizeof(sched->latencies->kinds));
+}
+
+LCUI_FUNC void lcu_pushlatencies (lua_State *L, lcu_Scheduler *sched) {
+	lua_newtable(L);
+	if (sched->latencies) {
+		int i;
+		for (i = 0; i < NUMOPKINDS; i++) {
+			Latency *latency = &sched->latencies->kinds[i];
+			const char *name = kindname(i);
+			if (latency->total > 0 && name) {
+				pushlatency(L, latency);
+				lua_setfield(L, -2, name);
+			}
+		}
+	}
+}
+
+
+/*
+ * operation map
+ */
+
+#define hashthread(S,L)	((((size_t)(L))>>4^((size_t)(L))>>12)&((S)->opmapsz-1))
+
+static lcu_Operation *findop (lcu_Scheduler *sched, lua_State *L) {
+	if (sched->nops > 0) {
+		size_t i = hashthread(sched, L);
+		lcu_Operation *op;
+		while ((op = sched->opmap[i]) != NULL) {
+			/* grouped ops are found through their groups */
+			if (opthread(op) == L && !lcuL_maskflag(op, FLAG_GROUPED)) return op;
+			i = (i+1)&(sched->opmapsz-1);
+		}
+	}
+	return NULL;
+}
+
+static void insertop (lcu_Scheduler *sched, lcu_Operation *op) {
+	size_t i = hashthread(sched, opthread(op));
+	while (sched->opmap[i] != NULL) i = (i+1)&(sched->opmapsz-1);
+	sched->opmap[i] = op;
+	sched->nops++;
+}
+
+static void removeop (lcu_Scheduler *sched, lcu_Operation *op) {
+	size_t mask = sched->opmapsz-1;
+	size_t i = hashthread(sched, opthread(op));
+	size_t j;
+	while (sched->opmap[i] != op) i = (i+1)&mask;
+	for (j = (i+1)&mask; sched->opmap[j] != NULL; j = (j+1)&mask) {
+		size_t h = hashthread(sched, opthread(sched->opmap[j]));
+		if (((j-h)&mask) >= ((j-i)&mask)) {  /* entry 'j' can move to 'i' */
+			sched->opmap[i] = sched->opmap[j];
+			i = j;
+		}
+	}
+	sched->opmap[i] = NULL;
+	sched->nops--;
+}
+
+static void reserveop (lua_State *L, lcu_Scheduler *sched) {
+	if (2*(sched->nops+1) > sched->opmapsz) {
+		lcu_Operation **old = sched->opmap;
+		size_t oldsz = sched->opmapsz;
+		size_t i, sz = oldsz ? 2*oldsz : 16;
+		sched->opmap = (lcu_Operation **)allocmem(L, sched, NULL, 0,
+		                                          sz*sizeof(lcu_Operation *));
+		memset(sched->opmap, 0, sz*sizeof(lcu_Operation *));
+		sched->opmapsz = sz;
+		sched->nops = 0;
+		for (i = 0; i < oldsz; i++) if (old[i]) insertop(sched, old[i]);
+		sched->allocf(sched->allocud, old, oldsz*sizeof(lcu_Operation *), 0);
+	}
+}
+
+static size_t reqsize (uv_req_type type) {
+	switch ((int)type) {
+#define XX(uc,lc) case UV_##uc: return sizeof(uv_##lc##_t);
+		UV_REQ_TYPE_MAP(XX)
+#undef XX
+		case LCU_WHEELREQ: return sizeof(WheelRequest);
+		default: return sizeof(union uv_any_req);
+	}
+}
+
+static size_t hdlsize (uv_handle_type type) {
+	switch (type) {
+#define XX(uc,lc) case UV_##uc: return sizeof(uv_##lc##_t);
+		UV_HANDLE_TYPE_MAP(XX)
+#undef XX
+		default: return sizeof(union uv_any_handle);
+	}
+}
+
+static void freeop (lcu_Scheduler *sched, lcu_Operation *op) {
+	op->next = sched->freeops[op->sizecls];
+	sched->freeops[op->sizecls] = op;
+}
+
+static lcu_Operation *newop (lua_State *L, lcu_Scheduler *sched, int sizecls) {
+	lcu_Operation *op = sched->freeops[sizecls];
+	if (op != NULL) sched->freeops[sizecls] = op->next;
+	else {
+		op = (lcu_Operation *)allocmem(L, sched, NULL, 0, opclssize(sizecls));
+		op->sizecls = sizecls;
+	}
+	return op;
+}
+
+static lcu_Operation *tothrop (lua_State *L, lcu_Scheduler *sched, size_t sz) {
+	lcu_Operation *op = findop(sched, L);
+	if (op == NULL) {
+		int sizecls = opsizecls(sz);
+		uv_req_t *request;
+		op = sched->spareop;
+		if (op == NULL || op->sizecls != sizecls) {
+			if (op != NULL) freeop(sched, op);
+			sched->spareop = NULL;
+			op = newop(L, sched, sizecls);
+			sched->spareop = op;
+		}
+		reserveop(L, sched);
+		reserveslot(L, sched);  /* so saving the thread cannot raise errors */
+		op->flags = FLAG_REQUEST;
+		op->value = -1;
+		op->priority = threadclass(L, sched);
+		request = torequest(op);
+		request->type = UV_UNKNOWN_REQ;
+		request->data = (void *)L;
+	}
+	return op;
+}
+
+static lcu_Operation *fitthrop (lua_State *L, lcu_Scheduler *sched, lcu_Operation *op, size_t sz) {
+	int sizecls = opsizecls(sz);
+	if (op != sched->spareop && op->sizecls != sizecls) {  /* replace saved op */
+		lcu_Operation *fitop = newop(L, sched, sizecls);
+		size_t i = hashthread(sched, L);
+		lcu_assert(lcuL_maskflag(op, FLAG_REQUEST|FLAG_THRSAVED|FLAG_PENDING) == (FLAG_REQUEST|FLAG_THRSAVED));
+		lcu_assert(torequest(op)->type == UV_UNKNOWN_REQ);
+		while (sched->opmap[i] != op) i = (i+1)&(sched->opmapsz-1);
+		sched->opmap[i] = fitop;
+		fitop->flags = op->flags;
+		fitop->anchor = op->anchor;
+		fitop->value = op->value;
+		fitop->priority = op->priority;
+		fitop->results = op->results;
+		fitop->cancel = op->cancel;
+		torequest(fitop)->type = UV_UNKNOWN_REQ;
+		torequest(fitop)->data = (void *)L;
+		freeop(sched, op);
+		op = fitop;
+	}
+	return op;
+}
+
+static void savethread (lua_State *L, lcu_Scheduler *sched, lcu_Operation *op) {
+	lcu_assert(op == sched->spareop || lcuL_maskflag(op, FLAG_GROUPED));
+	lcu_assert(opthread(op) == L);
+	if (op == sched->spareop) sched->spareop = NULL;
+	lua_pushthread(L);
+	op->anchor = anchorvalue(L, sched);
+	insertop(sched, op);
+}
+
+static void freethread (lcu_Scheduler *sched, lcu_Operation *op) {
+	removeop(sched, op);
+	freeanchor(sched, op->anchor);
+	if (op->value >= 0) freeanchor(sched, op->value);
+	freeop(sched, op);
 }
 
+#define deleteop(S,O)	((S)->allocf((S)->allocud, O, opclssize((O)->sizecls), 0))
+
+static void freesched (lcu_Scheduler *sched) {
+	size_t i;
+	for (i = 0; i < sched->opmapsz; i++) if (sched->opmap[i]) deleteop(sched, sched->opmap[i]);
+	sched->allocf(sched->allocud, sched->opmap, sched->opmapsz*sizeof(lcu_Operation *), 0);
+	sched->opmapsz = 0;
+	sched->nops = 0;
+	for (i = 0; i < NUMOPSIZECLS; i++) {
+		lcu_Operation *op = sched->freeops[i];
+		while (op) {
+			lcu_Operation *next = op->next;
+			deleteop(sched, op);
+			op = next;
+		}
+		sched->freeops[i] = NULL;
+	}
+	if (sched->spareop) deleteop(sched, sched->spareop);
+	sched->spareop = NULL;
+	if (sched->wheel) detachentries(sched->wheel->ready);
+	sched->allocf(sched->allocud, sched->wheel, sizeof(TimerWheel), 0);
+	sched->wheel = NULL;
+	detachentries(sched->expired);  /* might be collected later */
+	sched->expired = NULL;
+	freeready(sched);
+	sched->allocf(sched->allocud, sched->stats, sizeof(LoopStats), 0);
+	sched->stats = NULL;
+	sched->allocf(sched->allocud, sched->latencies, sizeof(OpLatencies), 0);
+	sched->latencies = NULL;
+	sched->allocf(sched->allocud, sched->anchors, sched->nanchors*sizeof(lua_State *), 0);
+	sched->anchors = NULL;
+	sched->nanchors = 0;
+}
+
+
+/*
+ * scheduler
+ */
+
 static void closehandle (uv_handle_t* handle, void* arg) {
 	(void)arg;
 	if (!uv_is_closing(handle)) uv_close(handle, NULL);
@@ -59,51 +859,107 @@ static int terminateloop (lua_State *L) {
 		}
 	}
 	lcu_assert(err >= 0);
+	if (err >= 0) freesched(sched);  /* otherwise handles might still use them */
 	lcu_log(NULL, L, "UV loop closed");
 	return 0;
 }
 
 LCUI_FUNC void lcuM_newmodupvs (lua_State *L) {
-	lcu_Scheduler *sched = (lcu_Scheduler *)lua_newuserdatauv(L, sizeof(lcu_Scheduler), 0);
+	lcu_Scheduler *sched = (lcu_Scheduler *)lua_newuserdatauv(L, sizeof(lcu_Scheduler), 1);
 	uv_loop_t *loop = lcu_toloop(sched);
-	int err = uv_loop_init(loop);
-	if (err < 0) lcu_error(L, err);
+	int err;
+	sched->allocf = lua_getallocf(L, &sched->allocud);
+	sched->anchors = NULL;
+	sched->nanchors = 0;
+	sched->freeslot = -1;
+	sched->opmap = NULL;
+	sched->opmapsz = 0;
+	sched->nops = 0;
+	sched->spareop = NULL;
+	sched->current = NULL;
+	sched->arming = NULL;
+	sched->waking = NULL;
+	memset(sched->freeops, 0, sizeof(sched->freeops));
+	sched->wheel = NULL;
+	sched->expired = NULL;
+	sched->ready = NULL;
+	sched->stats = NULL;
+	sched->latencies = NULL;
+	memset(sched->reqresumes, 0, sizeof(sched->reqresumes));
+	memset(sched->hdlresumes, 0, sizeof(sched->hdlresumes));
+	sched->anchors = (lua_State **)allocmem(L, sched, NULL, 0, sizeof(lua_State *));
+	sched->anchors[0] = lua_newthread(L);
+	sched->nanchors = 1;
+	lua_pushnil(sched->anchors[0]);  /* no next thread yet */
+	lua_setiuservalue(L, -2, 1);
+	err = uv_loop_init(loop);
+	if (err < 0) {
+		freesched(sched);
+		lcu_error(L, err);
+	}
+	uv_loop_configure(loop, UV_METRICS_IDLE_TIME);  /* must be before polling */
 	sched->nasync = 0;
 	sched->nactive = 0;
+	sched->budget.data = NULL;
+	sched->halted = 0;
+	sched->nresumes = 0;
+	sched->stallns = 0;
+	sched->stallwarn = 0;
+	sched->accounting = 0;
 	loop->data = NULL;
 	lcuL_setfinalizer(L, terminateloop);
 }
 
-static void savevalue (lua_State *L, void *key) {
-	lua_pushlightuserdata(L, key);
-	lua_insert(L, -2);
-	lua_settable(L, LUA_REGISTRYINDEX);
-}
-
-static void pushsaved (lua_State *L, void *key) {
-	lua_pushlightuserdata(L, key);
-	lua_gettable(L, LUA_REGISTRYINDEX);
-}
-
-static void freevalue (lua_State *L, void *key) {
-	lua_pushlightuserdata(L, key);
-	lua_pushnil(L);
-	lua_settable(L, LUA_REGISTRYINDEX);
-}
-
-static void savethread (lua_State *L, void *key) {
-	lua_pushthread(L);
-	savevalue(L, key);
+static void recordstall (lua_State *L,
+                         lcu_Scheduler *sched,
+                         lua_State *thread,
+                         uint64_t nsecs) {
+	lua_Integer n;
+	luaL_checkstack(L, 4, NULL);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_STALLSREGKEY) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_createtable(L, LCU_STALLLOGSIZE, 1);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_STALLSREGKEY);
+	}
+	lua_getfield(L, -1, "n");
+	n = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_createtable(L, 0, 3);
+	lua_pushthread(thread);
+	lua_xmove(thread, L, 1);
+	lua_setfield(L, -2, "coroutine");
+	luaL_traceback(L, thread, NULL, 0);
+	lua_setfield(L, -2, "traceback");
+	lua_pushnumber(L, (lua_Number)nsecs*1e-9);
+	lua_setfield(L, -2, "duration");
+	lua_rawseti(L, -2, n%LCU_STALLLOGSIZE+1);  /* overwrite the oldest record */
+	lua_pushinteger(L, n+1);
+	lua_setfield(L, -2, "n");
+	lua_pop(L, 1);
+	if (sched->stallwarn) {
+		const char *msg = lua_pushfstring(L, "coroutine stalled the loop for %f seconds",
+		                                  (lua_Number)nsecs*1e-9);
+		lcuL_warnmsg(L, "system.run", msg);
+		lua_pop(L, 1);
+	}
 }
 
-static void resumethread (lua_State *thread,
-                          lua_State *L,
-                          int narg,
-                          uv_loop_t *loop) {
+static void runthread (lua_State *thread,
+                       lua_State *L,
+                       int narg,
+                       uv_loop_t *loop) {
+	lcu_Scheduler *sched = lcu_tosched(loop);
+	int accounting = sched->accounting;
+	uint64_t start = sched->stallns || accounting ? uv_hrtime() : 0;
+	uint64_t cpu = accounting ? lcuL_cputime() : 0;
+	int profiling = lcuPF_enabled;
 	int nret, status;
 	lcu_assert(loop->data == (void *)L);
-	lua_pushlightuserdata(thread, loop);  /* token to sign scheduler resume */
-	status = lua_resume(thread, L, narg+1, &nret);
+	sched->nresumes++;
+	if (profiling) lcuPF_enter(thread);
+	status = lua_resume(thread, L, narg, &nret);
+	if (profiling) lcuPF_leave(thread);
 	if (status != LUA_OK && status != LUA_YIELD) {
 		const char *errmsg = lua_tostring(thread, -1);
 		if (errmsg == NULL) errmsg = "(error object is not a string)";
@@ -111,6 +967,20 @@ static void resumethread (lua_State *thread,
 		lua_pop(thread, 1);
 	}
 	else lua_pop(thread, nret);  /* dicard yielded values */
+	if (start) {
+		uint64_t elapsed = uv_hrtime()-start;
+		if (accounting) lcuL_addusage(L, thread, 1, elapsed, lcuL_cputime()-cpu);
+		if (sched->stallns && elapsed >= sched->stallns)
+			recordstall(L, sched, thread, elapsed);
+	}
+}
+
+static void resumethread (lua_State *thread,
+                          lua_State *L,
+                          int narg,
+                          uv_loop_t *loop) {
+	lua_pushlightuserdata(thread, loop);  /* token to sign scheduler resume */
+	runthread(thread, L, narg+1, loop);
 }
 
 static int haltedop (lua_State *L, void *token) {
@@ -121,72 +991,201 @@ static int haltedop (lua_State *L, void *token) {
 	return 1;
 }
 
-static void checkyieldable (lua_State *L) {
-	if (!lua_isyieldable(L)) luaL_error(L, "unable to yield");
+static void cancelop (lcu_Operation *op);
+
+/* handles of parked operations are kept until the thread is resumed, */
+/* so it can await on them again */
+static void releaseparked (lcu_Scheduler *sched, lua_State *thread) {
+	lcu_Operation *op = findop(sched, thread);
+	if (op && lcuL_maskflag(op, FLAG_PARKED)) {
+		lcuL_clearflag(op, FLAG_PARKED);
+		if (!lcuL_maskflag(op, FLAG_REQUEST|FLAG_PENDING|FLAG_CLEANUP)) cancelop(op);
+	}
 }
 
-struct lcu_Operation {
-	union {
-		union uv_any_req request;
-		union uv_any_handle handle;
-	} kind;
-	int flags;
-	lua_CFunction results;
-	lua_CFunction cancel;
-};
+static void uv_onparked (uv_idle_t *idle) {
+	(void)idle;  /* just keeps the loop polling without blocking */
+}
 
-static lcu_Operation *tothrop (lua_State *L) {
-	lcu_Operation *op;
-	pushopmap(L);
-	lua_pushthread(L);
-	if (lua_gettable(L, -2) == LUA_TNIL) {
-		uv_req_t *request;
+static void uv_ondrain (uv_check_t *check) {
+	ReadyQueue *queue = (ReadyQueue *)check;
+	uv_loop_t *loop = check->loop;
+	lua_State *L = (lua_State *)loop->data;
+	size_t count = queue->count;  /* threads parked again are left to next drain */
+	while (count-- > 0 && queue->count > 0) {  /* some may be canceled meanwhile */
+		ReadyEntry *entry;
+		int i;
+		for (i = 0; queue->first[i] == NULL; i++) lcu_assert(i < NUMPRIORITIES-1);
+		entry = queue->first[i];
+		popentry(queue, entry);
+		pushanchored(L, entry->sched, entry->anchor);
+		resumethread(lua_tothread(L, -1), L, 0, loop);
+		releaseparked(lcu_tosched(loop), lua_tothread(L, -1));
+		lua_pop(L, 1);
+	}
+	if (queue->count == 0) {
+		uv_idle_stop(&queue->idle);
+		uv_check_stop(check);
+	}
+	lcuU_checksuspend(loop);
+}
+
+static int k_unpark (lua_State *L, int status, lua_KContext kctx) {
+	ReadyEntry *entry = (ReadyEntry *)kctx;
+	lcu_Scheduler *sched = entry->sched;
+	ReadyQueue *queue = sched->ready;
+	int base = entry->base;
+	int top = entry->top;
+	lcu_assert(status == LUA_YIELD);
+	if (entry->prev) popentry(queue, entry);  /* explicitly resumed */
+	freeanchor(sched, entry->anchor);
+	entry->next = queue->spare;
+	queue->spare = entry;
+	sched->nactive--;
+	if (haltedop(L, lcu_toloop(sched))) {
+		releaseparked(sched, L);
+		return lua_gettop(L)-top;
+	}
+	lcu_assert(lua_gettop(L) == top);
+	return top-base;
+}
+
+static int parkready (lua_State *L,
+                      lcu_Scheduler *sched,
+                      lcu_Operation *op,
+                      int priority,
+                      int nret) {
+	ReadyQueue *queue = sched->ready;
+	if (queue != NULL && priority > queue->highest && nret >= 0) {
+		ReadyEntry *entry = queue->spare;
+		luaL_checkstack(L, 1, NULL);
+		reserveslot(L, sched);  /* so anchoring cannot raise errors */
+		if (entry) queue->spare = entry->next;
+		else entry = (ReadyEntry *)allocmem(L, sched, NULL, 0, sizeof(ReadyEntry));
 		lua_pushthread(L);
-		op = (lcu_Operation *)lua_newuserdatauv(L, sizeof(lcu_Operation), 1);
-		lua_settable(L, -4);
-		op->flags = FLAG_REQUEST;
-		request = torequest(op);
-		request->type = UV_UNKNOWN_REQ;
-		request->data = (void *)L;
+		entry->sched = sched;
+		entry->priority = priority;
+		entry->anchor = anchorvalue(L, sched);  /* pops thread */
+		entry->top = lua_gettop(L);
+		entry->base = entry->top-nret;
+		pushentry(queue, entry);
+		if (!uv_is_active((uv_handle_t *)&queue->check)) {
+			uv_check_start(&queue->check, uv_ondrain);
+			uv_idle_start(&queue->idle, uv_onparked);
+		}
+		if (op && !lcuL_maskflag(op, FLAG_REQUEST)) lcuL_setflag(op, FLAG_PARKED);
+		sched->nactive++;
+		return lua_yieldk(L, 0, (lua_KContext)entry, k_unpark);
 	}
-	else op = (lcu_Operation *)lua_touserdata(L, -1);
-	lua_pop(L, 2);  /* pops 'lcu_Operation' and 'opmap' */
+	return nret;
+}
+
+LCUI_FUNC void lcu_setpriority (lua_State *L, lcu_Scheduler *sched, int idx, int priority) {
+	if (sched->ready == NULL) {
+		ReadyQueue *queue;
+		int i;
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_PRIORITIESREGKEY);
+		queue = (ReadyQueue *)allocmem(L, sched, NULL, 0, sizeof(ReadyQueue));
+		uv_check_init(lcu_toloop(sched), &queue->check);
+		uv_idle_init(lcu_toloop(sched), &queue->idle);
+		queue->count = 0;
+		for (i = 0; i < NUMPRIORITIES; i++) queue->classes[i] = 0;
+		queue->enabled = 0;
+		queue->highest = DEFPRIORITY;
+		queue->spare = NULL;
+		for (i = 0; i < NUMPRIORITIES; i++) {
+			queue->first[i] = NULL;
+			queue->last[i] = &queue->first[i];
+		}
+		sched->ready = queue;
+	}
+	if (lua_isthread(L, idx)) {
+		lcu_Operation *op = findop(sched, lua_tothread(L, idx));
+		if (op) op->priority = priority;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_PRIORITIESREGKEY);
+	lua_pushvalue(L, idx < 0 ? idx-1 : idx);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, -3) == LUA_TUSERDATA) {
+		PriorityTag *tag = (PriorityTag *)lua_touserdata(L, -1);
+		sched->ready->classes[tag->priority]--;
+		if (priority == DEFPRIORITY) {
+			tag->sched = NULL;  /* not counted anymore */
+			lua_pop(L, 1);
+			lua_pushnil(L);
+		} else {
+			tag->priority = priority;
+			sched->ready->classes[priority]++;
+		}
+	} else if (priority != DEFPRIORITY) {
+		PriorityTag *tag;
+		lua_pop(L, 1);
+		tag = (PriorityTag *)lua_newuserdatauv(L, sizeof(PriorityTag), 0);
+		tag->sched = NULL;
+		tag->priority = priority;
+		lcuL_setfinalizer(L, prioritytag_gc);
+		tag->sched = sched;
+		sched->ready->classes[priority]++;
+	}
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	updateclasses(sched->ready);
+}
+
+LCUI_FUNC int lcu_getpriority (lua_State *L, int idx) {
+	return getpriority(L, idx);
+}
+
+static void checkyieldable (lua_State *L) {
+	if (!lua_isyieldable(L)) luaL_error(L, "unable to yield");
+}
+
+static lcu_Operation *valueop (lcu_Scheduler *sched, lua_State *L) {
+	lcu_Operation *op = sched->current;
+	if (op == NULL || opthread(op) != L) op = findop(sched, L);
+	lcu_assert(op != NULL);
 	return op;
 }
 
-LCUI_FUNC void lcu_setopvalue (lua_State *L) {
-	pushopmap(L);
-	lua_pushthread(L);
-	if (lua_gettable(L, -2) == LUA_TUSERDATA) {
-		lua_pushvalue(L, -3);
-		lua_setiuservalue(L, -2, 1);
+static void setvalue (lua_State *L, lcu_Scheduler *sched, lcu_Operation *op) {
+	if (op->value >= 0) {
+		freeanchor(sched, op->value);
+		op->value = -1;
 	}
-	else lcu_assert(0);
-	lua_pop(L, 3);  /* pops 'lcu_Operation', 'opmap' and 'value' */
+	if (lua_isnil(L, -1)) lua_pop(L, 1);
+	else op->value = anchorvalue(L, sched);
 }
 
-LCUI_FUNC int lcu_pushopvalue (lua_State *L) {
-	int ltype;
-	pushopmap(L);
-	lua_pushthread(L);
-	ltype = lua_gettable(L, -2);
-	lua_remove(L, -2);  /* opmap */
-	if (ltype == LUA_TUSERDATA) {
-		ltype = lua_getiuservalue(L, -1, 1);
-		lua_remove(L, -2);  /* lcu_Operation */
+static int pushvalue (lua_State *L, lcu_Scheduler *sched, lcu_Operation *op) {
+	if (op->value < 0) {
+		lua_pushnil(L);
+		return LUA_TNIL;
 	}
-	else lcu_assert(ltype == LUA_TNIL);
-	return ltype;
+	pushanchored(L, sched, op->value);
+	return lua_type(L, -1);
+}
+
+LCUI_FUNC void lcu_setopvalue (lua_State *L, lcu_Scheduler *sched) {
+	setvalue(L, sched, valueop(sched, L));
+}
+
+LCUI_FUNC int lcu_pushopvalue (lua_State *L, lcu_Scheduler *sched) {
+	return pushvalue(L, sched, valueop(sched, L));
 }
 
 static void closedhdl (uv_handle_t *handle) {
-	lcu_Operation *op = (lcu_Operation *)handle;
+	lcu_Operation *op = tooperation(handle);
 	uv_loop_t *loop = handle->loop;
-	lua_State *L = (lua_State *)loop->data;
 	lua_State *thread = (lua_State *)handle->data;
 	uv_req_t *request = torequest(op);
 	lcu_Scheduler *sched = lcu_tosched(loop);
 	lcu_log(op, thread, "closed operation handle");
+	lcu_probe2(close, op, thread);
 	lcu_assert(!lcuL_maskflag(op, FLAG_REQUEST|FLAG_THRSAVED));
 	sched->nactive--;
 	lcuL_setflag(op, FLAG_REQUEST|FLAG_THRSAVED);
@@ -194,7 +1193,7 @@ static void closedhdl (uv_handle_t *handle) {
 	request->data = thread;
 	if (!lcuL_maskflag(op, FLAG_PENDING)) {
 		lcuL_clearflag(op, FLAG_THRSAVED);
-		freevalue(L, (void *)request);
+		freethread(sched, op);
 	}
 	else lcuU_resumecoreq(loop, request, 0);
 }
@@ -211,7 +1210,11 @@ static void cancelop (lcu_Operation *op) {
 	lcu_assert(!lcuL_maskflag(op, FLAG_CLEANUP));
 	if (lcuL_maskflag(op, FLAG_REQUEST)) {
 		uv_req_t *request = torequest(op);
-		uv_cancel(request);
+		if (request->type == LCU_WHEELREQ) {
+			WheelRequest *wheelreq = (WheelRequest *)request;
+			cancelentry(lcu_tosched(wheelreq->loop)->wheel, &wheelreq->entry);
+		}
+		else uv_cancel(request);
 		lcu_log(op, request->data, "canceled operation request");
 	} else {
 		uv_handle_t *handle = tohandle(op);
@@ -222,21 +1225,28 @@ static void cancelop (lcu_Operation *op) {
 	}
 }
 
+static void wakeexpired (lcu_Scheduler *sched, lua_State *L);
+
+#define checkexpired(S,L)	if ((S)->expired) wakeexpired(S, L)
+
 static int k_endop (lua_State *L, int status, lua_KContext kctx) {
-	lcu_Operation *op = tothrop(L);
 	int narg = (int)kctx;
 	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg);
+	lcu_Operation *op = findop(sched, L);
 	lcu_assert(status == LUA_YIELD);
 	lcu_assert(lcuL_maskflag(op, FLAG_PENDING|FLAG_CLEANUP) == FLAG_PENDING);
 	lua_remove(L, narg--);  /* remove 'sched' */
 	lcuL_clearflag(op, FLAG_PENDING);
 	if (haltedop(L, sched)) {
 		lcu_log(op, L, "resumed coroutine");
+		lcu_probe3(resume, op, L, 1);
 		if (op->cancel == NULL || op->cancel(L)) cancelop(op);
 		else lcuL_setflag(op, FLAG_CLEANUP);
 	} else {
 		lcu_log(op, L, "resumed operation");
-		if (op->results) return op->results(L);
+		lcu_probe3(resume, op, L, 0);
+		return parkready(L, sched, op, op->priority,
+		                 op->results ? op->results(L) : lua_gettop(L)-narg);
 	}
 	return lua_gettop(L)-narg; /* return yield */
 }
@@ -248,8 +1258,11 @@ static int startedopk (lua_State *L,
 	lcu_assert(!lcuL_maskflag(op, FLAG_PENDING|FLAG_CLEANUP));
 	if (nret < 0) {  /* shall yield, and wait for callback */
 		lcuL_setflag(op, FLAG_PENDING);
+		startlatency(sched, &op->started);
+		checkexpired(sched, L);
 		lua_pushlightuserdata(L, (void *)sched);
 		lcu_log(op, L, "suspended operation");
+		lcu_probe2(suspend, op, L);
 		return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_endop);
 	}
 	cancelop(op);
@@ -260,26 +1273,23 @@ static int startedopk (lua_State *L,
 #define startcohdlk(L,S,O,F,U) startedopk(L, S, O, (F)(L, tohandle(O), U, O))
 
 static int k_resetopk (lua_State *L, int status, lua_KContext kctx) {
-	lcu_Operation *op = tothrop(L);
 	int narg = (int)kctx;
-	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg-2);
+	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg-3);
+	lcu_Operation *op = findop(sched, L);
 	lcu_assert(status == LUA_YIELD);
 	lcu_assert(lcuL_maskflag(op, FLAG_PENDING));
 	lcuL_clearflag(op, FLAG_PENDING);
 	if (!haltedop(L, sched)) {
-		int mkreq = lua_toboolean(L, narg);
+		size_t sz = (size_t)lua_tointeger(L, narg);
+		int mkreq = lua_toboolean(L, narg-1);
+		void *setup = lua_touserdata(L, narg-2);
 		lcu_log(op, L, "resumed operation");
 		lcu_assert(lcuL_maskflag(op, FLAG_REQUEST));
 		lcu_assert(torequest(op)->type == UV_UNKNOWN_REQ);
-		if (mkreq) {
-			lcu_RequestSetup setup = (lcu_RequestSetup)lua_touserdata(L, narg-1);
-			lua_settop(L, narg-3);  /* discard yield, 'sched', 'setup' and 'mkreq' */
-			return startcoreqk(L, sched, op, setup);
-		} else {
-			lcu_HandleSetup setup = (lcu_HandleSetup)lua_touserdata(L, narg-1);
-			lua_settop(L, narg-3);  /* discard yield, 'sched', 'setup' and 'mkreq' */
-			return startcohdlk(L, sched, op, setup, lcu_toloop(sched));
-		}
+		lua_settop(L, narg-4);  /* discard yield, 'sched', 'setup', 'mkreq' and 'sz' */
+		op = fitthrop(L, sched, op, sz);
+		if (mkreq) return startcoreqk(L, sched, op, (lcu_RequestSetup)setup);
+		return startcohdlk(L, sched, op, (lcu_HandleSetup)setup, lcu_toloop(sched));
 	}
 	else lcu_log(op, L, "resumed coroutine");
 	return lua_gettop(L)-narg; /* return yield */
@@ -289,12 +1299,16 @@ static int yieldresetk (lua_State *L,
                         lcu_Scheduler *sched,
                         lcu_Operation *op,
                         int mkreq,
-                        void *setup) {
+                        void *setup,
+                        size_t sz) {
 	lcu_assert(!lcuL_maskflag(op, FLAG_PENDING));
 	lua_pushlightuserdata(L, (void *)sched);
 	lua_pushlightuserdata(L, (void *)setup);
 	lua_pushboolean(L, mkreq);
+	lua_pushinteger(L, (lua_Integer)sz);
 	lcuL_setflag(op, FLAG_PENDING);
+	op->started = 0;
+	checkexpired(sched, L);
 	lcu_log(op, L, "suspended operation");
 	return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_resetopk);
 }
@@ -330,6 +1344,78 @@ LCUI_FUNC int lcu_shallsuspend (lcu_Scheduler *sched) {
 	return sched->nasync > 0 && sched->nasync == sched->nactive;
 }
 
+LCUI_FUNC void lcu_setaccounting (lcu_Scheduler *sched, int enabled) {
+	sched->accounting = enabled;
+}
+
+LCUI_FUNC void lcu_setwatchdog (lcu_Scheduler *sched, uint64_t nsecs, int warn) {
+	sched->stallns = nsecs;
+	sched->stallwarn = warn;
+}
+
+LCUI_FUNC void lcu_haltsched (lcu_Scheduler *sched) {
+	sched->halted = 1;
+	uv_stop(lcu_toloop(sched));
+}
+
+static void uv_onbudget (uv_timer_t *timer) {
+	(void)timer;  /* just wakes up the loop */
+}
+
+LCUI_FUNC int lcu_runbudget (lcu_Scheduler *sched, uint64_t *nsecs, size_t *nresumes) {
+	uv_loop_t *loop = lcu_toloop(sched);
+	uv_timer_t *timer = &sched->budget;
+	uint64_t budget = *nsecs, elapsed = 0, start = uv_hrtime();
+	size_t resumed = sched->nresumes;
+	int pending;
+	if (timer->data == NULL) {
+		uv_timer_init(loop, timer);
+		uv_unref((uv_handle_t *)timer);  /* does not keep the loop alive */
+		timer->data = (void *)sched;
+	}
+	sched->halted = 0;
+	do {
+		uint64_t msecs = (budget-elapsed)/1000000;
+		if (msecs > 0) {
+			uv_timer_start(timer, uv_onbudget, msecs, 0);
+			pending = uv_run(loop, UV_RUN_ONCE);
+			uv_timer_stop(timer);
+		} else {  /* less than the timer resolution is left */
+			pending = uv_run(loop, UV_RUN_NOWAIT);
+			budget = elapsed;
+		}
+		elapsed = uv_hrtime()-start;
+	} while (pending && !sched->halted && elapsed < budget);
+	*nsecs = elapsed;
+	*nresumes = sched->nresumes-resumed;
+	return pending;
+}
+
+LCUI_FUNC int lcu_runspin (lcu_Scheduler *sched, uint64_t window,
+                           size_t *nspins, size_t *nwaits) {
+	uv_loop_t *loop = lcu_toloop(sched);
+	uint64_t idle = uv_hrtime();  /* when the loop last had no work */
+	size_t resumed = sched->nresumes;
+	int pending;
+	*nspins = 0;
+	*nwaits = 0;
+	sched->halted = 0;
+	do {
+		if (uv_hrtime()-idle < window) {
+			(*nspins)++;
+			pending = uv_run(loop, UV_RUN_NOWAIT);
+		} else {
+			(*nwaits)++;
+			pending = uv_run(loop, UV_RUN_ONCE);
+		}
+		if (sched->nresumes != resumed) {  /* some work was done */
+			resumed = sched->nresumes;
+			idle = uv_hrtime();
+		}
+	} while (pending && !sched->halted);
+	return pending;
+}
+
 LCUI_FUNC void lcuU_checksuspend (uv_loop_t *loop) {
 	lua_State *L = (lua_State *)loop->data;
 	lcu_Scheduler *sched = lcu_tosched(loop);
@@ -343,20 +1429,39 @@ LCUI_FUNC void lcuU_checksuspend (uv_loop_t *loop) {
 }
 
 
+static AwaitGroup *arminggroup (lcu_Scheduler *sched, lua_State *L);
+
+static int armgroupop (lua_State *L,
+                       lcu_Scheduler *sched,
+                       AwaitGroup *group,
+                       int mkreq,
+                       void *setup,
+                       size_t sz,
+                       lua_CFunction results,
+                       lua_CFunction cancel);
+
+
 /*
  * coroutine request
  */
 
 LCUI_FUNC int lcuT_resetcoreqk (lua_State *L,
+                                uv_req_type type,
                                 lcu_Scheduler *sched,
                                 lcu_RequestSetup setup,
                                 lua_CFunction results,
                                 lua_CFunction cancel) {
-	lcu_Operation *op = tothrop(L);
+	size_t sz = reqsize(type);
+	AwaitGroup *group = arminggroup(sched, L);
+	lcu_Operation *op;
+	if (group) return armgroupop(L, sched, group, 1, (void *)setup, sz, results, cancel);
+	op = tothrop(L, sched, sz);
 	checkyieldable(L);
-	switch (checkreset(op, results, cancel, 0)) {
-		case FREEOP: return startcoreqk(L, sched, op, setup);
-		case WAITOP: return yieldresetk(L, sched, op, 1, (void *)setup);
+	switch (checkreset(op, results, cancel, UV_UNKNOWN_HANDLE)) {
+		case FREEOP:
+			op = fitthrop(L, sched, op, sz);
+			return startcoreqk(L, sched, op, setup);
+		case WAITOP: return yieldresetk(L, sched, op, 1, (void *)setup, sz);
 		default: lcu_assert(0);
 	}
 	return 0;  /* unreachable */
@@ -371,7 +1476,7 @@ LCUI_FUNC void lcuT_armcoreq (lua_State *L,
 	if (err >= 0) {
 		lcu_Scheduler *sched = lcu_tosched(loop);
 		if (!lcuL_maskflag(op, FLAG_THRSAVED)) {
-			savethread(L, (void *)request);  // TODO: memory error here makes 'lcu_Operation' be GC.
+			savethread(L, sched, op);
 			lcuL_setflag(op, FLAG_THRSAVED);
 		}
 		sched->nactive++;
@@ -380,16 +1485,38 @@ LCUI_FUNC void lcuT_armcoreq (lua_State *L,
 	}
 }
 
+LCUI_FUNC void lcuT_armwheelreq (lua_State *L,
+                                 uv_loop_t *loop,
+                                 lcu_Operation *op,
+                                 uint64_t msecs,
+                                 lcu_WheelCallback callback) {
+	WheelRequest *wheelreq = (WheelRequest *)torequest(op);
+	TimerWheel *wheel = getwheel(L, lcu_tosched(loop));
+	lcu_assert(opsizecls(sizeof(WheelRequest)) <= op->sizecls);
+	wheelreq->request.type = LCU_WHEELREQ;
+	wheelreq->loop = loop;
+	wheelreq->entry.expired = expiredreq;
+	wheelreq->callback = callback;
+	startentry(wheel, &wheelreq->entry, msecs);
+	lcuT_armcoreq(L, loop, op, 0);
+}
+
 LCUI_FUNC lua_State *lcuU_endcoreq (uv_loop_t *loop, uv_req_t *request) {
-	lua_State *L = (lua_State *)loop->data;
-	lcu_Operation *op = (lcu_Operation *)request;
+	lcu_Operation *op = tooperation(request);
 	lcu_Scheduler *sched = lcu_tosched(loop);
+	int type = (int)request->type;
 	sched->nactive--;
 	lcu_assert(lcuL_maskflag(op, FLAG_REQUEST|FLAG_THRSAVED) == (FLAG_REQUEST|FLAG_THRSAVED));
 	request->type = UV_UNKNOWN_REQ;
-	if (lcuL_maskflag(op, FLAG_PENDING)) return (lua_State *)request->data;
+	if (lcuL_maskflag(op, FLAG_PENDING)) {
+		if (type < NUMREQKINDS) {
+			sched->reqresumes[type]++;
+			endlatency(sched, &op->started, reqkind(type));
+		}
+		return (lua_State *)request->data;
+	}
 	lcuL_clearflag(op, FLAG_THRSAVED|FLAG_CLEANUP);
-	freevalue(L, (void *)request);
+	freethread(sched, op);
 	lcuU_checksuspend(loop);
 	return NULL;
 }
@@ -397,13 +1524,18 @@ LCUI_FUNC lua_State *lcuU_endcoreq (uv_loop_t *loop, uv_req_t *request) {
 LCUI_FUNC void lcuU_resumecoreq (uv_loop_t *loop, uv_req_t *request, int narg) {
 	lua_State *L = (lua_State *)loop->data;
 	lua_State *thread = (lua_State *)request->data;
-	lcu_Operation *op = (lcu_Operation *)request;
+	lcu_Operation *op = tooperation(request);
+	lcu_Scheduler *sched = lcu_tosched(loop);
 	lcu_assert(lcuL_maskflag(op, FLAG_REQUEST|FLAG_THRSAVED|FLAG_PENDING) == (FLAG_REQUEST|FLAG_THRSAVED|FLAG_PENDING));
 	lcu_assert(request->type == UV_UNKNOWN_REQ);
+	sched->waking = (void *)op;
 	resumethread(thread, L, narg, loop);
-	if (lcuL_maskflag(op, FLAG_REQUEST) && request->type == UV_UNKNOWN_REQ) {
+	sched->waking = NULL;
+	if (!lcuL_maskflag(op, FLAG_GROUPED))
+		op = findop(sched, thread);  /* 'thread' might be using another op now */
+	if (lcuL_maskflag(op, FLAG_REQUEST) && torequest(op)->type == UV_UNKNOWN_REQ) {
 		lcuL_clearflag(op, FLAG_THRSAVED);
-		freevalue(L, (void *)request);
+		freethread(sched, op);
 	}
 	lcuU_checksuspend(loop);
 }
@@ -419,14 +1551,20 @@ LCUI_FUNC int lcuT_resetcohdlk (lua_State *L,
                                 lcu_HandleSetup setup,
                                 lua_CFunction results,
                                 lua_CFunction cancel) {
-	lcu_Operation *op = tothrop(L);
+	size_t sz = hdlsize(type < 0 ? -type : type);
+	AwaitGroup *group = arminggroup(sched, L);
+	lcu_Operation *op;
 	uv_loop_t *loop = NULL;
 	lcu_assert(type);
+	if (group) return armgroupop(L, sched, group, 0, (void *)setup, sz, results, cancel);
+	op = tothrop(L, sched, sz);
 	checkyieldable(L);
-	switch (checkreset(op, results, cancel, type)) {
-		case FREEOP: loop = lcu_toloop(sched); /* FALLTHRU */
+	switch (checkreset(op, results, cancel, type < 0 ? UV_UNKNOWN_HANDLE : type)) {
+		case FREEOP:
+			op = fitthrop(L, sched, op, sz);
+			loop = lcu_toloop(sched); /* FALLTHRU */
 		case SAMEOP: return startcohdlk(L, sched, op, setup, loop);
-		case WAITOP: return yieldresetk(L, sched, op, 0, (void *)setup);
+		case WAITOP: return yieldresetk(L, sched, op, 0, (void *)setup, sz);
 	}
 	return 0;  /* unreachable */
 }
@@ -436,7 +1574,7 @@ LCUI_FUNC int lcuT_armcohdl (lua_State *L, lcu_Operation *op, int err) {
 	if (err >= 0) {
 		uv_handle_t *handle = tohandle(op);
 		lcu_Scheduler *sched = lcu_tosched(handle->loop);
-		if (!lcuL_maskflag(op, FLAG_THRSAVED)) savethread(L, (void *)handle);  // TODO: memory error here makes 'lcu_Operation' be GC.
+		if (!lcuL_maskflag(op, FLAG_THRSAVED)) savethread(L, sched, op);
 		handle->data = (void *)L;
 		lcuL_clearflag(op, FLAG_REQUEST|FLAG_THRSAVED);
 		if (handle->type == UV_ASYNC) sched->nasync++;
@@ -449,9 +1587,10 @@ LCUI_FUNC int lcuT_armcohdl (lua_State *L, lcu_Operation *op, int err) {
 }
 
 LCUI_FUNC int lcuU_endcohdl (uv_handle_t *handle) {
-	lcu_Operation *op = (lcu_Operation *)handle;
+	lcu_Operation *op = tooperation(handle);
 	lcu_assert(!lcuL_maskflag(op, FLAG_REQUEST));
 	if (lcuL_maskflag(op, FLAG_PENDING|FLAG_CLEANUP) == FLAG_PENDING) return 1;
+	if (lcuL_maskflag(op, FLAG_PARKED)) return 0;  /* kept until thread is resumed */
 	lcuL_clearflag(op, FLAG_CLEANUP);
 	cancelop(op);
 	lcuU_checksuspend(handle->loop);
@@ -462,13 +1601,124 @@ LCUI_FUNC void lcuU_resumecohdl (uv_handle_t *handle, int narg) {
 	uv_loop_t *loop = handle->loop;
 	lua_State *L = (lua_State *)loop->data;
 	lua_State *thread = (lua_State *)handle->data;
-	lcu_Operation *op = (lcu_Operation *)handle;
+	lcu_Operation *op = tooperation(handle);
+	lcu_Scheduler *sched = lcu_tosched(loop);
+	if (lcuL_maskflag(op, FLAG_PARKED)) return;  /* thread is not awaiting it */
 	lcu_assert(lcuL_maskflag(op, FLAG_REQUEST|FLAG_PENDING) == FLAG_PENDING);
+	sched->hdlresumes[handle->type]++;
+	endlatency(sched, &op->started, hdlkind(handle->type));
+	sched->waking = (void *)op;
 	resumethread(thread, L, narg, loop);
-	if (!lcuL_maskflag(op, FLAG_PENDING|FLAG_CLEANUP)) cancelop(op);
+	sched->waking = NULL;
+	if (!lcuL_maskflag(op, FLAG_PENDING|FLAG_CLEANUP|FLAG_PARKED)) cancelop(op);
 	lcuU_checksuspend(loop);
 }
 
+LCUI_FUNC void lcuU_sethdlvalue (uv_handle_t *handle) {
+	lua_State *thread = (lua_State *)handle->data;
+	setvalue(thread, lcu_tosched(handle->loop), tooperation(handle));
+}
+
+LCUI_FUNC int lcuU_pushhdlvalue (uv_handle_t *handle) {
+	lua_State *thread = (lua_State *)handle->data;
+	return pushvalue(thread, lcu_tosched(handle->loop), tooperation(handle));
+}
+
+/*
+ * deadline
+ */
+
+typedef struct Deadline {
+	WheelEntry entry;  /* 'entry.prev' is NULL when not in any list */
+	int anchor;  /* slot anchoring the deadline while armed, or -1 */
+	lua_State *thread;  /* coroutine calling the function with the deadline */
+} Deadline;
+
+static int awaitingop (lcu_Scheduler *sched, lua_State *thread) {
+	lcu_Operation *op = findop(sched, thread);
+	if (op && lcuL_maskflag(op, FLAG_PENDING)) return 1;
+	/* other operations leave 'sched' on top of the suspended coroutine */
+	return lua_gettop(thread) > 0 && lua_touserdata(thread, -1) == (void *)sched;
+}
+
+static int deadline_gc (lua_State *L) {
+	Deadline *deadline = (Deadline *)lua_touserdata(L, 1);
+	if (deadline->entry.prev) unlinkentry(&deadline->entry);
+	return 0;
+}
+
+static void expireddeadline (uv_loop_t *loop, WheelEntry *entry) {
+	Deadline *deadline = (Deadline *)entry;
+	lua_State *L = (lua_State *)loop->data;
+	lcu_Scheduler *sched = lcu_tosched(loop);
+	lua_State *thread = deadline->thread;
+	int status = lua_status(thread);
+	lua_Debug ar;
+	entry->prev = NULL;
+	if (status == LUA_YIELD && awaitingop(sched, thread)) {
+		if (deadline->anchor >= 0) {
+			freeanchor(sched, deadline->anchor);
+			deadline->anchor = -1;
+		}
+		lua_pushthread(thread);
+		lua_xmove(thread, L, 1);  /* keep it while resuming thread */
+		lua_pushboolean(thread, 0);
+		lua_pushliteral(thread, "timeout");
+		runthread(thread, L, 2, loop);  /* explicit resume to cancel operation */
+		lua_pop(L, 1);
+		lcuU_checksuspend(loop);
+	} else if (status == LUA_YIELD || (status == LUA_OK && lua_getstack(thread, 0, &ar))) {
+		if (deadline->anchor >= 0) {  /* from now on, it is collected with 'thread' */
+			pushanchored(L, sched, deadline->anchor);
+			lcuL_setfinalizer(L, deadline_gc);
+			lua_pop(L, 1);
+			freeanchor(sched, deadline->anchor);
+			deadline->anchor = -1;
+		}
+		linkentry(&sched->expired, entry);  /* cancel its next operation instead */
+	} else if (deadline->anchor >= 0) {  /* 'thread' is dead */
+		freeanchor(sched, deadline->anchor);
+		deadline->anchor = -1;
+	}
+}
+
+static void wakeexpired (lcu_Scheduler *sched, lua_State *L) {
+	WheelEntry *entry = sched->expired;
+	while (entry) {
+		WheelEntry *next = entry->next;
+		if (((Deadline *)entry)->thread == L) cancelentry(sched->wheel, entry);
+		entry = next;
+	}
+}
+
+LCUI_FUNC void lcuT_pushdeadline (lua_State *L, lcu_Scheduler *sched, uint64_t msecs) {
+	TimerWheel *wheel = getwheel(L, sched);
+	Deadline *deadline = (Deadline *)lua_newuserdatauv(L, sizeof(Deadline), 1);
+	deadline->anchor = -1;
+	deadline->thread = L;
+	lua_pushthread(L);
+	lua_setiuservalue(L, -2, 1);
+	lua_pushvalue(L, -1);
+	deadline->anchor = anchorvalue(L, sched);
+	deadline->entry.expired = expireddeadline;
+	startentry(wheel, &deadline->entry, msecs);
+}
+
+LCUI_FUNC void lcuT_stopdeadline (lua_State *L, lcu_Scheduler *sched, int idx) {
+	Deadline *deadline = (Deadline *)lua_touserdata(L, idx);
+	if (deadline->entry.prev) {
+		TimerWheel *wheel = sched->wheel;
+		stopentry(wheel, &deadline->entry);
+		deadline->entry.prev = NULL;
+		if (wheel->count == 0 && wheel->ready == NULL) uv_timer_stop(&wheel->timer);
+	}
+	if (deadline->anchor >= 0) {
+		freeanchor(sched, deadline->anchor);
+		deadline->anchor = -1;
+	}
+}
+
+
 /*
  * userdata handle
  */
@@ -485,6 +1735,8 @@ LCUI_FUNC lcu_UdataHandle *lcuT_createudhdl (lua_State *L,
 	udhdl = (lcu_UdataHandle *)lua_newuserdatauv(L, sz, 2);
 	lcu_assert(sz >= sizeof(lcu_UdataHandle));
 	udhdl->flags = LCU_HANDLECLOSEDFLAG;
+	udhdl->anchor = -1;
+	udhdl->frame = -1;
 	udhdl->stop = NULL;
 	udhdl->step = NULL;
 	udhdl->handle.data = NULL;
@@ -496,9 +1748,11 @@ LCUI_FUNC lcu_UdataHandle *lcuT_createudhdl (lua_State *L,
 
 static void closedudhdl (uv_handle_t *handle) {
 	uv_loop_t *loop = handle->loop;
-	lua_State *L = (lua_State *)loop->data;
-	freevalue(L, (void *)handle);  /* becomes garbage */
-	lcu_log(handle, L, "closed object handle");
+	lcu_UdataHandle *udhdl = lcu_hdl2ud(handle);
+	freeanchor(lcu_tosched(loop), udhdl->anchor);  /* becomes garbage */
+	udhdl->anchor = -1;
+	lcu_log(handle, loop->data, "closed object handle");
+	lcu_probe2(close, handle, loop->data);
 }
 
 LCUI_FUNC int lcu_closeudhdl (lua_State *L, int idx) {
@@ -521,8 +1775,10 @@ LCUI_FUNC int lcu_closeudhdl (lua_State *L, int idx) {
 			lua_pushnil(L);
 			lua_setiuservalue(L, idx, UPV_THREAD);  /* allow thread to be collected */
 		}
-		lua_pushvalue(L, idx);
-		savevalue(L, (void *)handle);
+		if (udhdl->anchor < 0) {
+			lua_pushvalue(L, idx);
+			udhdl->anchor = anchorvalue(L, lcu_tosched(handle->loop));
+		}
 		uv_close(handle, closedudhdl);
 		lcuL_setflag(udhdl, LCU_HANDLECLOSEDFLAG);
 		lcu_log(handle, L, "closing object handle");
@@ -543,14 +1799,17 @@ static void stopudhdl (lua_State *L, lcu_UdataHandle *udhdl) {
 	int err = 0;
 	if (udhdl->stop) err = udhdl->stop(handle);
 	lcu_assert(handle->data == NULL);
-	pushsaved(L, (void *)handle);  /* restore saved object being stopped */
+	pushanchored(L, sched, udhdl->anchor);  /* restore saved object being stopped */
 	if (err < 0) {
 		lcu_closeudhdl(L, -1);
 		lcuL_warnerr(L, "object:stop", err);
 	} else {
 		lua_pushnil(L);
 		lua_setiuservalue(L, -2, UPV_THREAD);
-		if (!lcuL_maskflag(udhdl, LCU_HANDLECLOSEDFLAG)) freevalue(L, (void *)handle);
+		if (!lcuL_maskflag(udhdl, LCU_HANDLECLOSEDFLAG)) {
+			freeanchor(sched, udhdl->anchor);
+			udhdl->anchor = -1;
+		}
 	}
 	lua_pop(L, 1);  /* discard restored saved object */
 	udhdl->stop = NULL;
@@ -560,32 +1819,47 @@ static void stopudhdl (lua_State *L, lcu_UdataHandle *udhdl) {
 
 static int k_endudhdlk (lua_State *L, int status, lua_KContext kctx);
 
-static int scheduleudhdlk (lua_State *L, uv_handle_t *handle) {
+static int armgroupobj (lua_State *L,
+                        lcu_Scheduler *sched,
+                        AwaitGroup *group,
+                        uv_handle_t *handle);
+
+static int scheduleudhdlk (lua_State *L, uv_handle_t *handle, AwaitGroup *group) {
 	lcu_assert(handle->type != UV_UNKNOWN_HANDLE);
 	lcu_assert(uv_has_ref(handle));
 	lcu_assert(!uv_is_closing(handle));
+	lcu_Scheduler *sched = lcu_tosched(handle->loop);
 	lua_pushthread(L);
 	lua_setiuservalue(L, 1, UPV_THREAD);
 	handle->data = (void *)L;
+	startlatency(sched, &lcu_hdl2ud(handle)->started);
+	if (group) return armgroupobj(L, sched, group, handle);
+	checkexpired(sched, L);
+	lua_pushlightuserdata(L, (void *)sched);
 	lcu_log(handle, L, "suspended operation");
+	lcu_probe2(suspend, handle, L);
 	return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_endudhdlk);
 }
 
 static int k_endudhdlk (lua_State *L, int status, lua_KContext kctx) {
+	int narg = (int)kctx;
 	lcu_UdataHandle *udhdl = (lcu_UdataHandle *)lua_touserdata(L, 1);
 	uv_handle_t *handle = lcu_ud2hdl(udhdl);
 	lcu_assert(status == LUA_YIELD);
 	lcu_assert(handle->data != NULL);
+	lua_remove(L, narg--);  /* remove 'sched' */
 	handle->data = NULL;
 	if (!haltedop(L, handle->loop)) {
 		int nret = udhdl->step(L);
 		lcu_log(handle, L, "resumed operation");
-		if (nret >= 0) return nret;
-		return scheduleudhdlk (L, handle);
+		lcu_probe3(resume, handle, L, 0);
+		if (nret >= 0) return parkready(L, lcu_tosched(handle->loop), NULL, udhdl->priority, nret);
+		return scheduleudhdlk(L, handle, NULL);
 	}
 	stopudhdl(L, udhdl);
 	lcu_log(handle, L, "resumed coroutine");
-	return lua_gettop(L)-((int)kctx);
+	lcu_probe3(resume, handle, L, 1);
+	return lua_gettop(L)-narg;
 }
 
 LCUI_FUNC int lcuT_resetudhdlk (lua_State *L,
@@ -595,13 +1869,15 @@ LCUI_FUNC int lcuT_resetudhdlk (lua_State *L,
                                 lua_CFunction step) {
 	uv_handle_t *handle = lcu_ud2hdl(udhdl);
 	lcu_Scheduler *sched = lcu_tosched(handle->loop);
+	AwaitGroup *group = arminggroup(sched, L);
 	luaL_argcheck(L, handle->data == NULL, 1, "already in use");
-	checkyieldable(L);
+	if (group == NULL) checkyieldable(L);
 	udhdl->step = step;
+	udhdl->priority = threadclass(L, sched);
 	if (udhdl->stop == NULL) {  /* 'handle' was started, calling op again */
 		int err;
 		lua_pushvalue(L, 1);
-		savevalue(L, (void *)handle);  /* save now, because it may raise memory error */
+		udhdl->anchor = anchorvalue(L, sched);  /* save now, because it may raise memory error */
 		handle->data = (void *)L;  /* this is eventually done if 'start' returns no error, */
 		                           /* but libuv might call 'uv_alloc_cb' inside 'uv_*_start', */
 		                           /* therefore we must set everything up prematurely. */
@@ -610,27 +1886,43 @@ LCUI_FUNC int lcuT_resetudhdlk (lua_State *L,
 		if (err < 0) {
 			udhdl->step = NULL; 
 			handle->data = NULL;  /* rollback the premature setup for callbacks (see above) */
-			freevalue(L, (void *)handle);
+			freeanchor(sched, udhdl->anchor);
+			udhdl->anchor = -1;
 			return lcuL_pusherrres(L, err);
 		}
 		udhdl->stop = stop;
 		sched->nactive++;
 	}
-	return scheduleudhdlk (L, handle);
+	return scheduleudhdlk(L, handle, group);
 }
 
 LCUI_FUNC void lcuU_resumeudhdl (uv_handle_t *handle, int narg) {
 	uv_loop_t *loop = handle->loop;
 	lua_State *L = (lua_State *)loop->data;
 	lua_State *thread = (lua_State *)handle->data;
+	lcu_Scheduler *sched = lcu_tosched(loop);
 	lua_pushthread(thread);
 	lua_xmove(thread, L, 1);  /* save thread in case it is replaced in UPV_THREAD */
+	sched->hdlresumes[handle->type]++;
+	endlatency(sched, &lcu_hdl2ud(handle)->started, hdlkind(handle->type));
+	sched->waking = (void *)handle;
 	resumethread(thread, L, narg, loop);
+	sched->waking = NULL;
 	lua_pop(L, 1);
 	if (handle->data == NULL) stopudhdl(L, lcu_hdl2ud(handle));
 	lcuU_checksuspend(loop);
 }
 
+static void pushmemberarg (lua_State *L, lcu_Scheduler *sched, int slot, int arg);
+
+LCUI_FUNC void lcuU_pushudhdlarg (uv_handle_t *handle, int arg) {
+	lua_State *thread = (lua_State *)handle->data;
+	lcu_UdataHandle *udhdl = lcu_hdl2ud(handle);
+	if (udhdl->frame >= 0)  /* awaited by a group */
+		pushmemberarg(thread, lcu_tosched(handle->loop), udhdl->frame, arg);
+	else lua_pushvalue(thread, arg);
+}
+
 
 /*
  * userdata request
@@ -644,13 +1936,14 @@ LCUI_FUNC lcu_UdataRequest *lcuT_createudreq (lua_State *L, size_t sz) {
 	return udreq;
 }
 
-static void freeudreq (lua_State *L, uv_req_t *request) {
+static void freeudreq (lua_State *L, lcu_Scheduler *sched, uv_req_t *request) {
+	lcu_UdataRequest *udreq = lcu_req2ud(request);
 	lcu_assert(request->type == UV_REQ_TYPE_MAX);
-	pushsaved(L, (void *)request);  /* restore saved object being stopped */
+	pushanchored(L, sched, udreq->anchor);  /* restore saved object being stopped */
 	lua_pushnil(L);
 	lua_setiuservalue(L, -2, UPV_THREAD);
 	request->data = NULL;
-	freevalue(L, (void *)request);
+	freeanchor(sched, udreq->anchor);
 	request->type = UV_UNKNOWN_REQ;
 	lua_pop(L, 1);  /* discard restored saved object */
 }
@@ -668,10 +1961,13 @@ static int k_endudreq (lua_State *L, int status, lua_KContext kctx) {
 		lua_pushnil(L);
 		lua_setiuservalue(L, 1, UPV_THREAD);
 		lcu_log(request, L, "resumed coroutine");
+		lcu_probe3(resume, request, L, 1);
 		if (udreq->cancel == NULL || udreq->cancel(L)) uv_cancel(request);
 	} else {
 		lcu_log(request, L, "resumed operation");
-		if (udreq->results) return udreq->results(L);
+		lcu_probe3(resume, request, L, 0);
+		return parkready(L, sched, NULL, udreq->priority,
+		                 udreq->results ? udreq->results(L) : lua_gettop(L)-narg);
 	}
 	return lua_gettop(L)-narg;
 }
@@ -684,7 +1980,7 @@ static int startedudreqk (lua_State *L,
                           lua_CFunction cancel) {
 	uv_req_t *request = lcu_ud2req(udreq);
 	if (nret >= 0) {
-		freeudreq(L, request);
+		freeudreq(L, sched, request);
 		return nret;
 	}
 	lcu_assert(request->type != UV_UNKNOWN_REQ);
@@ -693,25 +1989,28 @@ static int startedudreqk (lua_State *L,
 	sched->nactive++;
 	udreq->results = results;
 	udreq->cancel = cancel;
+	startlatency(sched, &udreq->started);
+	checkexpired(sched, L);
 	lua_pushlightuserdata(L, (void *)sched);
 	lcu_log(request, L, "suspended operation");
+	lcu_probe2(suspend, request, L);
 	return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_endudreq);
 }
 
 static int k_resetudreqk (lua_State *L, int status, lua_KContext kctx) {
 	int narg = (int)kctx;
-	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg-3);
+	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg);
 	lcu_UdataRequest *udreq = (lcu_UdataRequest *)lua_touserdata(L, 1);
 	uv_req_t *request = lcu_ud2req(udreq);
 	lcu_assert(status == LUA_YIELD);
 	if (!haltedop(L, sched)) {
 		int nret;
 		uv_loop_t *loop = lcu_toloop(sched);
-		lcu_RequestSetup setup = (lcu_RequestSetup)lua_touserdata(L, narg-2);
-		lua_CFunction results = (lua_CFunction)lua_touserdata(L, narg-1);
-		lua_CFunction cancel = (lua_CFunction)lua_touserdata(L, narg);
+		lcu_RequestSetup setup = (lcu_RequestSetup)lua_touserdata(L, narg-3);
+		lua_CFunction results = (lua_CFunction)lua_touserdata(L, narg-2);
+		lua_CFunction cancel = (lua_CFunction)lua_touserdata(L, narg-1);
 		lcu_assert(request->type == UV_UNKNOWN_REQ);
-		lua_settop(L, narg-4);  /* discard yield, 'sched', 'setup', 'results' and 'cancel' */
+		lua_settop(L, narg-4);  /* discard yield, 'setup', 'results', 'cancel' and 'sched' */
 		lcu_log(request, L, "resumed operation");
 		nret = setup(L, request, loop, NULL);
 		return startedudreqk(L, sched, udreq, nret, results, cancel);
@@ -732,9 +2031,10 @@ LCUI_FUNC int lcuT_resetudreqk (lua_State *L,
 	uv_req_t *request = lcu_ud2req(udreq);
 	luaL_argcheck(L, request->data == NULL, 1, "already in use");
 	checkyieldable(L);
+	udreq->priority = threadclass(L, sched);
 	if (request->type == UV_UNKNOWN_REQ) {  /* 'request' is free and collectable */
 		lua_pushvalue(L, 1);
-		savevalue(L, (void *)request);  /* save now, because it may raise memory error */
+		udreq->anchor = anchorvalue(L, sched);  /* save now, because it may raise memory error */
 		request->type = UV_REQ_TYPE_MAX;  /* 'request' is free but not collectable */
 	}
 	lua_pushthread(L);
@@ -746,10 +2046,11 @@ LCUI_FUNC int lcuT_resetudreqk (lua_State *L,
 		return startedudreqk(L, sched, udreq, nret, results, cancel);
 	}
 	/* previous caller was resumed while request was still pending */
-	lua_pushlightuserdata(L, (void *)sched);
 	lua_pushlightuserdata(L, (void *)setup);
 	lua_pushlightuserdata(L, (void *)results);
 	lua_pushlightuserdata(L, (void *)cancel);
+	checkexpired(sched, L);
+	lua_pushlightuserdata(L, (void *)sched);  /* on top, as for other suspended operations */
 	lcu_log(request, L, "suspended operation");
 	return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_resetudreqk);
 }
@@ -760,10 +2061,14 @@ LCUI_FUNC lua_State *lcuU_endudreq (uv_loop_t *loop, uv_req_t *request) {
 	lcu_Scheduler *sched = lcu_tosched(loop);
 	lcu_assert(request->type != UV_UNKNOWN_REQ);
 	lcu_assert(request->type != UV_REQ_TYPE_MAX);
+	if (thread) {
+		sched->reqresumes[request->type]++;
+		endlatency(sched, &lcu_req2ud(request)->started, reqkind(request->type));
+	}
 	request->type = UV_REQ_TYPE_MAX;
 	sched->nactive--;
 	if (thread) return thread;
-	freeudreq(L, request);
+	freeudreq(L, sched, request);
 	lcuU_checksuspend(loop);
 	return NULL;
 }
@@ -775,10 +2080,334 @@ LCUI_FUNC void lcuU_resumeudreq (uv_loop_t *loop, uv_req_t *request, int narg) {
 	lua_xmove(thread, L, 1);  /* save thread in case it is replaced in UPV_THREAD */
 	resumethread(thread, L, narg, loop);
 	lua_pop(L, 1);
-	if (request->type == UV_REQ_TYPE_MAX) freeudreq(L, request);
+	if (request->type == UV_REQ_TYPE_MAX) freeudreq(L, lcu_tosched(loop), request);
 	lcuU_checksuspend(loop);
 }
 
+/*
+ * operation group
+ */
+
+typedef struct AwaitMember {
+	void *awaited;  /* operation, or handle of object, being awaited, or NULL */
+	int object;  /* 'awaited' is the handle of an object */
+	int frame;  /* slot anchoring the values of the call, or -1 */
+} AwaitMember;
+
+/* objects keep the values of the call so their callbacks can get its arguments */
+static int *frameslot (AwaitMember *member) {
+	if (member->object) {
+		uv_handle_t *handle = (uv_handle_t *)member->awaited;
+		return &lcu_hdl2ud(handle)->frame;
+	}
+	return &member->frame;
+}
+
+struct AwaitGroup {
+	lua_State *thread;  /* coroutine awaiting the operations */
+	AwaitGroup *previous;  /* group being armed before this one */
+	const void *function;  /* function of the call being armed */
+	int calling;  /* index of the call being armed */
+	int count;  /* number of calls */
+	AwaitMember members[1];  /* operation of each call */
+};
+
+/* only the await function of each call arms an operation of the group */
+static AwaitGroup *arminggroup (lcu_Scheduler *sched, lua_State *L) {
+	AwaitGroup *group = sched->arming;
+	if (group != NULL && group->thread == L) {
+		lua_Debug ar;
+		const void *function;
+		if (!lua_getstack(L, 0, &ar)) return NULL;
+		luaL_checkstack(L, 1, NULL);
+		lua_getinfo(L, "f", &ar);
+		function = lua_topointer(L, -1);
+		lua_pop(L, 1);
+		if (function == group->function) {
+			lcu_assert(group->members[group->calling].awaited == NULL);
+			return group;
+		}
+	}
+	return NULL;
+}
+
+/* values of the call are restored to compute the results of its operation */
+static void saveframe (lua_State *L, lcu_Scheduler *sched, int *slot) {
+	lua_Debug ar;
+	int i, top = lua_gettop(L);
+	luaL_checkstack(L, 2, NULL);
+	lua_createtable(L, top, 2);
+	for (i = 1; i <= top; i++) {
+		lua_pushvalue(L, i);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushinteger(L, top);
+	lua_setfield(L, -2, "n");
+	lua_getstack(L, 0, &ar);
+	lua_getinfo(L, "f", &ar);
+	lua_setfield(L, -2, "f");
+	*slot = anchorvalue(L, sched);
+}
+
+static int pushframe (lua_State *L,
+                      lcu_Scheduler *sched,
+                      int *slot,
+                      lua_CFunction call,
+                      lua_CFunction f) {
+	lua_Debug ar;
+	int i, n, frame;
+	luaL_checkstack(L, 3, NULL);
+	pushanchored(L, sched, *slot);
+	frame = lua_gettop(L);
+	freeanchor(sched, *slot);
+	*slot = -1;
+	lua_getfield(L, frame, "n");
+	n = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, frame, "f");
+	lua_pushvalue(L, -1);
+	lua_getinfo(L, ">u", &ar);
+	luaL_checkstack(L, ar.nups+n+2, "too many values");
+	for (i = 1; i <= ar.nups; i++) lua_getupvalue(L, frame+1, i);
+	lua_pushcclosure(L, call, ar.nups);  /* so 'f' gets upvalues of the call */
+	lua_replace(L, frame+1);
+	lua_pushlightuserdata(L, (void *)f);
+	lua_pushinteger(L, n);
+	for (i = 1; i <= n; i++) lua_rawgeti(L, frame, i);
+	lua_remove(L, frame);
+	return n+3;
+}
+
+static void pushmemberarg (lua_State *L, lcu_Scheduler *sched, int slot, int arg) {
+	pushanchored(L, sched, slot);
+	lua_rawgeti(L, -1, arg);
+	lua_remove(L, -2);
+}
+
+static int callresults (lua_State *L) {
+	lua_CFunction results = (lua_CFunction)lua_touserdata(L, 1);
+	int nframe = (int)lua_tointeger(L, 2);
+	int nret;
+	lua_rotate(L, 1, -2);
+	lua_pop(L, 2);  /* discard 'results' and 'nframe' */
+	nret = results ? results(L) : lua_gettop(L)-nframe;
+	lcu_assert(nret >= 0);
+	return nret;
+}
+
+static int callcancel (lua_State *L) {
+	lua_CFunction cancel = (lua_CFunction)lua_touserdata(L, 1);
+	lua_rotate(L, 1, -2);
+	lua_pop(L, 2);  /* discard 'cancel' and 'nframe' */
+	lua_pushboolean(L, cancel(L));
+	return 1;
+}
+
+static void dropop (lcu_Scheduler *sched, lcu_Operation *op) {
+	lcuL_clearflag(op, FLAG_PENDING);
+	if (!lcuL_maskflag(op, FLAG_REQUEST) || torequest(op)->type != UV_UNKNOWN_REQ) {
+		cancelop(op);  /* released when its handle is closed or its request ends */
+	} else if (lcuL_maskflag(op, FLAG_THRSAVED)) {
+		lcuL_clearflag(op, FLAG_THRSAVED);
+		freethread(sched, op);
+	}
+	else freeop(sched, op);
+}
+
+static void cancelmember (lua_State *L, lcu_Scheduler *sched, AwaitMember *member) {
+	void *awaited = member->awaited;
+	int *slot = frameslot(member);
+	if (member->object) {
+		uv_handle_t *handle = (uv_handle_t *)awaited;
+		handle->data = NULL;
+		stopudhdl(L, lcu_hdl2ud(handle));
+	} else {
+		lcu_Operation *op = (lcu_Operation *)awaited;
+		int cancel = 1;
+		if (lcuL_maskflag(op, FLAG_PENDING) && op->cancel != NULL) {
+			int n = pushframe(L, sched, slot, callcancel, op->cancel);
+			sched->current = op;
+			lua_call(L, n-1, 1);
+			sched->current = NULL;
+			cancel = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+		if (cancel) dropop(sched, op);
+		else {
+			lcuL_clearflag(op, FLAG_PENDING);
+			lcuL_setflag(op, FLAG_CLEANUP);
+		}
+		lcu_log(op, L, "canceled grouped operation");
+	}
+	if (*slot >= 0) {
+		freeanchor(sched, *slot);
+		*slot = -1;
+	}
+	member->awaited = NULL;
+}
+
+static int finishmember (lua_State *L,
+                         lcu_Scheduler *sched,
+                         AwaitMember *member,
+                         int base) {
+	uv_handle_t *handle = (uv_handle_t *)member->awaited;
+	lcu_Operation *op = NULL;
+	int n;
+	if (member->object) {
+		n = pushframe(L, sched, frameslot(member), callresults, lcu_hdl2ud(handle)->step);
+		handle->data = NULL;  /* stopped if not awaited again */
+	} else {
+		op = (lcu_Operation *)member->awaited;
+		n = pushframe(L, sched, frameslot(member), callresults, op->results);
+		lcuL_clearflag(op, FLAG_PENDING);  /* released once the thread yields */
+	}
+	member->awaited = NULL;
+	lua_rotate(L, base+1, n);  /* place the call below the completion values */
+	sched->current = op;
+	lua_call(L, lua_gettop(L)-base-1, LUA_MULTRET);
+	sched->current = NULL;
+	return lua_gettop(L)-base;
+}
+
+static void endgroup (lua_State *L, lcu_Scheduler *sched, AwaitGroup *group) {
+	int i;
+	sched->arming = group->previous;
+	sched->current = NULL;
+	for (i = 0; i < group->count; i++)
+		if (group->members[i].awaited) cancelmember(L, sched, &group->members[i]);
+}
+
+static int armgroupop (lua_State *L,
+                       lcu_Scheduler *sched,
+                       AwaitGroup *group,
+                       int mkreq,
+                       void *setup,
+                       size_t sz,
+                       lua_CFunction results,
+                       lua_CFunction cancel) {
+	AwaitMember *member = &group->members[group->calling];
+	lcu_Operation *op;
+	uv_req_t *request;
+	int nret;
+	reserveop(L, sched);
+	reserveslot(L, sched);  /* so saving the thread cannot raise errors */
+	op = newop(L, sched, opsizecls(sz));
+	op->flags = FLAG_REQUEST|FLAG_GROUPED;
+	op->value = -1;
+	op->priority = DEFPRIORITY;
+	op->results = results;
+	op->cancel = cancel;
+	request = torequest(op);
+	request->type = UV_UNKNOWN_REQ;
+	request->data = (void *)L;
+	member->awaited = (void *)op;  /* released by 'endgroup' on errors */
+	member->object = 0;
+	sched->current = op;
+	if (mkreq) nret = ((lcu_RequestSetup)setup)(L, request, lcu_toloop(sched), op);
+	else nret = ((lcu_HandleSetup)setup)(L, tohandle(op), lcu_toloop(sched), op);
+	sched->current = NULL;
+	if (nret >= 0) {  /* completed without suspension */
+		member->awaited = NULL;
+		dropop(sched, op);
+		return nret;
+	}
+	saveframe(L, sched, &member->frame);
+	lcuL_setflag(op, FLAG_PENDING);
+	startlatency(sched, &op->started);
+	lcu_log(op, L, "armed grouped operation");
+	return 0;
+}
+
+static int armgroupobj (lua_State *L,
+                        lcu_Scheduler *sched,
+                        AwaitGroup *group,
+                        uv_handle_t *handle) {
+	AwaitMember *member = &group->members[group->calling];
+	member->awaited = (void *)handle;  /* released by 'endgroup' on errors */
+	member->object = 1;
+	saveframe(L, sched, frameslot(member));
+	lcu_log(handle, L, "armed grouped operation");
+	return 0;
+}
+
+static int k_awaitany (lua_State *L, int status, lua_KContext kctx) {
+	int narg = (int)kctx;
+	lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, narg);
+	AwaitGroup *group = (AwaitGroup *)lua_touserdata(L, 1);
+	void *waking = sched->waking;
+	int i, winner = 0;
+	lcu_assert(status == LUA_YIELD);
+	sched->waking = NULL;
+	lua_remove(L, narg--);  /* remove 'sched' */
+	if (!haltedop(L, lcu_toloop(sched))) {
+		for (i = 0; i < group->count; i++)
+			if (group->members[i].awaited == waking) winner = i+1;
+		lcu_assert(winner > 0);
+	}
+	for (i = 0; i < group->count; i++)
+		if (i+1 != winner && group->members[i].awaited)
+			cancelmember(L, sched, &group->members[i]);
+	if (winner > 0) {
+		int nret = finishmember(L, sched, &group->members[winner-1], narg);
+		lua_pushinteger(L, winner);
+		lua_insert(L, narg+1);
+		lcu_log(group, L, "resumed operation group");
+		return parkready(L, sched, NULL, threadclass(L, sched), nret+1);
+	}
+	lcu_log(group, L, "resumed coroutine");
+	return lua_gettop(L)-narg; /* return yield */
+}
+
+LCUI_FUNC int lcuT_awaitanyk (lua_State *L, lcu_Scheduler *sched) {
+	int ncall = lua_gettop(L);
+	int base = ncall+1;  /* group and calls */
+	size_t sz = offsetof(AwaitGroup, members)+(size_t)ncall*sizeof(AwaitMember);
+	AwaitGroup *group = (AwaitGroup *)lua_newuserdatauv(L, sz, 0);
+	int i;
+	group->thread = L;
+	group->function = NULL;
+	group->calling = 0;
+	group->count = ncall;
+	for (i = 0; i < ncall; i++) {
+		group->members[i].awaited = NULL;
+		group->members[i].object = 0;
+		group->members[i].frame = -1;
+	}
+	lua_insert(L, 1);
+	group->previous = sched->arming;
+	sched->arming = group;
+	for (i = 1; i <= ncall; i++) {
+		int narg, j;
+		lua_getfield(L, i+1, "n");
+		narg = lua_isinteger(L, -1) ? (int)lua_tointeger(L, -1) : (int)lua_rawlen(L, i+1);
+		lua_pop(L, 1);
+		if (!lua_checkstack(L, narg)) {
+			endgroup(L, sched, group);
+			return luaL_argerror(L, i, "too many arguments");
+		}
+		for (j = 1; j <= narg; j++) lua_rawgeti(L, i+1, j);
+		group->calling = i-1;
+		group->function = lua_topointer(L, base+1);
+		if (lua_pcall(L, narg-1, LUA_MULTRET, 0) != LUA_OK) {
+			endgroup(L, sched, group);
+			return lua_error(L);
+		}
+		if (group->members[i-1].awaited == NULL) {  /* completed without suspension */
+			int nret = lua_gettop(L)-base;
+			endgroup(L, sched, group);
+			lua_pushinteger(L, i);
+			lua_insert(L, base+1);
+			return nret+1;
+		}
+		lua_settop(L, base);  /* discard returned values */
+	}
+	sched->arming = group->previous;
+	checkexpired(sched, L);
+	lua_pushlightuserdata(L, (void *)sched);
+	lcu_log(group, L, "suspended operation group");
+	return lua_yieldk(L, 0, (lua_KContext)lua_gettop(L), k_awaitany);
+}
+
 /*
  * auxiliary functions
  */
@@ -3,6 +3,7 @@
 
 
 #include "lcuconf.h"
+#include "coutil.h"
 
 #include <uv.h>
 #include <lua.h>
@@ -17,10 +18,6 @@
 
 LCUI_FUNC void lcuM_newmodupvs (lua_State *L);
 
-typedef struct lcu_Scheduler lcu_Scheduler;
-
-typedef struct lcu_Operation lcu_Operation;
-
 #define lcu_getsched(L)	(lcu_Scheduler *)lua_touserdata(L, lua_upvalueindex(1))
 
 #define lcu_tosched(U)	((lcu_Scheduler *)U)
@@ -31,18 +28,37 @@ LCUI_FUNC int lcu_shallsuspend (lcu_Scheduler *sched);
 
 LCUI_FUNC void lcuU_checksuspend (uv_loop_t *loop);
 
-LCUI_FUNC void lcu_setopvalue (lua_State *L);
+LCUI_FUNC void lcu_haltsched (lcu_Scheduler *sched);
 
-LCUI_FUNC int lcu_pushopvalue (lua_State *L);
+LCUI_FUNC void lcu_setwatchdog (lcu_Scheduler *sched, uint64_t nsecs, int warn);
 
-/* request operations */
+LCUI_FUNC void lcu_setaccounting (lcu_Scheduler *sched, int enabled);
 
-typedef int (*lcu_RequestSetup) (lua_State *L,
-                                 uv_req_t *request,
-                                 uv_loop_t *loop,
-                                 lcu_Operation *op);
+LCUI_FUNC void lcu_pushstats (lua_State *L, lcu_Scheduler *sched, int idx);
+
+LCUI_FUNC void lcu_setlatencies (lua_State *L, lcu_Scheduler *sched, int enabled);
+
+LCUI_FUNC void lcu_resetlatencies (lcu_Scheduler *sched);
+
+LCUI_FUNC void lcu_pushlatencies (lua_State *L, lcu_Scheduler *sched);
+
+LCUI_FUNC int lcu_runbudget (lcu_Scheduler *sched, uint64_t *nsecs, size_t *nresumes);
+
+LCUI_FUNC int lcu_runspin (lcu_Scheduler *sched, uint64_t window,
+                           size_t *nspins, size_t *nwaits);
+
+LCUI_FUNC void lcu_setpriority (lua_State *L, lcu_Scheduler *sched, int idx, int priority);
+
+LCUI_FUNC int lcu_getpriority (lua_State *L, int idx);
+
+LCUI_FUNC void lcu_setopvalue (lua_State *L, lcu_Scheduler *sched);
+
+LCUI_FUNC int lcu_pushopvalue (lua_State *L, lcu_Scheduler *sched);
+
+/* request operations */
 
 LCUI_FUNC int lcuT_resetcoreqk (lua_State *L,
+                                uv_req_type type,
                                 lcu_Scheduler *sched,
                                 lcu_RequestSetup setup,
                                 lua_CFunction results,
@@ -57,12 +73,25 @@ LCUI_FUNC lua_State *lcuU_endcoreq (uv_loop_t *loop, uv_req_t *request);
 
 LCUI_FUNC void lcuU_resumecoreq (uv_loop_t *loop, uv_req_t *request, int narg);
 
-/* thread operations */
+/* requests of 'LCU_WHEELREQ' type expire on the scheduler's timer wheel */
 
-typedef int (*lcu_HandleSetup) (lua_State *L,
-                                uv_handle_t *handle,
-                                uv_loop_t *loop,
-                                lcu_Operation *op);
+#define LCU_WHEELREQ	((uv_req_type)(UV_REQ_TYPE_MAX+1))
+
+typedef void (*lcu_WheelCallback) (uv_loop_t *loop, uv_req_t *request);
+
+LCUI_FUNC void lcuT_armwheelreq (lua_State *L,
+                                 uv_loop_t *loop,
+                                 lcu_Operation *op,
+                                 uint64_t msecs,
+                                 lcu_WheelCallback callback);
+
+/* deadline operations */
+
+LCUI_FUNC void lcuT_pushdeadline (lua_State *L, lcu_Scheduler *sched, uint64_t msecs);
+
+LCUI_FUNC void lcuT_stopdeadline (lua_State *L, lcu_Scheduler *sched, int idx);
+
+/* thread operations */
 
 LCUI_FUNC int lcuT_resetcohdlk (lua_State *L,
                                 uv_handle_type type,
@@ -77,6 +106,10 @@ LCUI_FUNC int lcuU_endcohdl (uv_handle_t *handle);
 
 LCUI_FUNC void lcuU_resumecohdl (uv_handle_t *handle, int narg);
 
+LCUI_FUNC void lcuU_sethdlvalue (uv_handle_t *handle);
+
+LCUI_FUNC int lcuU_pushhdlvalue (uv_handle_t *handle);
+
 /* object operations */
 
 #define LCU_HANDLECLOSEDFLAG	0x01
@@ -85,6 +118,10 @@ typedef int (*lcu_HandleAction) (uv_handle_t *h);
 
 typedef struct lcu_UdataHandle {
 	int flags;
+	int anchor;
+	int frame;
+	int priority;
+	uint64_t started;
 	lcu_HandleAction stop;
 	lua_CFunction step;
 	uv_handle_t handle;
@@ -113,11 +150,16 @@ LCUI_FUNC int lcuT_resetudhdlk (lua_State *L,
 
 LCUI_FUNC void lcuU_resumeudhdl (uv_handle_t *handle, int narg);
 
+LCUI_FUNC void lcuU_pushudhdlarg (uv_handle_t *handle, int arg);
+
 
 
 typedef struct lcu_UdataRequest {
 	lua_CFunction results;
 	lua_CFunction cancel;
+	int anchor;
+	int priority;
+	uint64_t started;
 	uv_req_t request;
 } lcu_UdataRequest;
 
@@ -142,6 +184,12 @@ LCUI_FUNC void lcuU_resumeudreq (uv_loop_t *loop, uv_req_t *request, int narg);
 
 
 
+/* group operations */
+
+LCUI_FUNC int lcuT_awaitanyk (lua_State *L, lcu_Scheduler *sched);
+
+
+
 /* auxiliary functions */
 
 LCUI_FUNC int lcuL_checknoyieldmode (lua_State *L, int arg);
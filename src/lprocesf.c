@@ -536,7 +536,7 @@ static int k_setupproc (lua_State *L,
 }
 static int system_execute (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
-	return lcuT_resetcohdlk(L, -1, sched, k_setupproc, NULL, NULL);
+	return lcuT_resetcohdlk(L, -UV_PROCESS, sched, k_setupproc, NULL, NULL);
 }
 
 
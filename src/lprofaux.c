@@ -0,0 +1,301 @@
+#include "lprofaux.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <lauxlib.h>
+
+
+LCUI_DDEF volatile int lcuPF_enabled = 0;
+
+/*
+ * Each system thread that resumes coroutines or tasks has a slot, and sets a
+ * count hook in the states it resumes, unless they already have a hook.
+ * Periodically, a sampler thread requests a sample from the slots of threads
+ * resuming states, and the hook records the stack of the state it interrupts
+ * when its slot has a request. Only the thread of the slot sets or removes
+ * hooks, and changes the slot, except for 'requested' and 'inuse'.
+ */
+typedef struct ProfSlot {
+	struct ProfSlot *next;
+	int inuse;  /* is assigned to a system thread */
+	unsigned int thread;  /* number of the thread using the slot */
+	volatile int running;  /* number of states being resumed by the thread */
+	volatile int requested;  /* a sample was requested by the sampler */
+} ProfSlot;
+
+typedef struct StackCount {
+	struct StackCount *next;
+	size_t hash;
+	size_t count;
+	size_t len;
+	char stack[1];  /* folded stack (not terminated) */
+} StackCount;
+
+#define COUNTSIZE	24  /* enough for a space, a count and a newline */
+
+static uv_once_t once = UV_ONCE_INIT;
+static uv_key_t slotkey;
+static uv_mutex_t mutex;
+static uv_cond_t wakeup;
+static ProfSlot *slots = NULL;
+static unsigned int nthreads = 0;
+static uv_thread_t sampler;
+static int sampling = 0;  /* 'sampler' is running */
+static int stopping = 0;  /* 'sampler' shall terminate */
+static uint64_t period = 0;  /* nanoseconds between samples */
+static StackCount **buckets = NULL;
+static size_t nbuckets = 0;
+static size_t nstacks = 0;
+
+static void initprof (void) {
+	if (uv_key_create(&slotkey) ||
+	    uv_mutex_init(&mutex) ||
+	    uv_cond_init(&wakeup)) abort();
+}
+
+static ProfSlot *acquireslot (void) {
+	ProfSlot *slot;
+	uv_mutex_lock(&mutex);
+	for (slot = slots; slot && slot->inuse; slot = slot->next);
+	if (slot == NULL) {
+		slot = (ProfSlot *)malloc(sizeof(ProfSlot));
+		if (slot) {
+			slot->next = slots;
+			slots = slot;
+		}
+	}
+	if (slot) {
+		slot->inuse = 1;
+		slot->thread = ++nthreads;
+		slot->running = 0;
+		slot->requested = 0;
+	}
+	uv_mutex_unlock(&mutex);
+	uv_key_set(&slotkey, slot);
+	return slot;
+}
+
+static void samplehook (lua_State *L, lua_Debug *ar);
+
+LCUI_FUNC void lcuPF_enter (lua_State *L) {
+	ProfSlot *slot;
+	uv_once(&once, initprof);
+	slot = (ProfSlot *)uv_key_get(&slotkey);
+	if (slot == NULL && (slot = acquireslot()) == NULL) return;
+	slot->running++;
+	if (lua_gethook(L) == NULL)  /* keep any other hook */
+		lua_sethook(L, samplehook, LUA_MASKCOUNT, LCU_PROFHOOKCOUNT);
+}
+
+LCUI_FUNC void lcuPF_leave (lua_State *L) {
+	ProfSlot *slot;
+	uv_once(&once, initprof);
+	slot = (ProfSlot *)uv_key_get(&slotkey);
+	if (slot == NULL) return;
+	slot->running--;
+	if (lua_gethook(L) == samplehook) lua_sethook(L, NULL, 0, 0);
+}
+
+LCUI_FUNC void lcuPF_releasethread (void) {
+	ProfSlot *slot;
+	uv_once(&once, initprof);
+	slot = (ProfSlot *)uv_key_get(&slotkey);
+	if (slot) {
+		uv_key_set(&slotkey, NULL);
+		uv_mutex_lock(&mutex);
+		slot->inuse = 0;
+		slot->running = 0;
+		slot->requested = 0;
+		uv_mutex_unlock(&mutex);
+	}
+}
+
+
+/*
+ * Samples
+ */
+
+static size_t hashstack (const char *stack, size_t len) {
+	size_t hash = 2166136261u;
+	while (len--) hash = (hash^(unsigned char)*stack++)*16777619u;
+	return hash;
+}
+
+static void growbuckets_mx (void) {
+	size_t i, size = nbuckets ? nbuckets*2 : 64;
+	StackCount **newbuckets = (StackCount **)calloc(size, sizeof(StackCount *));
+	if (newbuckets == NULL) return;  /* keep using the current buckets */
+	for (i = 0; i < nbuckets; i++) {
+		StackCount *entry = buckets[i];
+		while (entry) {
+			StackCount *next = entry->next;
+			entry->next = newbuckets[entry->hash&(size-1)];
+			newbuckets[entry->hash&(size-1)] = entry;
+			entry = next;
+		}
+	}
+	free(buckets);
+	buckets = newbuckets;
+	nbuckets = size;
+}
+
+static void countstack_mx (const char *stack, size_t len) {
+	size_t hash = hashstack(stack, len);
+	StackCount *entry;
+	if (nstacks >= nbuckets) growbuckets_mx();
+	if (nbuckets == 0) return;
+	for (entry = buckets[hash&(nbuckets-1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->len == len && !memcmp(entry->stack, stack, len)) {
+			entry->count++;
+			return;
+		}
+	}
+	entry = (StackCount *)malloc(sizeof(StackCount)+len);
+	if (entry == NULL) return;  /* sample is lost */
+	memcpy(entry->stack, stack, len);
+	entry->hash = hash;
+	entry->len = len;
+	entry->count = 1;
+	entry->next = buckets[hash&(nbuckets-1)];
+	buckets[hash&(nbuckets-1)] = entry;
+	nstacks++;
+}
+
+static size_t addframe (char *buf, size_t len, const char *frame) {
+	size_t size = strlen(frame);
+	if (len+size+1 > LCU_PROFSTACKSIZE) return len;  /* truncate the stack */
+	if (len > 0) buf[len++] = ';';
+	memcpy(buf+len, frame, size);
+	return len+size;
+}
+
+static void samplehook (lua_State *L, lua_Debug *ar) {
+	char buf[LCU_PROFSTACKSIZE];
+	char frame[LUA_IDSIZE+64];
+	ProfSlot *slot = (ProfSlot *)uv_key_get(&slotkey);
+	lua_Debug info;
+	size_t len = 0;
+	int level = 0;
+	(void)ar;
+	if (!lcuPF_enabled) {  /* inherited by a coroutine created while sampled */
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+	if (slot == NULL || !slot->requested) return;
+	slot->requested = 0;
+	while (level < LCU_PROFMAXDEPTH && lua_getstack(L, level, &info)) level++;
+	snprintf(frame, sizeof(frame), "thread %u", slot->thread);
+	len = addframe(buf, len, frame);
+	while (level-- > 0) {
+		if (!lua_getstack(L, level, &info) || !lua_getinfo(L, "Sn", &info)) continue;
+		if (info.what[0] == 'C')
+			snprintf(frame, sizeof(frame), "%s ([C])", info.name ? info.name : "?");
+		else if (info.what[0] == 'm')
+			snprintf(frame, sizeof(frame), "main chunk (%s)", info.short_src);
+		else
+			snprintf(frame, sizeof(frame), "%s (%s:%d)", info.name ? info.name : "?",
+			                                             info.short_src, info.linedefined);
+		len = addframe(buf, len, frame);
+	}
+	uv_mutex_lock(&mutex);
+	if (sampling) countstack_mx(buf, len);
+	uv_mutex_unlock(&mutex);
+}
+
+static void samplermain (void *arg) {
+	(void)arg;
+	uv_mutex_lock(&mutex);
+	while (!stopping) {
+		ProfSlot *slot;
+		uv_cond_timedwait(&wakeup, &mutex, period);
+		if (stopping) break;
+		for (slot = slots; slot; slot = slot->next)
+			if (slot->inuse && slot->running > 0) slot->requested = 1;
+	}
+	uv_mutex_unlock(&mutex);
+}
+
+LCUI_FUNC int lcuPF_start (uint64_t nsecs) {
+	int err = 0;
+	uv_once(&once, initprof);
+	uv_mutex_lock(&mutex);
+	period = nsecs;
+	if (!sampling) {
+		stopping = 0;
+		err = uv_thread_create(&sampler, samplermain, NULL);
+		if (!err) {
+			sampling = 1;
+			lcuPF_enabled = 1;
+		}
+	}
+	uv_mutex_unlock(&mutex);
+	return err;
+}
+
+LCUI_FUNC void lcuPF_stop (void) {
+	int running;
+	uv_once(&once, initprof);
+	uv_mutex_lock(&mutex);
+	running = sampling;
+	if (running) {
+		stopping = 1;
+		sampling = 0;
+		lcuPF_enabled = 0;
+		uv_cond_signal(&wakeup);
+	}
+	uv_mutex_unlock(&mutex);
+	if (running) uv_thread_join(&sampler);
+}
+
+LCUI_FUNC void lcuPF_reset (void) {
+	size_t i;
+	uv_once(&once, initprof);
+	uv_mutex_lock(&mutex);
+	for (i = 0; i < nbuckets; i++) {
+		StackCount *entry = buckets[i];
+		while (entry) {
+			StackCount *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+		buckets[i] = NULL;
+	}
+	nstacks = 0;
+	uv_mutex_unlock(&mutex);
+}
+
+static size_t foldedsize_mx (void) {
+	size_t i, size = 0;
+	for (i = 0; i < nbuckets; i++) {
+		StackCount *entry;
+		for (entry = buckets[i]; entry; entry = entry->next)
+			size += entry->len+COUNTSIZE;
+	}
+	return size;
+}
+
+LCUI_FUNC void lcuPF_pushfolded (lua_State *L) {
+	size_t i, size, len = 0;
+	char *buf;
+	uv_once(&once, initprof);
+	uv_mutex_lock(&mutex);
+	size = foldedsize_mx();
+	uv_mutex_unlock(&mutex);
+	buf = (char *)lua_newuserdatauv(L, size, 0);
+	uv_mutex_lock(&mutex);
+	for (i = 0; i < nbuckets; i++) {
+		StackCount *entry;
+		for (entry = buckets[i]; entry; entry = entry->next) {
+			if (len+entry->len+COUNTSIZE > size) break;  /* sampled meanwhile */
+			memcpy(buf+len, entry->stack, entry->len);
+			len += entry->len;
+			len += (size_t)snprintf(buf+len, COUNTSIZE, " %lu\n",
+			                        (unsigned long)entry->count);
+		}
+	}
+	uv_mutex_unlock(&mutex);
+	lua_pushlstring(L, buf, len);
+	lua_remove(L, -2);  /* discard 'buf' */
+}
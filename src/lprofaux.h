@@ -0,0 +1,28 @@
+#ifndef lprofaux_h
+#define lprofaux_h
+
+
+#include "lcuconf.h"
+
+#include <stdint.h>
+#include <lua.h>
+
+
+LCUI_DDEC(volatile int lcuPF_enabled;)
+
+LCUI_FUNC void lcuPF_enter (lua_State *L);
+
+LCUI_FUNC void lcuPF_leave (lua_State *L);
+
+LCUI_FUNC void lcuPF_releasethread (void);
+
+LCUI_FUNC int lcuPF_start (uint64_t nsecs);
+
+LCUI_FUNC void lcuPF_stop (void);
+
+LCUI_FUNC void lcuPF_reset (void);
+
+LCUI_FUNC void lcuPF_pushfolded (lua_State *L);
+
+
+#endif
@@ -1,5 +1,10 @@
 #include "lmodaux.h"
 #include "loperaux.h"
+#include "ltraceaux.h"
+#include "lprofaux.h"
+
+#include <string.h>
+#include <math.h>
 
 
 static int k_resumeall (lua_State *L, int status, lua_KContext kctx) {
@@ -19,13 +24,56 @@ static int k_resumeall (lua_State *L, int status, lua_KContext kctx) {
 	return 1;
 }
 
+/* modes of 'system.run' that are not modes of 'uv_run' */
+#define RUN_BUDGET	(-1)
+#define RUN_SPIN	(-2)
+
+static int runtimed (lua_State *L, lcu_Scheduler *sched, int spin) {
+	uv_loop_t *loop = lcu_toloop(sched);
+	lua_Number secs = luaL_checknumber(L, 2);
+	uint64_t nsecs;
+	size_t count, nwaits;
+	int pending;
+	luaL_argcheck(L, secs >= 0 && secs*1e9 <= 0xffffffffffffffff, 2, "out of range");
+	nsecs = (uint64_t)(secs*1e9);
+	lua_settop(L, 0);
+	loop->data = (void *)L;
+	lcu_log(loop, L, "resuming threads (timed)");
+	if (spin) pending = lcu_runspin(sched, nsecs, &count, &nwaits);
+	else pending = lcu_runbudget(sched, &nsecs, &count);
+	lcu_log(loop, L, "done resuming threads (timed)");
+	loop->data = NULL;
+	lua_pushboolean(L, pending);
+	if (spin) {
+		lua_pushinteger(L, (lua_Integer)count);  /* spins */
+		lua_pushinteger(L, (lua_Integer)nwaits);
+	} else {
+		lua_pushnumber(L, (lua_Number)nsecs*1e-9);
+		lua_pushinteger(L, (lua_Integer)count);  /* resumes */
+	}
+	return 3;
+}
+
+static void pushtimeout (lua_State *L, uv_loop_t *loop) {
+	int msecs;
+	uv_update_time(loop);
+	msecs = uv_loop_alive(loop) ? uv_backend_timeout(loop) : -1;
+	if (msecs < 0) lua_pushnumber(L, HUGE_VAL);  /* nothing to wait for */
+	else lua_pushnumber(L, (lua_Number)msecs*1e-3);
+}
+
 static int lcuM_run (lua_State *L) {
-	static const char *const opts[] = {"loop", "step", "ready", NULL};
+	static const char *const opts[] = {"loop", "step", "ready",
+	                                   "budget", "spin", NULL};
+	static const int modes[] = {UV_RUN_DEFAULT, UV_RUN_ONCE, UV_RUN_NOWAIT,
+	                            RUN_BUDGET, RUN_SPIN};
 	lcu_Scheduler *sched = lcu_getsched(L);
 	uv_loop_t *loop = lcu_toloop(sched);
 	int pending;
-	uv_run_mode mode = luaL_checkoption(L, 1, "loop", opts);
+	int mode = modes[luaL_checkoption(L, 1, "loop", opts)];
 	if (loop->data != NULL) luaL_error(L, "already running");
+	if (mode == RUN_BUDGET || mode == RUN_SPIN)
+		return runtimed(L, sched, mode == RUN_SPIN);
 	lua_settop(L, 0);
 	if (mode == UV_RUN_DEFAULT && lua_isyieldable(L)) {
 		int ltype = lua_getfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
@@ -49,13 +97,28 @@ static int lcuM_run (lua_State *L) {
 	}
 	loop->data = (void *)L;
 	lcu_log(loop, L, "resuming threads");
-	pending = uv_run(loop, mode);
+	pending = uv_run(loop, (uv_run_mode)mode);
 	lcu_log(loop, L, "done resuming threads");
 	loop->data = NULL;
 	lua_pushboolean(L, pending);
+	if (mode == UV_RUN_NOWAIT) {
+		pushtimeout(L, loop);
+		return 2;
+	}
 	return 1;
 }
 
+/* fd, timeout = system.backend() */
+static int system_backend (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	uv_loop_t *loop = lcu_toloop(sched);
+	int fd = uv_backend_fd(loop);
+	if (fd < 0) return lcuL_pusherrres(L, UV_ENOTSUP);
+	lua_pushinteger(L, fd);
+	pushtimeout(L, loop);
+	return 2;
+}
+
 static int lcuM_isrunning (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
 	uv_loop_t *loop = lcu_toloop(sched);
@@ -67,7 +130,7 @@ static int lcuM_halt (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
 	uv_loop_t *loop = lcu_toloop(sched);
 	if (!loop->data) luaL_error(L, "not running");
-	uv_stop(loop);
+	lcu_haltsched(sched);
 	return 0;
 }
 
@@ -78,12 +141,240 @@ static int lcuM_printall (lua_State *L) {
 	return 0;
 }
 
+/* stats = system.stats([stats]) */
+static int system_stats (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+	lcu_pushstats(L, sched, 1);
+	return 1;
+}
+
+/* latencies = system.latency([action]) */
+static int system_latency (lua_State *L) {
+	static const char *const actions[] = {"read", "start", "stop", "reset", NULL};
+	lcu_Scheduler *sched = lcu_getsched(L);
+	switch (luaL_checkoption(L, 1, "read", actions)) {
+		case 1: lcu_setlatencies(L, sched, 1); return 0;
+		case 2: lcu_setlatencies(L, sched, 0); return 0;
+		case 3: lcu_resetlatencies(sched); return 0;
+	}
+	lcu_pushlatencies(L, sched);
+	return 1;
+}
+
+/* [json] = system.trace([action [, from [, to]]]) */
+static int system_trace (lua_State *L) {
+	static const char *const actions[] = {"export", "start", "stop", "reset", NULL};
+	switch (luaL_checkoption(L, 1, "export", actions)) {
+		case 1: lcuTR_enabled = 1; return 0;
+		case 2: lcuTR_enabled = 0; return 0;
+		case 3: lcuTR_reset(); return 0;
+	}
+	lcuTR_pushchrome(L, (uint64_t)luaL_optinteger(L, 2, 0),
+	                    (uint64_t)luaL_optinteger(L, 3, LUA_MAXINTEGER));
+	return 1;
+}
+
+/* [folded] = system.profile([action [, period]]) */
+static int system_profile (lua_State *L) {
+	static const char *const actions[] = {"dump", "start", "stop", "reset", NULL};
+	switch (luaL_checkoption(L, 1, "dump", actions)) {
+		case 1: {
+			lua_Number secs = luaL_optnumber(L, 2, .01);
+			luaL_argcheck(L, secs >= 1e-6 && secs*1e9 <= 0xffffffffffffffff, 2, "out of range");
+			return lcuL_pushresults(L, 0, lcuPF_start((uint64_t)(secs*1e9)));
+		}
+		case 2: lcuPF_stop(); return 0;
+		case 3: lcuPF_reset(); return 0;
+	}
+	lcuPF_pushfolded(L);
+	return 1;
+}
+
+/* system.accounting(enable) */
+static int system_accounting (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	int enable = lua_toboolean(L, 1);
+	if (!enable) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY);
+	} else if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY) != LUA_TTABLE) {
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY);
+		lua_pushthread(L);
+		lcuL_getusage(L, -1, 1);  /* a running task is accounted by its thread pool */
+	}
+	lcu_setaccounting(sched, enable);
+	return 0;
+}
+
+static void pushusage (lua_State *L, lcu_Usage *usage) {
+	lua_pushnumber(L, usage ? (lua_Number)usage->wall*1e-9 : 0);
+	lua_pushnumber(L, usage ? (lua_Number)usage->cpu*1e-9 : 0);
+	lua_pushinteger(L, usage ? usage->resumes : 0);
+}
+
+/* wall, cpu, resumes = system.usage(coroutine [, reset]) */
+static int system_usage (lua_State *L) {
+	lcu_Usage *usage;
+	int reset = lua_toboolean(L, 2);
+	luaL_checktype(L, 1, LUA_TTHREAD);
+	usage = lcuL_getusage(L, 1, 0);
+	pushusage(L, usage);
+	if (usage && reset) memset(usage, 0, sizeof(lcu_Usage));
+	return 3;
+}
+
+static const char *const UsageNames[] = {"cpu", "wall", "resumes", NULL};
+
+static int greaterusage (lcu_Usage *a, lcu_Usage *b, int criterion) {
+	switch (criterion) {
+		case 0: return a->cpu > b->cpu;
+		case 1: return a->wall > b->wall;
+	}
+	return a->resumes > b->resumes;
+}
+
+/* list = system.topusage(count [, criterion]) */
+static int system_topusage (lua_State *L) {
+	lua_Integer count = luaL_checkinteger(L, 1);
+	int criterion = luaL_checkoption(L, 2, "cpu", UsageNames);
+	lcu_Usage **top;
+	lua_State **threads;
+	int i, n = 0;
+	luaL_argcheck(L, count > 0 && count <= 1024, 1, "out of range");
+	lua_settop(L, 0);
+	luaL_checkstack(L, (int)count+4, "too many results");
+	top = (lcu_Usage **)lua_newuserdatauv(L, (size_t)count*(sizeof(lcu_Usage *)+sizeof(lua_State *)), 0);
+	threads = (lua_State **)(top+count);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY) == LUA_TTABLE) {
+		lua_pushnil(L);
+		while (lua_next(L, 2)) {  /* no allocations, so no entry is collected */
+			lcu_Usage *usage = (lcu_Usage *)lua_touserdata(L, -1);
+			lua_State *thread = lua_tothread(L, -2);
+			lua_pop(L, 1);
+			if (usage == NULL || thread == NULL || usage->resumes == 0) continue;
+			if (n < count) i = n++;
+			else if (greaterusage(usage, top[n-1], criterion)) i = n-1;
+			else continue;
+			for (; i > 0 && greaterusage(usage, top[i-1], criterion); i--) {
+				top[i] = top[i-1];
+				threads[i] = threads[i-1];
+			}
+			top[i] = usage;
+			threads[i] = thread;
+		}
+	}
+	for (i = 0; i < n; i++) {  /* anchor the coroutines */
+		lua_pushthread(threads[i]);
+		lua_xmove(threads[i], L, 1);
+	}
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_createtable(L, 0, 4);
+		lua_pushvalue(L, 3+i);
+		lua_setfield(L, -2, "coroutine");
+		pushusage(L, top[i]);
+		lua_setfield(L, -4, "resumes");
+		lua_setfield(L, -3, "cpu");
+		lua_setfield(L, -2, "wall");
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+/* system.watchdog([seconds [, warn]]) */
+static int system_watchdog (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	uint64_t nsecs = 0;
+	if (lua_toboolean(L, 1)) {
+		lua_Number secs = luaL_checknumber(L, 1);
+		luaL_argcheck(L, secs > 0 && secs*1e9 <= 0xffffffffffffffff, 1, "out of range");
+		nsecs = (uint64_t)(secs*1e9);
+	}
+	lcu_setwatchdog(sched, nsecs, lua_toboolean(L, 2));
+	return 0;
+}
+
+/* records, count = system.stalls([reset]) */
+static int system_stalls (lua_State *L) {
+	lua_Integer i, n = 0;
+	int reset = lua_toboolean(L, 1);
+	lua_settop(L, 0);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LCU_STALLSREGKEY) == LUA_TTABLE) {
+		lua_getfield(L, 1, "n");
+		n = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	i = n > LCU_STALLLOGSIZE ? n-LCU_STALLLOGSIZE : 0;
+	lua_createtable(L, (int)(n-i), 0);
+	for (; i < n; i++) {
+		lua_rawgeti(L, 1, i%LCU_STALLLOGSIZE+1);
+		lua_rawseti(L, 2, lua_rawlen(L, 2)+1);
+	}
+	if (reset) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LCU_STALLSREGKEY);
+	}
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+static const char *const PriorityNames[] = {"high", "normal", "low", NULL};
+
+/* class = system.awaitprio(coroutine [, class]) */
+static int system_awaitprio (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	int priority;
+	luaL_checktype(L, 1, LUA_TTHREAD);
+	priority = lcu_getpriority(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		lcu_setpriority(L, sched, 1, luaL_checkoption(L, 2, NULL, PriorityNames));
+	lua_pushstring(L, PriorityNames[priority]);
+	return 1;
+}
+
+/* i, ... = system.awaitany(call, ...) */
+static int system_awaitany (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	int ncall = lua_gettop(L);
+	int i;
+	luaL_argcheck(L, ncall > 0, 1, "table expected");
+	for (i = 1; i <= ncall; i++) {
+		int narg;
+		luaL_checktype(L, i, LUA_TTABLE);
+		lua_getfield(L, i, "n");
+		narg = lua_isinteger(L, -1) ? (int)lua_tointeger(L, -1) : (int)lua_rawlen(L, i);
+		lua_pop(L, 1);
+		luaL_argcheck(L, narg > 0, i, "function expected");
+	}
+	if (!lua_isyieldable(L)) luaL_error(L, "unable to yield");
+	luaL_checkstack(L, ncall+LUA_MINSTACK, "too many calls");
+	return lcuT_awaitanyk(L, sched);
+}
+
 LCUI_FUNC void lcuM_addscheduf (lua_State *L) {
 	static const luaL_Reg modf[] = {
 		{"run", lcuM_run},
 		{"isrunning", lcuM_isrunning},
 		{"halt", lcuM_halt},
 		{"printall", lcuM_printall},
+		{"backend", system_backend},
+		{"awaitany", system_awaitany},
+		{"awaitprio", system_awaitprio},
+		{"stats", system_stats},
+		{"watchdog", system_watchdog},
+		{"stalls", system_stalls},
+		{"latency", system_latency},
+		{"trace", system_trace},
+		{"profile", system_profile},
+		{"accounting", system_accounting},
+		{"usage", system_usage},
+		{"topusage", system_topusage},
 		{NULL, NULL}
 	};
 	lcuM_setfuncs(L, modf, LCU_MODUPVS);
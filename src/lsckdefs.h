@@ -15,6 +15,9 @@ typedef unsigned short in_port_t;
 
 typedef struct lcu_UdpSocket {
 	int flags;
+	int anchor;
+	int priority;
+	uint64_t started;
 	lcu_HandleAction stop;
 	lua_CFunction step;
 	uv_udp_t handle;
@@ -22,6 +25,9 @@ typedef struct lcu_UdpSocket {
 
 typedef struct lcu_TcpSocket {
 	int flags;
+	int anchor;
+	int priority;
+	uint64_t started;
 	lcu_HandleAction stop;
 	lua_CFunction step;
 	uv_tcp_t handle;
@@ -29,6 +35,9 @@ typedef struct lcu_TcpSocket {
 
 typedef struct lcu_PipeSocket {
 	int flags;
+	int anchor;
+	int priority;
+	uint64_t started;
 	lcu_HandleAction stop;
 	lua_CFunction step;
 	uv_pipe_t handle;
@@ -36,6 +45,9 @@ typedef struct lcu_PipeSocket {
 
 typedef struct lcu_TermSocket {
 	int flags;
+	int anchor;
+	int priority;
+	uint64_t started;
 	lcu_HandleAction stop;
 	lua_CFunction step;
 	uv_tty_t handle;
@@ -1,5 +1,6 @@
 #define LUA_LIB
 
+#include "lmodaux.h"
 #include "loperaux.h"
 #include "lttyaux.h"
 #include "lchaux.h"
@@ -18,6 +19,8 @@ LCUMOD_API int luaopen_coutil_system (lua_State *L) {
 	(void)lcuTY_tostdiofd(L);  /* stdio files must be GC after 'sched' on 'lua_close' */
 	(void)lcuCS_tochannelmap(L);  /* map must be GC after 'sched' on 'lua_close' */
 	lcuM_newmodupvs(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LCU_SCHEDULERREGKEY);  /* for the C API */
 	lua_newtable(L);
 	lcuM_addchanelf(L);
 	lcuM_addcommunf(L);
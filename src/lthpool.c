@@ -1,11 +1,21 @@
 #include "lthpool.h"
 
 #include "lmodaux.h"
+#include "loperaux.h"
 #include "lchaux.h"
+#include "ltraceaux.h"
+#include "lprofaux.h"
+#include "larenaux.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <uv.h>
 
 
+#if !LCU_LIBUVMINVER(45)
+#define uv_thread_setaffinity(T,M,O,S)	((void)(T),(void)(M),(void)(O),(void)(S),UV_ENOSYS)
+#endif
+
 #define STATUS_MASK     0x03
 #define STATUS_OPEN     0x00
 #define STATUS_CLOSING  0x01
@@ -15,6 +25,36 @@
 #define getstatus(P)  ((P)->flags&STATUS_MASK)
 #define setstatus(P,V)  ((P)->flags = ((P)->flags & (~STATUS_MASK)) | (V))
 
+/*
+ * Each system thread has a local queue of tasks, where it places the tasks it
+ * resumes, so they can be executed by it without locking the pool's mutex.
+ * System threads without local tasks take tasks from the pool's queue, where
+ * new tasks are placed, or steal tasks from the local queues of the others.
+ * Every 'LCU_TPOOLLOCALRUNS' tasks, or whenever there are tasks of the highest
+ * priority in the pool's queue, local tasks are left for a while, so tasks in
+ * the pool's queue are not starved.
+ */
+typedef struct Worker {
+	struct Worker *next;
+	lcu_ThreadPool *pool;
+	uv_mutex_t mutex;  /* protects 'queue' and 'pending' */
+	lcu_StateQ queue;
+	volatile int running;  /* is running a task */
+	volatile int pending;  /* number of tasks in 'queue' */
+} Worker;
+
+/*
+ * Tasks of pools with sticky tasks are bound to the system thread that last
+ * executed them, and are only placed in its local queue, which is not stolen
+ * by other system threads. Tasks bound to a system thread that terminates are
+ * placed in the pool's queue.
+ */
+typedef struct TaskRef {
+	lcu_ThreadPool *pool;  /* must be the first field */
+	Worker *worker;  /* system thread a sticky task is bound to */
+	int priority;  /* index of the pool's queue where the task is placed */
+} TaskRef;
+
 struct lcu_ThreadPool {
 	lua_Alloc allocf;
 	void *allocud;
@@ -24,14 +64,78 @@ struct lcu_ThreadPool {
 	int flags;  /* STATUS_MASK|JOIN_PENDING */
 	int size;  /* expected number of system threads */
 	int threads;  /* current number of system threads */
-	int idle;  /* number of system threads waiting on 'onwork' */
+	volatile int idle;  /* number of system threads waiting on 'onwork' */
 	int tasks;  /* total number of tasks (coroutines) in the thread pool */
-	int running;  /* number of system threads running tasks */
-	int pending;  /* number of tasks in 'queue' */
-	lcu_StateQ queue;
+	int running;  /* number of system threads without 'Worker' running tasks */
+	volatile int pending;  /* number of tasks in 'queues' */
+	volatile int urgent;  /* number of tasks in 'queues[0]' */
+	int pendlimit;  /* maximum 'pending' to accept new tasks, or -1 */
+	int waitroom;  /* new tasks shall wait for room instead of failing */
+	lcu_TaskWaiter *waiters;  /* waiting for room for new tasks */
+	int memaccount;  /* shall account the memory of new tasks */
+	size_t memlimit;  /* maximum memory of each new task */
+	size_t memory;  /* bytes allocated by accounted tasks */
+	size_t allocs;  /* number of allocations by accounted tasks */
+	lcu_StateQ queues[LCU_TASKPRIORITIES];  /* one queue per priority */
+	Worker *workers;  /* local queues of system threads */
+	int sticky;  /* tasks are bound to system threads */
+	size_t stacksize;  /* stack size of new system threads */
+	int masksize;  /* size of each CPU mask */
+	int nmasks;  /* number of CPU masks */
+	int placed;  /* number of system threads placed using 'masks' */
+	char *masks;  /* CPU masks of new system threads */
+	lcu_WarmStates *warm;  /* initialized states for new tasks, or NULL */
 	uv_thread_t last_terminated;  /* terminated worker thread pending join */
 };
 
+static uv_once_t once = UV_ONCE_INIT;
+static uv_key_t workerkey;
+
+static void initworkers (void) {
+	if (uv_key_create(&workerkey)) abort();
+}
+
+static TaskRef *totaskref (lua_State *L) {
+	TaskRef *ref;
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
+	ref = (TaskRef *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return ref;
+}
+
+static void enqueuetask_mx (lcu_ThreadPool *pool, lua_State *L, int priority) {
+	lcuCS_enqueuestateq(&pool->queues[priority], L);
+	pool->pending++;
+	if (priority == 0) pool->urgent++;
+}
+
+static lua_State *dequeuetask_mx (lcu_ThreadPool *pool) {
+	int priority;
+	for (priority = 0; priority < LCU_TASKPRIORITIES; priority++) {
+		lua_State *L = lcuCS_dequeuestateq(&pool->queues[priority]);
+		if (L) {
+			pool->pending--;
+			if (priority == 0) pool->urgent--;
+			return L;
+		}
+	}
+	return NULL;
+}
+
+static int hasroom_mx (lcu_ThreadPool *pool) {
+	return pool->pendlimit < 0 || pool->pending < pool->pendlimit;
+}
+
+static void signalroom_mx (lcu_ThreadPool *pool) {
+	int room = pool->pendlimit-pool->pending;
+	while (pool->waiters && (pool->pendlimit < 0 || room-- > 0)) {
+		lcu_TaskWaiter *waiter = pool->waiters;
+		pool->waiters = waiter->next;
+		waiter->waiting = 0;
+		uv_async_send(waiter->async);
+	}
+}
+
 
 static int hasextraidle_mx (lcu_ThreadPool *pool) {
 	return pool->threads > pool->size && pool->idle > 0;
@@ -46,101 +150,297 @@ static void checkhalted_mx (lcu_ThreadPool *pool) {
 
 static void threadmain (void *arg);
 
-static int addthread_mx (lcu_ThreadPool *pool, lua_State *L) {
+static int newthread_mx (lcu_ThreadPool *pool) {
+	uv_thread_t tid;
+	int err;
+#if LCU_LIBUVMINVER(26)
+	uv_thread_options_t options;
+	options.flags = pool->stacksize ? UV_THREAD_HAS_STACK_SIZE : 0;
+	options.stack_size = pool->stacksize;
+	err = uv_thread_create_ex(&tid, &options, threadmain, pool);
+#else
+	if (pool->stacksize) return UV_ENOSYS;
+	err = uv_thread_create(&tid, threadmain, pool);
+#endif
+	if (err) return err;
+	pool->threads++;
+	return 0;
+}
+
+static void counttasks_mx (lcu_ThreadPool *pool,
+                           int *running,
+                           int *pending,
+                           int exact);
+
+static int addthread_mx (lcu_ThreadPool *pool, lua_State *L, int priority) {
+	int running, pending;
+	counttasks_mx(pool, &running, &pending, 0);
 	/* starting or waking threads won't get this new task */
-	if (pool->threads-pool->running-pool->idle <= pool->pending) {
+	if (pool->threads-running-pool->idle <= pending) {
 		if (pool->idle > 0) {
 			uv_cond_signal(&pool->onwork);
 		} else if (pool->threads < pool->size) {
-			uv_thread_t tid;
-			int err = uv_thread_create(&tid, threadmain, pool);
-			if (!err) pool->threads++;
-			else lcuL_warnerr(L, "system.threads", err);
+			int err = newthread_mx(pool);
+			if (err) lcuL_warnerr(L, "system.threads", err);
 		}
 	}
 	if (getstatus(pool) == STATUS_CLOSED) return 0;
-	lcuCS_enqueuestateq(&pool->queue, L);
-	pool->pending++;
+	enqueuetask_mx(pool, L, priority);
 	return 1;
 }
 
+/*
+ * Tasks resumed by one system thread might be placed in the queue of another.
+ * Unless 'exact', counts of system threads are read without their locks, as
+ * hints to decide whether to wake or start system threads.
+ */
+static void counttasks_mx (lcu_ThreadPool *pool,
+                           int *running,
+                           int *pending,
+                           int exact) {
+	Worker *worker;
+	*running = pool->running;
+	*pending = pool->pending;
+	for (worker = pool->workers; worker; worker = worker->next) {
+		if (exact) uv_mutex_lock(&worker->mutex);
+		*running += worker->running;
+		*pending += worker->pending;
+	}
+	if (exact) for (worker = pool->workers; worker; worker = worker->next)
+		uv_mutex_unlock(&worker->mutex);
+}
+
+static void wakeidle (lcu_ThreadPool *pool, int locked) {
+	if (pool->idle > 0) {  /* hint read without lock */
+		if (!locked) uv_mutex_lock(&pool->mutex);
+		if (pool->idle > 0) uv_cond_signal(&pool->onwork);
+		if (!locked) uv_mutex_unlock(&pool->mutex);
+	}
+}
+
+static void pushlocal (Worker *worker, lua_State *L) {
+	uv_mutex_lock(&worker->mutex);
+	lcuCS_enqueuestateq(&worker->queue, L);
+	worker->pending++;
+	uv_mutex_unlock(&worker->mutex);
+	/* this thread is busy running a task, so an idle one might steal it */
+	if (worker->running && !worker->pool->sticky) wakeidle(worker->pool, 0);
+}
+
+static lua_State *poplocal (Worker *worker) {
+	lua_State *L;
+	uv_mutex_lock(&worker->mutex);
+	L = lcuCS_dequeuestateq(&worker->queue);
+	if (L) worker->pending--;
+	uv_mutex_unlock(&worker->mutex);
+	return L;
+}
+
+static void setrunning (Worker *worker, int running) {
+	uv_mutex_lock(&worker->mutex);
+	worker->running = running;
+	uv_mutex_unlock(&worker->mutex);
+}
+
+/* 'L' is the task to be requeued, if any */
+static lua_State *nextlocal (Worker *worker, lua_State *L, int more) {
+	uv_mutex_lock(&worker->mutex);
+	if ((worker->pending == 0 && worker->pool->pending > 0) ||
+	    worker->pool->urgent > 0) more = 0;  /* hints read without lock */
+	if (L && (!more || worker->pending > 0)) {  /* otherwise keep running 'L' */
+		lcuCS_enqueuestateq(&worker->queue, L);
+		worker->pending++;
+		L = NULL;
+	}
+	if (L == NULL && more && worker->pending > 0) {
+		L = lcuCS_dequeuestateq(&worker->queue);
+		worker->pending--;
+	}
+	if (L == NULL) worker->running = 0;
+	uv_mutex_unlock(&worker->mutex);
+	return L;
+}
+
+static lua_State *stealtask_mx (lcu_ThreadPool *pool, Worker *worker) {
+	lua_State *L = NULL;
+	Worker *victim;
+	if (worker) L = poplocal(worker);
+	if (pool->sticky) return L;
+	for (victim = pool->workers; L == NULL && victim; victim = victim->next) {
+		if (victim != worker && victim->pending > 0) {  /* hint read without lock */
+			L = poplocal(victim);
+			if (L) lcu_log(pool, L, "stole task");
+		}
+	}
+	return L;
+}
+
+static Worker *findworker_mx (lcu_ThreadPool *pool, Worker *worker) {
+	Worker *found;
+	for (found = pool->workers; found && found != worker; found = found->next);
+	return found;
+}
+
+static void addworker_mx (lcu_ThreadPool *pool, Worker *worker) {
+	worker->pool = pool;
+	worker->running = 0;
+	worker->pending = 0;
+	lcuCS_initstateq(&worker->queue);
+	worker->next = pool->workers;
+	pool->workers = worker;
+	uv_key_set(&workerkey, worker);
+}
+
+static void removeworker_mx (lcu_ThreadPool *pool, Worker *worker) {
+	Worker **ref = &pool->workers;
+	lua_State *L;
+	while (*ref != worker) ref = &(*ref)->next;
+	*ref = worker->next;
+	while ((L = poplocal(worker)))  /* move local tasks to the pool's queue */
+		enqueuetask_mx(pool, L, totaskref(L)->priority);
+	uv_key_set(&workerkey, NULL);
+	uv_mutex_destroy(&worker->mutex);
+}
+
 static void threadmain (void *arg) {
 	lcu_ThreadPool *pool = (lcu_ThreadPool *)arg;
+	Worker local;
+	Worker *worker = uv_mutex_init(&local.mutex) ? NULL : &local;
+	int pinerr = 0;
 
+	uv_once(&once, initworkers);
 	uv_mutex_lock(&pool->mutex);
+	if (worker) addworker_mx(pool, worker);
+	if (pool->nmasks > 0) {  /* before taking any task */
+		uv_thread_t self = uv_thread_self();
+		char *mask = pool->masks+(pool->placed++%pool->nmasks)*pool->masksize;
+		pinerr = uv_thread_setaffinity(&self, mask, NULL, pool->masksize);
+	}
 	while (1) {
 		lua_State *L = NULL;
-		int narg, status, enqueue;
+		int runs = 0, sticky;
 		while (1) {
 			if (pool->threads > pool->size) {
 				goto thread_end;
 			} else if (pool->pending) {
-				pool->pending--;
-				L = lcuCS_dequeuestateq(&pool->queue);
+				L = dequeuetask_mx(pool);
+				lcu_probe3(taskdequeue, pool, L, pool->pending);
+				if (pool->waiters) signalroom_mx(pool);
 				break;
 			} else if (getstatus(pool) == STATUS_CLOSING && pool->tasks == 0) {  /* if halted? */
 				pool->size = 0;
 			} else {
-				pool->idle++;
-				uv_cond_wait(&pool->onwork, &pool->mutex);
+				pool->idle++;  /* before stealing, so new local tasks signal 'onwork' */
+				L = stealtask_mx(pool, worker);
+				if (L == NULL) uv_cond_wait(&pool->onwork, &pool->mutex);
 				pool->idle--;
+				if (L) break;
 			}
 		}
-		pool->running++;
+		if (worker) setrunning(worker, 1);
+		else pool->running++;
+		sticky = worker && pool->sticky;
 		uv_mutex_unlock(&pool->mutex);
-		if (lua_status(L) == LUA_OK) narg = lua_gettop(L)-1;
-		else {
-			narg = lua_tointeger(L, -1);
-			lua_pop(L, 1);  /* discard 'narg' */
+		if (pinerr) {  /* keeps running, but on any CPU */
+			lcuL_warnerr(L, "system.threads", pinerr);
+			pinerr = 0;
 		}
-		status = lua_resume(L, NULL, narg, &narg);
-		if (status == LUA_YIELD) {
-			int base = lua_gettop(L)-narg;
-			const char *channelname = lua_tostring(L, base+1);
-			if (channelname) {
-				lcu_ChannelMap *map = lcuCS_tochannelmap(L);
-				lcu_ChannelSync *sync = lcuCS_getchsync(map, channelname);
-				int endpoint = lcuCS_checksyncargs(L, base+2);
-				if (endpoint == -1) {
-					enqueue = 1;
-					lcu_assert(lua_gettop(L) > base+2);
-					lua_replace(L, base+2);  /* place errmsg as 2nd return */
-					lua_pushboolean(L, 0);
-					lua_replace(L, base+1);  /* place false as 1st return */
-					lua_settop(L, base+2);  /* discard other values */
-					lua_pushinteger(L, 2);  /* push 'narg' */
+		do {
+			lcu_MemAccount *account;
+			int narg, status, enqueue, accounting, profiling, locked;
+			uint64_t start = 0, cpu = 0;
+			size_t memadd = 0, memsub = 0, allocs = 0;
+			if (lua_status(L) == LUA_OK) narg = lua_gettop(L)-1;
+			else {
+				narg = lua_tointeger(L, -1);
+				lua_pop(L, 1);  /* discard 'narg' */
+			}
+			accounting = lua_getfield(L, LUA_REGISTRYINDEX, LCU_USAGEREGKEY) == LUA_TTABLE;
+			lua_pop(L, 1);
+			if (accounting) {
+				start = uv_hrtime();
+				cpu = lcuL_cputime();
+			}
+			if (sticky) totaskref(L)->worker = worker;
+			lcu_log(pool, L, "resuming task");
+			lcu_probe2(taskresume, pool, L);
+			profiling = lcuPF_enabled;
+			if (profiling) lcuPF_enter(L);
+			status = lua_resume(L, NULL, narg, &narg);
+			if (profiling) lcuPF_leave(L);
+			if (accounting) lcuL_addusage(L, L, 0, uv_hrtime()-start, lcuL_cputime()-cpu);
+			lcu_log(pool, L, "suspended task");
+			account = lcuL_tomemaccount(L);
+			if (account) {
+				memsub = account->reported;
+				memadd = account->reported = account->bytes;
+				allocs = account->count-account->counted;
+				account->counted = account->count;
+			}
+			if (status == LUA_YIELD) {
+				int base = lua_gettop(L)-narg;
+				const char *channelname = lua_tostring(L, base+1);
+				if (channelname) {
+					lcu_ChannelMap *map = lcuCS_tochannelmap(L);
+					lcu_ChannelSync *sync = lcuCS_getchsync(map, channelname);
+					int endpoint = lcuCS_checksyncargs(L, base+2);
+					if (endpoint == -1) {
+						enqueue = 1;
+						lcu_assert(lua_gettop(L) > base+2);
+						lua_replace(L, base+2);  /* place errmsg as 2nd return */
+						lua_pushboolean(L, 0);
+						lua_replace(L, base+1);  /* place false as 1st return */
+						lua_settop(L, base+2);  /* discard other values */
+						lua_pushinteger(L, 2);  /* push 'narg' */
+					} else {
+						enqueue = lcuCS_matchchsync(sync, endpoint, L, base, narg, NULL, NULL);
+					}
+					lcuCS_freechsync(map, sync);  /* task might be running elsewhere */
 				} else {
-					enqueue = lcuCS_matchchsync(sync, endpoint, L, base, narg, NULL, NULL);
+					enqueue = !lcuCS_suspendedchtask(L, base+1);
+					lua_settop(L, base);  /* discard returned values */
+					lua_pushinteger(L, 0);  /* push 'narg' */
 				}
-				lcuCS_freechsync(map, channelname);
 			} else {
-				enqueue = !lcuCS_suspendedchtask(L, base+1);
-				lua_settop(L, base);  /* discard returned values */
-				lua_pushinteger(L, 0);  /* push 'narg' */
+				enqueue = 0;
+				if (status != LUA_OK) lcuL_warnmsg(L, "threads", lua_tostring(L, -1));
+				/* avoid 'pool->tasks--' */
+				lua_settop(L, 0);
+				lua_getfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
+				lua_pushnil(L);
+				lua_setmetatable(L, -2);
+				lcuL_closestate(lcuL_tomain(L));
+				memadd = 0;  /* all its memory is released */
 			}
-		} else {
-			enqueue = 0;
-			if (status != LUA_OK) lcuL_warnmsg(L, "threads", lua_tostring(L, -1));
-			/* avoid 'pool->tasks--' */
-			lua_settop(L, 0);
-			lua_getfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
-			lua_pushnil(L);
-			lua_setmetatable(L, -2);
-			lua_close(lcuL_tomain(L));
-		}
+
+			/* counts of the pool shall change atomically */
+			locked = account || status != LUA_YIELD || worker == NULL;
+			if (locked) {
+				uv_mutex_lock(&pool->mutex);
+				pool->memory = pool->memory-memsub+memadd;
+				pool->allocs += allocs;
+				if (status != LUA_YIELD) pool->tasks--;
+			}
+			if (worker) {
+				L = nextlocal(worker, enqueue ? L : NULL, ++runs < LCU_TPOOLLOCALRUNS);
+				if (worker->pending > 0) wakeidle(pool, locked);
+			} else {
+				if (enqueue) enqueuetask_mx(pool, L, totaskref(L)->priority);
+				pool->running--;
+				L = NULL;
+			}
+			if (locked) uv_mutex_unlock(&pool->mutex);
+		} while (L);
 
 		uv_mutex_lock(&pool->mutex);
-		pool->running--;
-		if (enqueue) {
-			pool->pending++;
-			lcuCS_enqueuestateq(&pool->queue, L);
-		} else if (status != LUA_YIELD) {
-			pool->tasks--;
-		}
 	}
 	thread_end:
+	if (worker) removeworker_mx(pool, worker);
+	lcuTR_releasethread();
+	lcuPF_releasethread();
+	lcuAR_releasethread();
 	pool->threads--;
-	if (hasextraidle_mx(pool)) {
+	if (hasextraidle_mx(pool) || (pool->pending && pool->idle > 0)) {
 		uv_cond_signal(&pool->onwork);
 	} else if (getstatus(pool) == STATUS_CLOSING) {
 		if (pool->threads == 0) uv_cond_signal(&pool->onterm);
@@ -158,14 +458,32 @@ static void threadmain (void *arg) {
 
 LCUI_FUNC void lcuTP_resumetask (lua_State *L) {
 	lcu_ThreadPool *pool;
-	int added;
-	lua_getfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
-	pool = *((lcu_ThreadPool **)lua_touserdata(L, -1));
-	lua_pop(L, 1);
+	TaskRef *ref;
+	Worker *worker;
+	int added = 1;
+	ref = totaskref(L);
+	pool = ref->pool;
+	uv_once(&once, initworkers);
+	worker = (Worker *)uv_key_get(&workerkey);
+	if (worker && worker->pool == pool && (ref->worker == NULL ||
+	                                       ref->worker == worker ||
+	                                       !pool->sticky)) {  /* hint read without lock */
+		pushlocal(worker, L);  /* resumed by a task of the same pool */
+		return;
+	}
 	uv_mutex_lock(&pool->mutex);
-	added = addthread_mx(pool, L);
+	if (pool->sticky && ref->worker && findworker_mx(pool, ref->worker)) {
+		worker = ref->worker;
+		uv_mutex_lock(&worker->mutex);
+		lcuCS_enqueuestateq(&worker->queue, L);
+		worker->pending++;
+		uv_mutex_unlock(&worker->mutex);
+		uv_cond_broadcast(&pool->onwork);  /* only 'worker' shall take it */
+	} else {
+		added = addthread_mx(pool, L, ref->priority);
+	}
 	uv_mutex_unlock(&pool->mutex);
-	if (!added) lua_close(lcuL_tomain(L));
+	if (!added) lcuL_closestate(lcuL_tomain(L));
 }
 
 
@@ -173,7 +491,7 @@ LCUI_FUNC void lcuTP_resumetask (lua_State *L) {
 LCUI_FUNC int lcuTP_createtpool (lcu_ThreadPool **ref,
                                  lua_Alloc allocf,
                                  void *allocud) {
-	int err = UV_ENOMEM;
+	int i, err = UV_ENOMEM;
 	lcu_ThreadPool *pool = (lcu_ThreadPool *)allocf(allocud, NULL, 0, sizeof(lcu_ThreadPool));
 	if (pool == NULL) goto alloc_err;
 	err = uv_mutex_init(&pool->mutex);
@@ -192,7 +510,23 @@ LCUI_FUNC int lcuTP_createtpool (lcu_ThreadPool **ref,
 	pool->tasks = 0;
 	pool->running = 0;
 	pool->pending = 0;
-	lcuCS_initstateq(&pool->queue);
+	pool->urgent = 0;
+	pool->pendlimit = -1;
+	pool->waitroom = 0;
+	pool->waiters = NULL;
+	pool->memaccount = 0;
+	pool->memlimit = 0;
+	pool->memory = 0;
+	pool->allocs = 0;
+	for (i = 0; i < LCU_TASKPRIORITIES; i++) lcuCS_initstateq(&pool->queues[i]);
+	pool->workers = NULL;
+	pool->sticky = 0;
+	pool->stacksize = 0;
+	pool->masksize = 0;
+	pool->nmasks = 0;
+	pool->placed = 0;
+	pool->masks = NULL;
+	pool->warm = NULL;
 	*ref = pool;
 	return 0;
 
@@ -207,22 +541,30 @@ LCUI_FUNC int lcuTP_createtpool (lcu_ThreadPool **ref,
 }
 
 LCUI_FUNC void lcuTP_destroytpool (lcu_ThreadPool *pool) {
+	int i;
 	lcu_assert(getstatus(pool) == STATUS_CLOSED);
 	lcu_assert(pool->threads == 0);
 	lcu_assert(pool->idle == 0);
 	lcu_assert(pool->tasks == 0);
 	lcu_assert(pool->running == 0);
 	lcu_assert(pool->pending == 0);
-	lcu_assert(pool->queue.head == NULL);
-	lcu_assert(pool->queue.tail == NULL);
+	for (i = 0; i < LCU_TASKPRIORITIES; i++) {
+		lcu_assert(pool->queues[i].head == NULL);
+		lcu_assert(pool->queues[i].tail == NULL);
+	}
+	lcu_assert(pool->workers == NULL);
+	lcu_assert(pool->waiters == NULL);
 	uv_mutex_destroy(&pool->mutex);
 	if (lcuL_maskflag(pool, JOIN_PENDING)) uv_thread_join(&pool->last_terminated);
+	if (pool->masks)
+		pool->allocf(pool->allocud, pool->masks, pool->nmasks*pool->masksize, 0);
+	if (pool->warm) lcuL_freewarmstates(pool->warm);
 	pool->allocf(pool->allocud, pool, sizeof(lcu_ThreadPool), 0);
 }
 
 LCUI_FUNC void lcuTP_closetpool (lcu_ThreadPool *pool) {
-	int tasks, pending;
-	lcu_StateQ queue;
+	int i, tasks, pending;
+	lcu_StateQ queues[LCU_TASKPRIORITIES];
 
 	uv_mutex_lock(&pool->mutex);
 	setstatus(pool, STATUS_CLOSING);
@@ -232,9 +574,19 @@ LCUI_FUNC void lcuTP_closetpool (lcu_ThreadPool *pool) {
 	}
 	tasks = pool->tasks;
 	pending = pool->pending;
-	queue = pool->queue;
+	for (i = 0; i < LCU_TASKPRIORITIES; i++) {
+		queues[i] = pool->queues[i];
+		lcuCS_initstateq(&pool->queues[i]);
+	}
 	pool->pending = 0;
-	lcuCS_initstateq(&pool->queue);
+	pool->urgent = 0;
+	while (pool->waiters) {  /* they shall find the pool closed */
+		lcu_TaskWaiter *waiter = pool->waiters;
+		pool->waiters = waiter->next;
+		waiter->waiting = 0;
+		waiter->pool = NULL;
+		uv_async_send(waiter->async);
+	}
 	setstatus(pool, STATUS_CLOSED);
 	uv_mutex_unlock(&pool->mutex);
 
@@ -245,7 +597,8 @@ LCUI_FUNC void lcuTP_closetpool (lcu_ThreadPool *pool) {
 		lcuTP_destroytpool(pool);
 	} else if (pending > 0) {
 		lua_State *L;
-		while ((L = lcuCS_dequeuestateq(&queue))) lua_close(lcuL_tomain(L));
+		for (i = 0; i < LCU_TASKPRIORITIES; i++)
+			while ((L = lcuCS_dequeuestateq(&queues[i]))) lcuL_closestate(lcuL_tomain(L));
 	}
 }
 
@@ -256,13 +609,12 @@ LCUI_FUNC int lcuTP_resizetpool (lcu_ThreadPool *pool, int size, int create) {
 	newthreads = size-pool->size;
 	pool->size = size;
 	if (newthreads > 0) {
-		if (!create && newthreads > pool->pending) newthreads = pool->pending;
-		while (newthreads--) {
-			uv_thread_t tid;
-			err = uv_thread_create(&tid, threadmain, pool);
-			if (err) break;
-			pool->threads++;
+		if (!create) {
+			int running, pending;
+			counttasks_mx(pool, &running, &pending, 0);
+			if (newthreads > pending) newthreads = pending;
 		}
+		while (newthreads-- && !err) err = newthread_mx(pool);
 	} else if (hasextraidle_mx(pool)) {
 		uv_cond_signal(&pool->onwork);
 	}
@@ -282,18 +634,44 @@ static int collectthreadpool (lua_State *L) {
 	return 0;
 }
 
-LCUI_FUNC int lcuTP_addtpooltask (lcu_ThreadPool *pool, lua_State *L) {
-	lcu_ThreadPool **poolref;
+LCUI_FUNC int lcuTP_setthreadopts (lcu_ThreadPool *pool,
+                                   const lcu_ThreadOptions *options) {
+	size_t size = options->nmasks*options->masksize;
+	char *masks = NULL;
+	if (size > 0) {
+		masks = (char *)pool->allocf(pool->allocud, NULL, 0, size);
+		if (masks == NULL) return UV_ENOMEM;
+		memcpy(masks, options->masks, size);
+	}
+	uv_mutex_lock(&pool->mutex);
+	if (pool->masks)
+		pool->allocf(pool->allocud, pool->masks, pool->nmasks*pool->masksize, 0);
+	pool->sticky = options->sticky;
+	pool->stacksize = options->stacksize;
+	pool->masksize = options->masksize;
+	pool->nmasks = options->nmasks;
+	pool->placed = 0;
+	pool->masks = masks;
+	uv_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+LCUI_FUNC int lcuTP_addtpooltask (lcu_ThreadPool *pool,
+                                  lua_State *L,
+                                  int priority) {
+	TaskRef *ref;
 	int added;
 	int hasspace = lua_checkstack(L, 1);
 	lcu_assert(hasspace);
-	poolref = (lcu_ThreadPool **)lua_newuserdatauv(L, sizeof(lcu_ThreadPool *), 0);
-	*poolref = pool;
+	ref = (TaskRef *)lua_newuserdatauv(L, sizeof(TaskRef), 0);
+	ref->pool = pool;
+	ref->worker = NULL;
+	ref->priority = priority;
 	lcuL_setfinalizer(L, collectthreadpool);
 	lua_setfield(L, LUA_REGISTRYINDEX, LCU_TASKTPOOLREGKEY);
 
 	uv_mutex_lock(&pool->mutex);
-	added = addthread_mx(pool, L);
+	added = addthread_mx(pool, L, priority);
 	lcu_assert(added);
 	pool->tasks++;
 	uv_mutex_unlock(&pool->mutex);
@@ -304,15 +682,105 @@ LCUI_FUNC int lcuTP_addtpooltask (lcu_ThreadPool *pool, lua_State *L) {
 LCUI_FUNC int lcuTP_counttpool (lcu_ThreadPool *pool,
                                 lcu_ThreadCount *count,
                                 const char *what) {
+	int running, pending;
 	uv_mutex_lock(&pool->mutex);
+	counttasks_mx(pool, &running, &pending, 1);
 	for (; *what; what++) switch (*what) {
 		case 'e': count->expected = pool->size; break;
 		case 'a': count->actual = pool->threads; break;
-		case 'r': count->running = pool->running; break;
-		case 'p': count->pending = pool->pending; break;
-		case 's': count->suspended = pool->tasks-pool->running-pool->pending; break;
+		case 'r': count->running = running; break;
+		case 'p': count->pending = pending; break;
+		case 's': count->suspended = pool->tasks-running-pending; break;
 		case 'n': count->numoftasks = pool->tasks; break;
+		case 'm': count->memory = pool->memory; break;
+		case 'c': count->allocs = pool->allocs; break;
 	}
 	uv_mutex_unlock(&pool->mutex);
 	return 0;
 }
+
+LCUI_FUNC lua_Alloc lcuTP_getallocf (lcu_ThreadPool *pool, void **allocud) {
+	*allocud = pool->allocud;
+	return pool->allocf;
+}
+
+LCUI_FUNC int lcuTP_setwarmstates (lcu_ThreadPool *pool, int size, int refill) {
+	lcu_WarmStates *warm;
+	int err = 0;
+	uv_mutex_lock(&pool->mutex);
+	if (pool->warm == NULL && size > 0)
+		err = lcuL_newwarmstates(&pool->warm, pool->allocf, pool->allocud);
+	warm = pool->warm;
+	uv_mutex_unlock(&pool->mutex);
+	if (warm) err = lcuL_setwarmstates(warm, size, refill);
+	return err;
+}
+
+LCUI_FUNC lcu_WarmStates *lcuTP_getwarmstates (lcu_ThreadPool *pool) {
+	lcu_WarmStates *warm;
+	uv_mutex_lock(&pool->mutex);
+	warm = pool->warm;
+	uv_mutex_unlock(&pool->mutex);
+	return warm;
+}
+
+LCUI_FUNC void lcuTP_setmemlimit (lcu_ThreadPool *pool, int account, size_t limit) {
+	uv_mutex_lock(&pool->mutex);
+	pool->memaccount = account;
+	pool->memlimit = limit;
+	uv_mutex_unlock(&pool->mutex);
+}
+
+LCUI_FUNC void lcuTP_setpendlimit (lcu_ThreadPool *pool, int limit, int wait) {
+	uv_mutex_lock(&pool->mutex);
+	pool->pendlimit = limit;
+	pool->waitroom = wait;
+	signalroom_mx(pool);
+	uv_mutex_unlock(&pool->mutex);
+}
+
+LCUI_FUNC int lcuTP_hasroom (lcu_ThreadPool *pool, int *wait) {
+	int room;
+	uv_mutex_lock(&pool->mutex);
+	room = hasroom_mx(pool);
+	*wait = pool->waitroom;
+	uv_mutex_unlock(&pool->mutex);
+	return room;
+}
+
+LCUI_FUNC void lcuTP_addwaiter (lcu_ThreadPool *pool, lcu_TaskWaiter *waiter) {
+	lcu_TaskWaiter **ref = &pool->waiters;
+	uv_mutex_lock(&pool->mutex);
+	while (*ref) ref = &(*ref)->next;
+	waiter->next = NULL;
+	waiter->pool = pool;
+	waiter->waiting = 1;
+	*ref = waiter;
+	if (hasroom_mx(pool)) signalroom_mx(pool);  /* room was made meanwhile */
+	uv_mutex_unlock(&pool->mutex);
+}
+
+LCUI_FUNC void lcuTP_removewaiter (lcu_TaskWaiter *waiter) {
+	lcu_ThreadPool *pool = waiter->pool;
+	uv_mutex_lock(&pool->mutex);
+	if (waiter->waiting) {
+		lcu_TaskWaiter **ref = &pool->waiters;
+		while (*ref != waiter) ref = &(*ref)->next;
+		*ref = waiter->next;
+		waiter->waiting = 0;
+	} else {
+		signalroom_mx(pool);  /* room it was signaled for goes to others */
+	}
+	uv_mutex_unlock(&pool->mutex);
+	waiter->pool = NULL;
+}
+
+LCUI_FUNC int lcuTP_accountstate (lcu_ThreadPool *pool, lua_State *L) {
+	int account;
+	size_t limit;
+	uv_mutex_lock(&pool->mutex);
+	account = pool->memaccount;
+	limit = pool->memlimit;
+	uv_mutex_unlock(&pool->mutex);
+	return account ? lcuL_setmemaccount(L, limit) : 0;
+}
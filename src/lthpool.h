@@ -4,6 +4,7 @@
 
 #include "lcuconf.h"
 
+#include <uv.h>
 #include <lua.h>
 
 
@@ -19,7 +20,22 @@ LCUI_FUNC void lcuTP_closetpool (lcu_ThreadPool *pool);
 
 LCUI_FUNC int lcuTP_resizetpool (lcu_ThreadPool *pool, int size, int create);
 
-LCUI_FUNC int lcuTP_addtpooltask (lcu_ThreadPool *pool, lua_State *L);
+typedef struct lcu_ThreadOptions {
+	size_t stacksize;  /* stack size of new system threads, or 0 for default */
+	int sticky;  /* tasks are resumed by the system thread that started them */
+	int masksize;  /* size of each CPU mask, as in 'uv_cpumask_size' */
+	int nmasks;  /* number of CPU masks, or 0 for no affinity */
+	const char *masks;  /* CPU masks given in turns to new system threads */
+} lcu_ThreadOptions;
+
+LCUI_FUNC int lcuTP_setthreadopts (lcu_ThreadPool *pool,
+                                   const lcu_ThreadOptions *options);
+
+#define LCU_TASKPRIORITIES	3  /* from 0 (highest) to 2 (lowest) */
+
+LCUI_FUNC int lcuTP_addtpooltask (lcu_ThreadPool *pool,
+                                  lua_State *L,
+                                  int priority);
 
 typedef struct lcu_ThreadCount {
 	int expected;
@@ -28,12 +44,39 @@ typedef struct lcu_ThreadCount {
 	int pending;
 	int suspended;
 	int numoftasks;
+	size_t memory;
+	size_t allocs;
 } lcu_ThreadCount;
 
 LCUI_FUNC int lcuTP_counttpool (lcu_ThreadPool *pool,
                                 lcu_ThreadCount *count,
                                 const char *what);
 
+LCUI_FUNC lua_Alloc lcuTP_getallocf (lcu_ThreadPool *pool, void **allocud);
+
+typedef struct lcu_TaskWaiter {
+	struct lcu_TaskWaiter *next;
+	lcu_ThreadPool *pool;  /* pool it waits for, or NULL */
+	uv_async_t *async;  /* signaled when 'pool' has room for a new task */
+	int waiting;  /* is in the list of waiters of 'pool' */
+} lcu_TaskWaiter;
+
+LCUI_FUNC void lcuTP_setpendlimit (lcu_ThreadPool *pool, int limit, int wait);
+
+LCUI_FUNC int lcuTP_hasroom (lcu_ThreadPool *pool, int *wait);
+
+LCUI_FUNC void lcuTP_addwaiter (lcu_ThreadPool *pool, lcu_TaskWaiter *waiter);
+
+LCUI_FUNC void lcuTP_removewaiter (lcu_TaskWaiter *waiter);
+
+LCUI_FUNC int lcuTP_setwarmstates (lcu_ThreadPool *pool, int size, int refill);
+
+LCUI_FUNC struct lcu_WarmStates *lcuTP_getwarmstates (lcu_ThreadPool *pool);
+
+LCUI_FUNC void lcuTP_setmemlimit (lcu_ThreadPool *pool, int account, size_t limit);
+
+LCUI_FUNC int lcuTP_accountstate (lcu_ThreadPool *pool, lua_State *L);
+
 
 LCUI_FUNC void lcuTP_resumetask (lua_State *L);
 
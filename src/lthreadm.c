@@ -4,13 +4,23 @@
 #include "lmodaux.h"
 #include "lttyaux.h"
 #include "lchaux.h"
+#include "larenaux.h"
+#include "loperaux.h"
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <luamem.h>
 
 
+#if !LCU_LIBUVMINVER(45)
+#define uv_cpumask_size()	UV_ENOSYS
+#endif
+
 
 #define TPOOLGCCLS	LCU_PREFIX"lcu_ThreadPool *"
+#define TASKWAITERCLS	LCU_PREFIX"lcu_TaskWaiter"
 
 static lcu_ThreadPool *tothreads (lua_State *L, int idx) {
 	lcu_ThreadPool **ref = (lcu_ThreadPool **)luaL_checkudata(L, idx, LCU_THREADSCLS);
@@ -50,13 +60,120 @@ static int threads_close (lua_State *L) {
 	return 1;
 }
 
-/* succ [, errmsg] = threads:resize(value) */
+/* marks in 'mask' the CPUs in a list like '0-3,8' read from file 'path' */
+static int readcpulist (const char *path, char *mask, int size) {
+	char buffer[BUFSIZ];
+	char *c = buffer;
+	int count = 0;
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return 0;
+	if (fgets(buffer, sizeof(buffer), file) == NULL) buffer[0] = '\0';
+	fclose(file);
+	while (*c >= '0' && *c <= '9') {
+		long cpu = strtol(c, &c, 10), last = cpu;
+		if (*c == '-') last = strtol(c+1, &c, 10);
+		for (; cpu <= last && cpu < size; cpu++, count++) mask[cpu] = 1;
+		if (*c == ',') c++;
+	}
+	return count;
+}
+
+/* replaces the CPU mask on top by masks of its CPUs in each NUMA node */
+static int splitnumanodes (lua_State *L, int size) {
+	const char *cpus = (const char *)lua_touserdata(L, -1);
+	char *nodes = (char *)lua_newuserdatauv(L, size, 0);
+	char *masks;
+	int node, nmasks = 0;
+	memset(nodes, 0, size);
+	if (readcpulist("/sys/devices/system/node/online", nodes, size) == 0)
+		nodes[0] = 1;  /* assume a single node */
+	for (node = 0; node < size; node++) nmasks += nodes[node];
+	masks = (char *)lua_newuserdatauv(L, nmasks*size, 0);
+	memset(masks, 0, nmasks*size);
+	nmasks = 0;
+	for (node = 0; node < size; node++) if (nodes[node]) {
+		char *mask = masks+nmasks*size;
+		char path[64];
+		int cpu, count = 0;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (readcpulist(path, mask, size) == 0) memcpy(mask, cpus, size);
+		for (cpu = 0; cpu < size; cpu++) count += (mask[cpu] &= cpus[cpu]);
+		if (count > 0) nmasks++;  /* otherwise discard the mask */
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	return nmasks;
+}
+
+/* table at 'idx' is replaced by the userdata with its CPU masks (or nil) */
+static int checkthreadopts (lua_State *L, int idx, lcu_ThreadOptions *options) {
+	int numa;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "stacksize");
+	lua_getfield(L, idx, "sticky");
+	lua_getfield(L, idx, "numa");
+	lua_getfield(L, idx, "cpus");
+	if (lua_isnil(L, -4)) {
+		options->stacksize = 0;
+	} else {
+		lua_Integer size = lua_tointeger(L, -4);
+		if (!lua_isinteger(L, -4) || size < 0)
+			return luaL_error(L, "bad field stacksize (non-negative integer expected)");
+		options->stacksize = (size_t)size;
+	}
+	options->sticky = lua_toboolean(L, -3);
+	numa = lua_toboolean(L, -2);
+	options->masksize = 0;
+	options->nmasks = 0;
+	options->masks = NULL;
+	if (numa || !lua_isnil(L, -1)) {
+		int size = uv_cpumask_size();
+		char *mask;
+		if (size < 0) return size;
+		mask = (char *)lua_newuserdatauv(L, size, 0);
+		if (lua_isnil(L, -2)) {
+			memset(mask, 1, size);
+		} else {
+			int cpus = lua_absindex(L, -2);
+			lua_Integer i, n;
+			if (!lua_istable(L, cpus))
+				return luaL_error(L, "bad field cpus (table expected)");
+			memset(mask, 0, size);
+			n = luaL_len(L, cpus);
+			for (i = 1; i <= n; i++) {
+				lua_Integer cpu;
+				lua_geti(L, cpus, i);
+				cpu = lua_tointeger(L, -1);
+				if (!lua_isinteger(L, -1) || cpu < 0 || cpu >= size)
+					return luaL_error(L, "bad field cpus (invalid CPU %d)", (int)cpu);
+				mask[cpu] = 1;
+				lua_pop(L, 1);
+			}
+		}
+		options->masksize = size;
+		options->nmasks = numa ? splitnumanodes(L, size) : 1;
+		options->masks = (const char *)lua_touserdata(L, -1);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_replace(L, idx);
+	lua_pop(L, 4);
+	return 0;
+}
+
+/* succ [, errmsg] = threads:resize(value [, create [, options]]) */
 static int threads_resize (lua_State *L) {
 	int err;
 	lcu_ThreadPool *pool = tothreads(L, 1);
 	int size = (int)luaL_checkinteger(L, 2);
 	int create = lua_toboolean(L, 3);
 	luaL_argcheck(L, size >= 0, 2, "size cannot be negative");
+	if (!lua_isnoneornil(L, 4)) {
+		lcu_ThreadOptions options;
+		err = checkthreadopts(L, 4, &options);
+		if (!err) err = lcuTP_setthreadopts(pool, &options);
+		if (err) return lcuL_pusherrres(L, err);
+	}
 	err = lcuTP_resizetpool(pool, size, create);
 	return lcuL_pushresults(L, 0, err);
 }
@@ -68,7 +185,7 @@ static int threads_count (lua_State *L) {
 	const char *opt = luaL_checkstring(L, 2);
 	size_t len = strlen(opt);
 	luaL_checkstack(L, len, "too many values to return");
-	lcuTP_counttpool(pool, &count, len < 6 ? opt : "earpsn");
+	lcuTP_counttpool(pool, &count, len < 8 ? opt : "earpsnmc");
 	lua_settop(L, 2);
 	for (; *opt; opt++) switch (*opt) {
 		case 'e': lua_pushinteger(L, count.expected); break;
@@ -77,32 +194,172 @@ static int threads_count (lua_State *L) {
 		case 'p': lua_pushinteger(L, count.pending); break;
 		case 's': lua_pushinteger(L, count.suspended); break;
 		case 'n': lua_pushinteger(L, count.numoftasks); break;
+		case 'm': lua_pushinteger(L, (lua_Integer)count.memory); break;
+		case 'c': lua_pushinteger(L, (lua_Integer)count.allocs); break;
 		default: return luaL_error(L, "bad option (got '%c')", (int)*opt);
 	}
 	return lua_gettop(L)-2;
 }
 
+/* true = threads:memlimit([limit]) */
+static int threads_memlimit (lua_State *L) {
+	lcu_ThreadPool *pool = tothreads(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		lcuTP_setmemlimit(pool, 0, 0);
+	} else {
+		lua_Number limit = luaL_checknumber(L, 2);
+		luaL_argcheck(L, limit >= 0, 2, "limit cannot be negative");
+		lcuTP_setmemlimit(pool, 1, limit < (lua_Number)SIZE_MAX ? (size_t)limit
+		                                                        : SIZE_MAX);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* true = threads:pendlimit([limit [, wait]]) */
+static int threads_pendlimit (lua_State *L) {
+	lcu_ThreadPool *pool = tothreads(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		lcuTP_setpendlimit(pool, -1, 0);
+	} else {
+		lua_Integer limit = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, limit >= 0, 2, "limit cannot be negative");
+		lcuTP_setpendlimit(pool, limit < INT_MAX ? (int)limit : INT_MAX,
+		                         lua_toboolean(L, 3));
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* true [, errmsg] = threads:warmstates([size [, refill]]) */
+static int threads_warmstates (lua_State *L) {
+	lcu_ThreadPool *pool = tothreads(L, 1);
+	lua_Integer size = luaL_optinteger(L, 2, 0);
+	lua_Integer refill = luaL_optinteger(L, 3, size);
+	int err;
+	luaL_argcheck(L, size >= 0, 2, "size cannot be negative");
+	luaL_argcheck(L, refill >= 0, 3, "refill cannot be negative");
+	err = lcuTP_setwarmstates(pool, size < INT_MAX ? (int)size : INT_MAX,
+	                                refill < INT_MAX ? (int)refill : INT_MAX);
+	return lcuL_pushresults(L, 0, err);
+}
+
+/* getmetatable(waiter).__gc(waiter) */
+static int taskwaiter_gc (lua_State *L) {
+	lcu_TaskWaiter *waiter = (lcu_TaskWaiter *)luaL_checkudata(L, 1, TASKWAITERCLS);
+	if (waiter->pool) lcuTP_removewaiter(waiter);
+	return 0;
+}
+
+static void uv_onroom (uv_async_t *async) {
+	uv_handle_t *handle = (uv_handle_t *)async;
+	lua_State *thread = (lua_State *)handle->data;
+	lcu_TaskWaiter *waiter;
+	lcuU_pushhdlvalue(handle);
+	waiter = (lcu_TaskWaiter *)lua_touserdata(thread, -1);
+	lua_pop(thread, 1);
+	waiter->pool = NULL;  /* removed by the signaling thread */
+	if (lcuU_endcohdl(handle)) lcuU_resumecohdl(handle, 0);
+}
+
+static int cancelroom (lua_State *L) {
+	lcu_TaskWaiter *waiter;
+	lua_getfield(L, LUA_REGISTRYINDEX, LCU_SCHEDULERREGKEY);
+	lcu_pushopvalue(L, (lcu_Scheduler *)lua_touserdata(L, -1));
+	waiter = (lcu_TaskWaiter *)lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	if (waiter->pool) lcuTP_removewaiter(waiter);
+	return 1;
+}
+
+static int k_setupwaitroom (lua_State *L,
+                            uv_handle_t *handle,
+                            uv_loop_t *loop,
+                            lcu_Operation *op) {
+	lcu_ThreadPool *pool = tothreads(L, 1);
+	uv_async_t *async = (uv_async_t *)handle;
+	lcu_TaskWaiter *waiter =
+		(lcu_TaskWaiter *)lua_newuserdatauv(L, sizeof(lcu_TaskWaiter), 0);
+	int err;
+	waiter->pool = NULL;
+	waiter->async = async;
+	waiter->waiting = 0;
+	luaL_setmetatable(L, TASKWAITERCLS);
+	err = uv_async_init(loop, async, uv_onroom);
+	if (lcuT_armcohdl(L, op, err) < 0) return lcuL_pusherrres(L, err);
+	lcu_setopvalue(L, lcu_tosched(loop));
+	lcuTP_addwaiter(pool, waiter);
+	return -1;
+}
+
+/* returns -1 if 'pool' has room for a new task, or the number of results */
+static int awaitroom (lua_State *L, lcu_ThreadPool *pool, lua_CFunction retry) {
+	int wait;
+	if (lcuTP_hasroom(pool, &wait)) return -1;
+	if (wait && lua_isyieldable(L)) {
+		int ltype = lua_getfield(L, LUA_REGISTRYINDEX, LCU_SCHEDULERREGKEY);
+		lcu_Scheduler *sched = (lcu_Scheduler *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (ltype == LUA_TUSERDATA)  /* retry once there is room */
+			return lcuT_resetcohdlk(L, -UV_ASYNC, sched, k_setupwaitroom,
+			                                            retry,
+			                                            cancelroom);
+	}
+	return lcuL_pusherrres(L, UV_EAGAIN);
+}
+
 static int returntoperrmsg (lua_State *L, lua_State *NL) {
 	lua_pushboolean(L, 0);
 	if (lcuL_pushfrom(NULL, L, NL, -1, "error") != LUA_OK)
 		lcuL_warnmsg(L, "threads.dostring", lua_tostring(NL, -1));
-	lua_close(lcuL_tomain(NL));
+	lcuL_closestate(lcuL_tomain(NL));
 	return 2;  /* return false plus error message */
 }
 
+static lua_State *newtask (lua_State *L, lcu_ThreadPool *pool) {
+	void *allocud;
+	lua_Alloc allocf = lcuTP_getallocf(pool, &allocud);
+	lcu_WarmStates *warm = lcuTP_getwarmstates(pool);
+	lua_State *NL = warm ? lcuL_newstatew(L, warm)  /* take an initialized state */
+	                     : lcuL_newstatef(L, allocf, allocud);  /* create a similar state */
+	int err = lcuTP_accountstate(pool, NL);
+	if (err) {
+		lcuL_closestate(lcuL_tomain(NL));
+		lcu_error(L, err);
+	}
+	return NL;
+}
+
+/* letters 'h' and 'l' in 'mode' define the priority class of the task */
+static const char *checktaskmode (lua_State *L, int arg, int *priority) {
+	const char *mode = luaL_optstring(L, arg, NULL);
+	*priority = LCU_TASKPRIORITIES/2;
+	if (mode) {
+		int high = strchr(mode, 'h') != NULL;
+		int low = strchr(mode, 'l') != NULL;
+		luaL_argcheck(L, !(high && low), arg, "conflicting priority classes");
+		if (high) *priority = 0;
+		else if (low) *priority = LCU_TASKPRIORITIES-1;
+		else return mode;
+		if (!strchr(mode, 'b') && !strchr(mode, 't')) mode = NULL;  /* only class */
+	}
+	return mode;
+}
+
 static int dochunk (lua_State *L,
                     lcu_ThreadPool *pool,
                     lua_State *NL,
                     int status,
-                    int narg) {
+                    int narg,
+                    int priority) {
 	int top;
 	if (status != LUA_OK) return returntoperrmsg(L, NL);
 	top = lua_gettop(L);
 	status = lcuL_movefrom(NULL, NL, L, top > narg ? top-narg : 0, "argument");
 	if (status != LUA_OK) return returntoperrmsg(L, NL);
-	status = lcuTP_addtpooltask(pool, NL);
+	status = lcuTP_addtpooltask(pool, NL, priority);
 	if (status) {
-		lua_close(lcuL_tomain(NL));
+		lcuL_closestate(lcuL_tomain(NL));
 		return lcuL_pusherrres(L, status);
 	}
 	lua_pushboolean(L, 1);
@@ -115,34 +372,57 @@ static int threads_dostring (lua_State *L) {
 	size_t l;
 	const char *s = luamem_checkarray(L, 2, &l);
 	const char *chunkname = luaL_optstring(L, 3, s);
-	const char *mode = luaL_optstring(L, 4, NULL);
-	lua_State *NL = lcuL_newstate(L);  /* create a similar state */
-	int status = luaL_loadbufferx(NL, s, l, chunkname, mode);
-	return dochunk(L, pool, NL, status, 4);
+	int priority;
+	const char *mode = checktaskmode(L, 4, &priority);
+	int nret = awaitroom(L, pool, threads_dostring);
+	lua_State *NL;
+	if (nret >= 0) return nret;
+	NL = newtask(L, pool);
+	return dochunk(L, pool, NL, luaL_loadbufferx(NL, s, l, chunkname, mode), 4,
+	               priority);
 }
 
 /* succ [, errmsg] = threads:dofile([path [, mode, ...]]) */
 static int threads_dofile (lua_State *L) {
 	lcu_ThreadPool *pool = tothreads(L, 1);
 	const char *fpath = luaL_optstring(L, 2, NULL);
-	const char *mode = luaL_optstring(L, 3, NULL);
-	lua_State *NL = lcuL_newstate(L);  /* create a similar state */
-	int status = luaL_loadfilex(NL, fpath, mode);
-	return dochunk(L, pool, NL, status, 3);
+	int priority;
+	const char *mode = checktaskmode(L, 3, &priority);
+	int nret = awaitroom(L, pool, threads_dofile);
+	lua_State *NL;
+	if (nret >= 0) return nret;
+	NL = newtask(L, pool);
+	return dochunk(L, pool, NL, luaL_loadfilex(NL, fpath, mode), 3, priority);
 }
 
-/* threads [, errmsg] = system.threads([size]) */
+/* threads [, errmsg] = system.threads([size [, allocator [, options]]]) */
 static int threads_create (lua_State *L) {
+	static const char *const allocators[] = { "parent", "arena", NULL };
 	lcu_ThreadPool *pool;
 	if (lua_gettop(L) > 0) {
 		int err, size = (int)luaL_checkinteger(L, 1);
-		lcu_ThreadPool **ref =
-			(lcu_ThreadPool **)lua_newuserdatauv(L, sizeof(lcu_ThreadPool *), 0);
-		void *allocud;
-		lua_Alloc allocf = lua_getallocf(L, &allocud);
+		int arena = luaL_checkoption(L, 2, "parent", allocators);
+		int hasopts = !lua_isnoneornil(L, 3);
+		lcu_ThreadOptions options;
+		lcu_ThreadPool **ref;
+		void *allocud = NULL;
+		lua_Alloc allocf = arena ? lcuAR_alloc : lcuL_getallocf(L, &allocud);
+		if (arena) lcuAR_init();  /* before 'lcuAR_alloc' is ever called */
+		if (hasopts) {
+			err = checkthreadopts(L, 3, &options);
+			if (err) return lcuL_pusherrres(L, err);
+		}
+		ref = (lcu_ThreadPool **)lua_newuserdatauv(L, sizeof(lcu_ThreadPool *), 0);
 		err = lcuTP_createtpool(ref, allocf, allocud);
 		if (err) return lcuL_pusherrres(L, err);
 		pool = *ref;
+		if (hasopts) {
+			err = lcuTP_setthreadopts(pool, &options);
+			if (err) {
+				lcuTP_closetpool(pool);
+				return lcuL_pusherrres(L, err);
+			}
+		}
 		if (size > 0) {
 			err = lcuTP_resizetpool(pool, size, 1);
 			if (err) {
@@ -175,6 +455,10 @@ LCUMOD_API int luaopen_coutil_threads (lua_State *L) {
 		{"__gc", tpoolgc_gc},
 		{NULL, NULL}
 	};
+	static const luaL_Reg waitermt[] = {
+		{"__gc", taskwaiter_gc},
+		{NULL, NULL}
+	};
 	static const luaL_Reg threadsmt[] = {
 		{"__index", NULL},
 		{"__close", threads_close},
@@ -185,6 +469,9 @@ LCUMOD_API int luaopen_coutil_threads (lua_State *L) {
 		{"close", threads_close},
 		{"resize", threads_resize},
 		{"count", threads_count},
+		{"memlimit", threads_memlimit},
+		{"pendlimit", threads_pendlimit},
+		{"warmstates", threads_warmstates},
 		{"dostring", threads_dostring},
 		{"dofile", threads_dofile},
 		{NULL, NULL}
@@ -195,6 +482,9 @@ LCUMOD_API int luaopen_coutil_threads (lua_State *L) {
 	luaL_newmetatable(L, TPOOLGCCLS)  /* metatable for tpool sentinel */;
 	luaL_setfuncs(L, poolrefmt, 0);  /* add metamethods to metatable */
 	lua_pop(L, 1);  /* pop metatable */
+	luaL_newmetatable(L, TASKWAITERCLS);  /* metatable for waiters of room */
+	luaL_setfuncs(L, waitermt, 0);  /* add metamethods to metatable */
+	lua_pop(L, 1);  /* pop metatable */
 	luaL_newmetatable(L, LCU_THREADSCLS);  /* metatable for thread pools */
 	luaL_setfuncs(L, threadsmt, 0);  /* add metamethods to metatable */
 	lua_pushvalue(L, -2);  /* push library */
@@ -30,7 +30,7 @@ static int system_time (lua_State *L) {
 	return 1;
 }
 
-/* succ [, errmsg] = system.suspend([delay]) */
+/* succ [, errmsg] = system.suspend([delay [, mode]]) */
 static int returntrue (lua_State *L) {
 	lua_pushboolean(L, 1);
 	return 1;
@@ -67,10 +67,29 @@ static int k_setuptimer (lua_State *L,
 	if (err < 0) return lcuL_pusherrres(L, err);
 	return -1;  /* yield on success */
 }
+static void uv_onwheel (uv_loop_t *loop, uv_req_t *request) {
+	if (lcuU_endcoreq(loop, request)) lcuU_resumecoreq(loop, request, 0);
+}
+static int k_setupwheel (lua_State *L,
+                         uv_req_t *request,
+                         uv_loop_t *loop,
+                         lcu_Operation *op) {
+	uint64_t msecs = (uint64_t)(lua_tonumber(L, 1)*1e3);
+	(void)request;
+	lcuT_armwheelreq(L, loop, op, msecs, uv_onwheel);
+	return -1;  /* yield on success */
+}
 static int system_suspend (lua_State *L) {
 	lcu_Scheduler *sched = lcu_getsched(L);
 	lua_Number delay = luaL_optnumber(L, 1, 0);
-	if (lcuL_checknoyieldmode(L, 2)) {
+	const char *mode = luaL_optstring(L, 2, "");
+	int noyield = 0, coarse = 0;
+	for (; *mode; mode++) switch (*mode) {
+		case LCU_NOYIELDMODE: noyield = 1; break;
+		case 'c': coarse = 1; break;
+		default: return luaL_error(L, "unknown mode char (got '%c')", *mode);
+	}
+	if (noyield) {
 		if (delay > 0) {
 			delay *= 1e3;
 			luaL_argcheck(L, delay <= UINT_MAX, 1, "out of range");
@@ -78,6 +97,8 @@ static int system_suspend (lua_State *L) {
 		}
 	} else if (delay > 0) {
 		luaL_argcheck(L, delay*1e3 <= 0xffffffffffffffff, 1, "out of range");
+		if (coarse)
+			return lcuT_resetcoreqk(L, LCU_WHEELREQ, sched, k_setupwheel, returntrue, NULL);
 		return lcuT_resetcohdlk(L, UV_TIMER, sched, k_setuptimer, returntrue, NULL);
 	} else {
 		return lcuT_resetcohdlk(L, UV_IDLE, sched, k_setupidle, returntrue, NULL);
@@ -85,6 +106,24 @@ static int system_suspend (lua_State *L) {
 	return returntrue(L);
 }
 
+/* ... = system.deadline(seconds, f, ...) */
+static int k_calldeadline (lua_State *L, int status, lua_KContext kctx) {
+	(void)kctx;
+	lcuT_stopdeadline(L, lcu_getsched(L), 1);
+	if (status != LUA_OK && status != LUA_YIELD) return lua_error(L);
+	return lua_gettop(L)-1;
+}
+static int system_deadline (lua_State *L) {
+	lcu_Scheduler *sched = lcu_getsched(L);
+	lua_Number delay = luaL_checknumber(L, 1);
+	luaL_checkany(L, 2);
+	if (delay < 0) delay = 0;
+	else luaL_argcheck(L, delay*1e3 <= 0xffffffffffffffff, 1, "out of range");
+	lcuT_pushdeadline(L, sched, (uint64_t)(delay*1e3));
+	lua_replace(L, 1);
+	return k_calldeadline(L, lua_pcallk(L, lua_gettop(L)-2, LUA_MULTRET, 0, 0, k_calldeadline), 0);
+}
+
 
 LCUI_FUNC void lcuM_addtimef (lua_State *L) {
 	static const luaL_Reg luaf[] = {
@@ -94,6 +133,7 @@ LCUI_FUNC void lcuM_addtimef (lua_State *L) {
 	static const luaL_Reg modf[] = {
 		{"time", system_time},
 		{"suspend", system_suspend},
+		{"deadline", system_deadline},
 		{NULL, NULL}
 	};
 	lcuM_setfuncs(L, luaf, 0);
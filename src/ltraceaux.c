@@ -0,0 +1,186 @@
+#include "ltraceaux.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <lauxlib.h>
+
+
+LCUI_DDEF volatile int lcuTR_enabled = 0;
+
+#if defined(__GNUC__)
+#define loadacquire(P)	__atomic_load_n(P, __ATOMIC_ACQUIRE)
+#define storerelease(P,V)	__atomic_store_n(P, V, __ATOMIC_RELEASE)
+#define fenceacquire()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fencerelease()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#define loadacquire(P)	(*(P))
+#define storerelease(P,V)	(*(P) = (V))
+#define fenceacquire()	((void)0)
+#define fencerelease()	((void)0)
+#endif
+
+/*
+ * Each system thread writes records only into its own ring, without locks.
+ * Each slot of a ring has the sequence number of the record it holds, which
+ * is cleared while the record is written, so the exporter drops any slot
+ * that is overwritten while it is copied. The mutex protects the list of
+ * rings, which are never released, but reused by new threads once released
+ * by old ones.
+ */
+typedef struct TraceSlot {
+	size_t seq;  /* number of the record plus one, or 0 while it is written */
+	lcu_TraceRecord record;
+} TraceSlot;
+
+typedef struct TraceRing {
+	struct TraceRing *next;
+	int inuse;  /* is assigned to a system thread */
+	unsigned int thread;  /* number of the thread using the ring */
+	size_t head;  /* number of records written so far */
+	TraceSlot slots[LCU_TRACERINGSIZE];
+} TraceRing;
+
+static uv_once_t once = UV_ONCE_INIT;
+static uv_key_t ringkey;
+static uv_mutex_t mutex;
+static TraceRing *rings = NULL;
+static unsigned int nthreads = 0;
+static uint64_t resetat = 0;  /* records before this are discarded */
+
+static void inittrace (void) {
+	if (uv_key_create(&ringkey) || uv_mutex_init(&mutex)) abort();
+}
+
+static TraceRing *acquirering (void) {
+	TraceRing *ring;
+	uv_mutex_lock(&mutex);
+	for (ring = rings; ring && ring->inuse; ring = ring->next);
+	if (ring == NULL) {
+		ring = (TraceRing *)malloc(sizeof(TraceRing));
+		if (ring) {
+			memset(ring->slots, 0, sizeof(ring->slots));
+			ring->head = 0;
+			ring->next = rings;
+			rings = ring;
+		}
+	}
+	if (ring) {
+		ring->inuse = 1;
+		ring->thread = ++nthreads;
+	}
+	uv_mutex_unlock(&mutex);
+	uv_key_set(&ringkey, ring);
+	return ring;
+}
+
+LCUI_FUNC void lcuTR_record (const void *operation,
+                             const void *coroutine,
+                             const char *event) {
+	TraceRing *ring;
+	TraceSlot *slot;
+	size_t head;
+	uv_once(&once, inittrace);
+	ring = (TraceRing *)uv_key_get(&ringkey);
+	if (ring == NULL && (ring = acquirering()) == NULL) return;
+	head = ring->head;  /* only written by this thread */
+	slot = &ring->slots[head%LCU_TRACERINGSIZE];
+	storerelease(&slot->seq, 0);
+	fencerelease();  /* clear 'seq' before the record is changed */
+	slot->record.time = uv_hrtime();
+	slot->record.thread = ring->thread;
+	slot->record.operation = operation;
+	slot->record.coroutine = coroutine;
+	slot->record.event = event;
+	storerelease(&slot->seq, head+1);
+	storerelease(&ring->head, head+1);
+}
+
+LCUI_FUNC void lcuTR_reset (void) {
+	uv_once(&once, inittrace);
+	uv_mutex_lock(&mutex);
+	resetat = uv_hrtime();
+	uv_mutex_unlock(&mutex);
+}
+
+LCUI_FUNC void lcuTR_releasethread (void) {
+	TraceRing *ring;
+	uv_once(&once, inittrace);
+	ring = (TraceRing *)uv_key_get(&ringkey);
+	if (ring) {
+		uv_key_set(&ringkey, NULL);
+		uv_mutex_lock(&mutex);
+		ring->inuse = 0;
+		uv_mutex_unlock(&mutex);
+	}
+}
+
+static int comparerecords (const void *a, const void *b) {
+	uint64_t ta = ((const lcu_TraceRecord *)a)->time;
+	uint64_t tb = ((const lcu_TraceRecord *)b)->time;
+	return (ta > tb) - (ta < tb);
+}
+
+static size_t collectring (TraceRing *ring, lcu_TraceRecord *records,
+                           uint64_t from, uint64_t to) {
+	size_t i, n = 0, head = loadacquire(&ring->head);
+	size_t first = head > LCU_TRACERINGSIZE ? head-LCU_TRACERINGSIZE : 0;
+	for (i = first; i < head; i++) {
+		TraceSlot *slot = &ring->slots[i%LCU_TRACERINGSIZE];
+		lcu_TraceRecord *record = &records[n];
+		if (loadacquire(&slot->seq) != i+1) continue;  /* being overwritten */
+		*record = slot->record;
+		fenceacquire();  /* copy the record before 'seq' is checked again */
+		if (loadacquire(&slot->seq) != i+1) continue;  /* overwritten meanwhile */
+		if (record->time >= from && record->time <= to && record->time >= resetat)
+			n++;
+	}
+	return n;
+}
+
+static void addrecord (luaL_Buffer *b, lcu_TraceRecord *record, unsigned long pid) {
+	char buf[256];
+	snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+	                           "\"pid\":%lu,\"tid\":%u,\"ts\":%llu.%03u,"
+	                           "\"args\":{\"operation\":\"%p\",\"coroutine\":\"%p\"}}",
+	         record->event, pid, record->thread,
+	         (unsigned long long)(record->time/1000), (unsigned)(record->time%1000),
+	         record->operation, record->coroutine);
+	luaL_addstring(b, buf);
+}
+
+static size_t countrings (void) {
+	TraceRing *ring;
+	size_t count = 0;
+	uv_mutex_lock(&mutex);
+	for (ring = rings; ring; ring = ring->next) count++;
+	uv_mutex_unlock(&mutex);
+	return count;
+}
+
+LCUI_FUNC void lcuTR_pushchrome (lua_State *L, uint64_t from, uint64_t to) {
+	size_t i, n = 0, count;
+	unsigned long pid = (unsigned long)uv_os_getpid();
+	lcu_TraceRecord *records;
+	TraceRing *ring;
+	luaL_Buffer b;
+	uv_once(&once, inittrace);
+	count = countrings();  /* rings are only added, so exceeding ones are ignored */
+	records = (lcu_TraceRecord *)lua_newuserdatauv(L,
+		count*LCU_TRACERINGSIZE*sizeof(lcu_TraceRecord), 0);
+	uv_mutex_lock(&mutex);
+	for (ring = rings; ring && count > 0; ring = ring->next, count--)
+		n += collectring(ring, records+n, from, to);
+	uv_mutex_unlock(&mutex);
+	qsort(records, n, sizeof(lcu_TraceRecord), comparerecords);
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "{\"traceEvents\":[");
+	for (i = 0; i < n; i++) {
+		if (i > 0) luaL_addchar(&b, ',');
+		addrecord(&b, &records[i], pid);
+	}
+	luaL_addstring(&b, "],\"displayTimeUnit\":\"ns\"}");
+	luaL_pushresult(&b);
+	lua_remove(L, -2);  /* discard 'records' */
+}
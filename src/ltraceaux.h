@@ -0,0 +1,35 @@
+#ifndef ltraceaux_h
+#define ltraceaux_h
+
+
+#include "lcuconf.h"
+
+#include <stdint.h>
+#include <lua.h>
+
+
+typedef struct lcu_TraceRecord {
+	uint64_t time;  /* from 'uv_hrtime' */
+	unsigned int thread;  /* number of the system thread */
+	const void *operation;
+	const void *coroutine;
+	const char *event;  /* static string that identifies the event */
+} lcu_TraceRecord;
+
+LCUI_DDEC(volatile int lcuTR_enabled;)
+
+#define lcuTR_trace(O,L,M)	(lcuTR_enabled ? \
+	lcuTR_record((const void *)(O), (const void *)(L), (M)) : (void)0)
+
+LCUI_FUNC void lcuTR_record (const void *operation,
+                             const void *coroutine,
+                             const char *event);
+
+LCUI_FUNC void lcuTR_reset (void);
+
+LCUI_FUNC void lcuTR_releasethread (void);
+
+LCUI_FUNC void lcuTR_pushchrome (lua_State *L, uint64_t from, uint64_t to);
+
+
+#endif
@@ -0,0 +1,61 @@
+-- Usage: lua memory.lua [count]
+-- Reports the memory used by each coroutine parked awaiting an operation.
+-- Each case is measured in a separate process to avoid interference.
+-- Only resident memory is reported, because operations are allocated outside
+-- the Lua heap, so 'collectgarbage("count")' does not include them.
+
+local system = require "coutil.system"
+
+local cases = {
+	yield = function ()
+		coroutine.yield()
+	end,
+	idle = function ()
+		system.suspend()
+	end,
+	timer = function ()
+		system.suspend(3600)
+	end,
+	signal = function ()
+		system.awaitsig("userdef1")
+	end,
+}
+
+local function measure()
+	for i = 1, 3 do collectgarbage("collect") end
+	return system.procinfo("r")
+end
+
+local name, count = ...
+if cases[name] then
+	local f = cases[name]
+	local coros = {}
+	count = math.tointeger(count)
+	for i = 1, count do
+		coros[i] = false
+	end
+	local rss = measure()
+	for i = 1, count do
+		local co = coroutine.create(f)
+		assert(coroutine.resume(co))
+		coros[i] = co
+	end
+	local parkedrss = measure()
+	print(string.format("%-8s %10.1f", name, (parkedrss-rss)/count))
+	for i = 1, count do
+		coroutine.resume(coros[i])  -- cancel the operation
+	end
+	system.run()
+else
+	count = math.tointeger(name or 1e5)
+	local i = -1
+	while arg[i-1] ~= nil do i = i-1 end
+	local lua = arg[i] or "lua"
+	print(string.format("%-8s %10s   (bytes per coroutine, %d coroutines)",
+		"case", "resident", count))
+	for _, name in ipairs{ "yield", "idle", "timer", "signal" } do
+		local command = string.format("%q %q %s %d", lua, arg[0], name, count)
+		local output = assert(io.popen(command)):read("a")
+		io.write(output)
+	end
+end
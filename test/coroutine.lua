@@ -766,6 +766,38 @@ do case "inherit preload"
 	done()
 end
 
+do case "changed preload"
+	spawn(function ()
+		local function loadmodule()
+			return assert(stateco.load[[
+				local package = require "package"
+				package.path = ""
+				package.cpath = ""
+				return require("module").name
+			]])
+		end
+		local function first() return {name = "first"} end
+		local function second() return {name = "second"} end
+
+		package.preload["module"] = first
+		local co1 = loadmodule()
+		package.preload["module"] = second
+		local co2 = loadmodule()
+		package.preload["module"] = first
+		local co3 = loadmodule()
+		package.preload["module"] = nil
+
+		for co, name in pairs{ [co1] = "first", [co2] = "second", [co3] = "first" } do
+			local ok, res = system.resume(co)
+			assert(ok == true and res == name)
+		end
+	end)
+
+	assert(system.run() == false)
+
+	done()
+end
+
 do case "keep values on stack"
 	local system = require "coutil.system"
 	local stateco = require "coutil.coroutine"
@@ -795,3 +827,37 @@ do case "keep values on stack"
 
 	done()
 end
+
+do case "warm states"
+	asserterr("size cannot be negative", pcall(stateco.warmstates, -1))
+	asserterr("refill cannot be negative", pcall(stateco.warmstates, 1, -1))
+	assert(stateco.warmstates(3, 1) == true)
+
+	spawn(function ()
+		package.preload["module"] = function ()
+			return {name = "module"}
+		end
+
+		local cos = {}
+		for i = 1, 5 do
+			cos[i] = assert(stateco.load[[
+				local package = require "package"
+				package.path = ""
+				package.cpath = ""
+				return require("module").name, ...
+			]])
+		end
+
+		package.preload["module"] = nil
+
+		for i, co in ipairs(cos) do
+			local ok, name, value = system.resume(co, i)
+			assert(ok == true and name == "module" and value == i)
+		end
+	end)
+
+	assert(system.run() == false)
+	assert(stateco.warmstates() == true)
+
+	done()
+end
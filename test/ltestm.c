@@ -1,5 +1,6 @@
 #include "lauxlib.h"
 #include "lmodaux.h"
+#include "coutil.h"
 
 
 /* succ [, errmsg] = coroutine.load(chunk, chunkname, mode) */
@@ -17,11 +18,84 @@ static int test_yieldsaved (lua_State *L) {
 }
 
 
+
+/* value = awaitwork(value) */
+static void dowork (uv_work_t *work) {
+	(void)work;
+}
+static void uv_onworked (uv_work_t *work, int err) {
+	uv_loop_t *loop = work->loop;
+	uv_req_t *request = (uv_req_t *)work;
+	lua_State *thread = lcu_endreq(loop, request);
+	if (thread) {
+		lua_pushinteger(thread, err);
+		lcu_resumereq(loop, request, 1);
+	}
+}
+static int pusherrres (lua_State *L, int err) {
+	lua_pushboolean(L, 0);
+	lua_pushstring(L, uv_strerror(err));
+	return 2;
+}
+static int returnworked (lua_State *L) {
+	int err = (int)lua_tointeger(L, -1);
+	if (err < 0) return pusherrres(L, err);
+	lua_settop(L, 1);
+	return 1;
+}
+static int k_setupwork (lua_State *L,
+                        uv_req_t *request,
+                        uv_loop_t *loop,
+                        lcu_Operation *op) {
+	uv_work_t *work = (uv_work_t *)request;
+	int err = uv_queue_work(loop, work, dowork, uv_onworked);
+	lcu_armreq(L, loop, op, err);
+	if (err < 0) return pusherrres(L, err);
+	return -1;  /* yield on success */
+}
+static int test_awaitwork (lua_State *L) {
+	lcu_Scheduler *sched = lcu_checkscheduler(L);
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	return lcu_awaitreq(L, sched, UV_WORK, k_setupwork, returnworked, NULL);
+}
+
+
+/* function = workf(name) */
+static lua_Integer fillbytes (lcu_WorkValue *values, int nvalues) {
+	size_t i;
+	if (nvalues != 2 || values[1].integer < 0 || values[1].integer > 255) return UV_EINVAL;
+	for (i = 0; i < values[0].buffer.size; i++)
+		values[0].buffer.data[i] = (char)values[1].integer;
+	return (lua_Integer)values[0].buffer.size;
+}
+static lua_Integer countbytes (lcu_WorkValue *values, int nvalues) {
+	size_t i;
+	lua_Integer count = 0;
+	if (nvalues != 2) return UV_EINVAL;
+	for (i = 0; i < values[0].buffer.size; i++)
+		if ((unsigned char)values[0].buffer.data[i] == values[1].integer) count++;
+	return count;
+}
+static int test_workf (lua_State *L) {
+	static const char *const names[] = {"fill", "count", NULL};
+	switch (luaL_checkoption(L, 1, NULL, names)) {
+		case 0: lcu_pushworkf(L, fillbytes, "bi"); break;
+		case 1: lcu_pushworkf(L, countbytes, "si"); break;
+	}
+	return 1;
+}
+
+
 LCUMOD_API int luaopen_coutil_test (lua_State *L) {
 	static const luaL_Reg modf[] = {
 		{"yieldsaved", test_yieldsaved},
+		{"awaitwork", test_awaitwork},
+		{"workf", test_workf},
 		{NULL, NULL}
 	};
 	luaL_newlib(L, modf);
+	lua_pushinteger(L, lcu_apiversion());
+	lua_setfield(L, -2, "apiversion");
 	return 1;
 }
@@ -6,6 +6,18 @@ local function testbooloption(sock, name)
 	assert(sock:setoption(name, false) == true)
 end
 
+local function testbusypoll(sock)
+	asserterr("number expected", pcall(sock.setoption, sock, "busypoll", true))
+	for _, value in ipairs{ -1, 0, math.huge } do
+		asserterr("out of range", pcall(sock.setoption, sock, "busypoll", value))
+	end
+	for _, value in ipairs{ 1e-6, 5e-5, false } do
+		local ok, err = sock:setoption("busypoll", value)
+		assert(ok == true or err == "operation not permitted"
+		                  or err == "operation not supported on socket")
+	end
+end
+
 local ipaddr = {
 	ipv4 = {
 		localhost = "127.0.0.1",
@@ -119,6 +131,11 @@ for _, domain in ipairs{ "ipv4", "ipv6" } do
 		end
 	end
 
+	do case "busypoll"
+		testbusypoll(create())
+		done()
+	end
+
 	do case "mcastttl"
 		local datagram = assert(create())
 		for _, value in ipairs{ 1, 2, 3, 123, 128, 255 } do
@@ -871,6 +888,11 @@ for _, domain in ipairs{ "ipv4", "ipv6" } do
 		done()
 	end
 
+	do case "busypoll"
+		testbusypoll(create("stream"))
+		done()
+	end
+
 	do case "keepalive"
 		local stream = assert(create("stream"))
 		for _, value in ipairs{ 1, 2, 3, 123, 128, 255 } do
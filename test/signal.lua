@@ -241,3 +241,29 @@ do case "ignore errors after cancel"
 
 	done()
 end
+
+do case "await any"
+	local stage = 0
+	spawn(function ()
+		local i, res = system.awaitany({system.suspend, 3600},
+		                               {system.awaitsig, "userdef1"},
+		                               {system.awaitsig, "userdef2"})
+		assert(i == 2)
+		assert(res == "userdef1")
+		stage = 1
+		system.suspend()
+		stage = 2
+	end)
+	assert(stage == 0)
+
+	spawn(function ()
+		system.suspend()
+		sendsignal("userdef1")
+	end)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 2)
+
+	done()
+end
@@ -465,6 +465,35 @@ function teststream(create, addresses)
 		done()
 	end
 
+	do case "deadline"
+		local stage = 0
+		spawn(function ()
+			local server = assert(create("passive"))
+			assert(server:bind(addresses.bindable))
+			assert(server:listen(backlog))
+			asserterr("timeout", system.deadline(.01, server.accept, server))
+			stage = 1
+			local stream = assert(system.deadline(3600, server.accept, server))
+			stage = 2
+			assert(stream:close())
+			assert(server:close())
+		end)
+
+		spawn(function ()
+			repeat system.suspend() until stage >= 1
+			local stream = assert(create("stream"))
+			assert(stream:connect(addresses.bindable))
+			assert(stream:close())
+		end)
+		assert(stage == 0)
+
+		gc()
+		assert(system.run() == false)
+		assert(stage == 2)
+
+		done()
+	end
+
 	newtest "connect"
 
 	do case "errors"
@@ -1178,6 +1207,88 @@ end
 		done()
 	end
 
+	do case "deadline"
+		local stage = 0
+		spawn(function ()
+			local server = assert(create("passive"))
+			assert(server:bind(addresses.bindable))
+			assert(server:listen(backlog))
+			local stream = assert(server:accept())
+			stage = 1
+			asserterr("timeout", system.deadline(.01, stream.read, stream, memory.create(10)))
+			stage = 2
+			local buffer = memory.create(10)
+			assert(system.deadline(3600, stream.read, stream, buffer) == 5)
+			assert(memory.tostring(buffer, 1, 5) == "hello")
+			stage = 3
+			assert(stream:close())
+			assert(server:close())
+		end)
+
+		spawn(function ()
+			local stream = assert(create("stream"))
+			assert(stream:connect(addresses.bindable))
+			repeat system.suspend() until stage >= 2
+			assert(stream:write("hello"))
+			repeat system.suspend() until stage >= 3
+			assert(stream:close())
+		end)
+		assert(stage == 0)
+
+		gc()
+		assert(system.run() == false)
+		assert(stage == 3)
+
+		done()
+	end
+
+	do case "await any"
+		local stage = 0
+		spawn(function ()
+			local server = assert(create("passive"))
+			assert(server:bind(addresses.bindable))
+			assert(server:listen(backlog))
+			local stream1 = assert(server:accept())
+			local stream2 = assert(server:accept())
+			stage = 1
+			local buffer1, buffer2 = memory.create(10), memory.create(10)
+			local i, bytes = system.awaitany({stream1.read, stream1, buffer1},
+			                                 {stream2.read, stream2, buffer2},
+			                                 {server.accept, server})
+			assert(i == 2)
+			assert(bytes == 5)
+			assert(memory.tostring(buffer2, 1, 5) == "hello")
+			stage = 2
+			assert(stream1:read(buffer1) == 5)
+			assert(memory.tostring(buffer1, 1, 5) == "world")
+			stage = 3
+			assert(stream1:close())
+			assert(stream2:close())
+			assert(server:close())
+		end)
+
+		spawn(function ()
+			local stream1 = assert(create("stream"))
+			assert(stream1:connect(addresses.bindable))
+			local stream2 = assert(create("stream"))
+			assert(stream2:connect(addresses.bindable))
+			repeat system.suspend() until stage >= 1
+			assert(stream2:write("hello"))
+			repeat system.suspend() until stage >= 2
+			assert(stream1:write("world"))
+			repeat system.suspend() until stage >= 3
+			assert(stream1:close())
+			assert(stream2:close())
+		end)
+		assert(stage == 0)
+
+		gc()
+		assert(system.run() == false)
+		assert(stage == 3)
+
+		done()
+	end
+
 	newtest "send"
 
 if standard == "posix" then
@@ -128,6 +128,250 @@ do case "run loop"
 	done()
 end
 
+do case "run budget"
+	asserterr("number expected", pcall(system.run, "budget"))
+	asserterr("out of range", pcall(system.run, "budget", -1))
+	asserterr("out of range", pcall(system.run, "budget", math.huge))
+
+	local pending, used, resumed = system.run("budget", 1)
+	assert(pending == false)
+	assert(used >= 0 and used < 1)
+	assert(resumed == 0)
+
+	local n = 3
+	local stage = {}
+	for i = 1, n do
+		stage[i] = 0
+		spawn(function (c)
+			for j = 1, c do
+				system.suspend()
+				stage[i] = j
+			end
+		end, i)
+	end
+	gc()
+	local pending, used, resumed = system.run("budget", 1)
+	assert(pending == false)
+	assert(used >= 0 and used < 1)
+	assert(resumed == 6)
+	for i = 1, n do
+		assert(stage[i] == i)
+	end
+
+	local stage = 0
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		system.suspend(.01)
+		stage = 1
+		system.suspend(10)
+		stage = 2
+	end)
+	gc()
+	local pending, used, resumed = system.run("budget", .1)
+	assert(pending == true)
+	assert(used >= .09)
+	assert(resumed == 1)
+	assert(stage == 1)
+
+	spawn(function ()
+		system.suspend()
+		system.halt()
+	end)
+	gc()
+	local pending, used, resumed = system.run("budget", 10)
+	assert(pending == true)
+	assert(used < 10)
+	assert(resumed == 1)
+	assert(stage == 1)
+
+	coroutine.resume(garbage.thread)
+	assert(stage == 2)
+	assert(system.run() == false)
+
+	done()
+end
+
+do case "run spin"
+	asserterr("number expected", pcall(system.run, "spin"))
+	asserterr("out of range", pcall(system.run, "spin", -1))
+
+	local pending, spins, waits = system.run("spin", 1)
+	assert(pending == false)
+	assert(spins == 1)
+	assert(waits == 0)
+
+	local stage = 0
+	spawn(function ()
+		system.suspend(.05)
+		stage = 1
+	end)
+	gc()
+	local pending, spins, waits = system.run("spin", 0)
+	assert(pending == false)
+	assert(spins == 0)
+	assert(waits >= 1)
+	assert(stage == 1)
+
+	local stage = 0
+	spawn(function ()
+		system.suspend(.05)
+		stage = 1
+	end)
+	gc()
+	local pending, spins, waits = system.run("spin", 1)
+	assert(pending == false)
+	assert(spins > 1)
+	assert(waits == 0)
+	assert(stage == 1)
+
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		system.suspend(10)
+	end)
+	spawn(function ()
+		system.suspend()
+		system.halt()
+	end)
+	gc()
+	local pending, spins, waits = system.run("spin", 1)
+	assert(pending == true)
+	assert(spins >= 1)
+	assert(waits == 0)
+
+	coroutine.resume(garbage.thread)
+	assert(system.run() == false)
+
+	done()
+end
+
+newtest "backend" --------------------------------------------------------------
+
+if standard == "posix" then
+do case "poll descriptor"
+	local fd, timeout = system.backend()
+	assert(math.type(fd) == "integer")
+	assert(fd >= 0)
+	assert(timeout == math.huge)
+
+	local stage = 0
+	spawn(function ()
+		system.suspend(.2)
+		stage = 1
+	end)
+	local again, timeout = system.backend()
+	assert(again == fd)
+	assert(timeout > 0 and timeout <= .2)
+
+	spawn(function ()
+		system.suspend()
+		stage = -1
+	end)
+	again, timeout = system.backend()
+	assert(timeout == 0)
+
+	local pending, timeout = system.run("ready")
+	assert(pending == true)
+	assert(stage == -1)
+	assert(timeout > 0 and timeout <= .2)
+
+	local deadline = os.time()+1
+	repeat
+		gc()
+		pending, timeout = system.run("ready")
+	until not pending or os.time() > deadline
+	assert(pending == false)
+	assert(stage == 1)
+	assert(timeout == math.huge)
+
+	done()
+end
+end
+
+newtest "capi" -----------------------------------------------------------------
+
+local cotest = require "coutil_test"
+
+do case "error messages"
+	assert(cotest.apiversion == 1)
+	asserterr("value expected", pcall(cotest.awaitwork))
+	asserterr("unable to yield", pcall(cotest.awaitwork, true))
+
+	done()
+end
+
+do case "await request"
+	local stage = 0
+	spawn(function ()
+		assert(cotest.awaitwork("done") == "done")
+		stage = 1
+	end)
+	assert(stage == 0)
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
+
+do case "cancel request"
+	local stage = 0
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		local a, b = cotest.awaitwork("done")
+		assert(a == "cancel" and b == nil)
+		stage = 1
+	end)
+	assert(stage == 0)
+	coroutine.resume(garbage.thread, "cancel")
+	assert(stage == 1)
+	assert(system.run() == false)
+
+	done()
+end
+
+do case "work functions"
+	local memory = require "memory"
+	local fill = cotest.workf("fill")
+	local count = cotest.workf("count")
+	asserterr("unable to yield", pcall(fill, memory.create(1), 0))
+
+	local stage = 0
+	spawn(function ()
+		local buffer = memory.create(64)
+		asserterr("memory expected", pcall(fill, "string", 0))
+		asserterr("number expected", pcall(fill, buffer))
+		asserterr("invalid argument", fill(buffer, 256))
+		assert(fill(buffer, 65) == 64)
+		assert(memory.tostring(buffer) == string.rep("A", 64))
+		assert(count(buffer, 65) == 64)
+		assert(count("ABBA", 66) == 2)
+		stage = 1
+	end)
+	assert(stage == 0)
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
+
+do case "cancel work"
+	local memory = require "memory"
+	local fill = cotest.workf("fill")
+	local stage = 0
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		local a, b = fill(memory.create(1024), 0)
+		assert(a == "cancel" and b == nil)
+		stage = 1
+	end)
+	assert(stage == 0)
+	coroutine.resume(garbage.thread, "cancel")
+	assert(stage == 1)
+	gc()
+	assert(system.run() == false)
+
+	done()
+end
+
 newtest "halt" -----------------------------------------------------------------
 
 do case "error messages"
@@ -153,3 +397,750 @@ do case "halt loop"
 
 	done()
 end
+
+newtest "stats" ----------------------------------------------------------------
+
+do case "error messages"
+	asserterr("table expected", pcall(system.stats, 1))
+
+	done()
+end
+
+do case "reused table"
+	local stats = system.stats()
+	assert(system.stats(stats) == stats)
+	local operations = stats.operations
+	assert(type(operations) == "table")
+	assert(system.stats(stats).operations == operations)
+	for _, field in ipairs{ "polling", "processing", "lag", "idle" } do
+		assert(type(stats[field]) == "number")
+		assert(stats[field] >= 0)
+	end
+	for _, field in ipairs{ "iterations", "resumes", "active", "handles", "requests" } do
+		assert(math.type(stats[field]) == "integer")
+		assert(stats[field] >= 0)
+	end
+	assert(math.type(operations.timer) == "integer")
+	assert(math.type(operations.write) == "integer")
+	assert(math.type(operations.wheel) == "integer")
+
+	done()
+end
+
+do case "counters"
+	local before = system.stats()
+	local timer, idle = before.operations.timer, before.operations.idle
+	local iterations, resumes = before.iterations, before.resumes
+	local polling, waited = before.polling, before.idle
+
+	local stage = 0
+	spawn(function ()
+		system.suspend(.01)
+		system.suspend(.01)
+		system.suspend()
+		stage = 1
+	end)
+	gc()
+	local stats = system.stats()
+	assert(stats.active == 1)
+	assert(stats.handles >= 1)
+
+	assert(system.run() == false)
+	assert(stage == 1)
+	system.stats(stats)
+	assert(stats.iterations > iterations)
+	assert(stats.resumes >= resumes+3)
+	assert(stats.operations.timer == timer+2)
+	assert(stats.operations.idle == idle+1)
+	assert(stats.polling >= polling+.015)
+	assert(stats.idle >= waited+.015)
+	assert(stats.lag <= stats.processing)
+	assert(stats.active == 0)
+
+	done()
+end
+
+newtest "latency" --------------------------------------------------------------
+
+do case "error messages"
+	asserterr("invalid option 'none'", pcall(system.latency, "none"))
+
+	done()
+end
+
+do case "disabled"
+	system.latency("stop")
+	system.latency("reset")
+	spawn(function ()
+		system.suspend(.01)
+	end)
+	assert(system.run() == false)
+	assert(next(system.latency()) == nil)
+
+	done()
+end
+
+do case "histograms"
+	system.latency("start")
+	spawn(function ()
+		system.suspend(.01)
+		system.suspend(.02)
+		system.suspend()
+	end)
+	assert(system.run() == false)
+	system.latency("stop")
+
+	local latencies = system.latency()
+	local timer = latencies.timer
+	assert(timer.count == 2)
+	assert(timer.max >= .015)
+	assert(timer.p50 <= timer.p90)
+	assert(timer.p90 <= timer.p99)
+	assert(timer.p99 <= timer.max)
+	local buckets = timer.buckets
+	local total = 0
+	for i, count in ipairs(buckets) do
+		assert(math.type(count) == "integer")
+		total = total+count
+	end
+	assert(total == timer.count)
+	assert(latencies.idle.count == 1)
+
+	spawn(function ()
+		system.suspend(.01)
+	end)
+	assert(system.run() == false)
+	assert(system.latency().timer.count == 2)
+
+	system.latency("reset")
+	assert(next(system.latency()) == nil)
+
+	done()
+end
+
+do case "streams"
+	local memory = require "memory"
+	local address = system.address("ipv4", "127.0.0.1", 0)
+	system.latency("start")
+	spawn(function ()
+		local passive = assert(system.socket("passive", "ipv4"))
+		assert(passive:bind(address))
+		assert(passive:getaddress("self", address))
+		assert(passive:listen(1))
+		spawn(function ()
+			local socket = assert(system.socket("stream", "ipv4"))
+			assert(socket:connect(address))
+			assert(socket:write("ping"))
+			assert(socket:close())
+		end)
+		local stream = assert(passive:accept())
+		assert(passive:close())
+		local buffer = memory.create(4)
+		local bytes = 0
+		while bytes < #buffer do
+			bytes = bytes+assert(stream:read(buffer, bytes+1))
+		end
+		assert(tostring(buffer) == "ping")
+		assert(stream:close())
+	end)
+	assert(system.run() == false)
+	system.latency("stop")
+
+	local latencies = system.latency()
+	assert(latencies.connect.count == 1)
+	assert(latencies.tcp.count >= 2)  -- accept and read
+	system.latency("reset")
+
+	done()
+end
+
+newtest "trace" ----------------------------------------------------------------
+
+do case "error messages"
+	asserterr("invalid option 'none'", pcall(system.trace, "none"))
+	asserterr("number expected", pcall(system.trace, "export", "none"))
+
+	done()
+end
+
+local function countevents(json, name)
+	local count = 0
+	for event in string.gmatch(json, '"name":"([^"]*)"') do
+		if name == nil or event == name then
+			count = count+1
+		end
+	end
+	return count
+end
+
+do case "export"
+	system.trace("reset")
+	local start = system.nanosecs()
+	system.trace("start")
+	spawn(function ()
+		system.suspend(.01)
+	end)
+	assert(system.run() == false)
+	system.trace("stop")
+	local finish = system.nanosecs()
+
+	local json = system.trace()
+	assert(string.match(json, '^{"traceEvents":%[.*%],"displayTimeUnit":"ns"}$'))
+	assert(countevents(json, "suspended operation") >= 1)
+	assert(countevents(json, "resumed operation") >= 1)
+	local last = 0
+	for ts in string.gmatch(json, '"ts":([%d.]+)') do
+		ts = tonumber(ts)
+		assert(ts >= last)
+		assert(ts*1e3 >= start-1 and ts*1e3 <= finish+1)
+		last = ts
+	end
+
+	spawn(function ()
+		system.suspend(.01)
+	end)
+	assert(system.run() == false)
+	assert(system.trace() == json)
+
+	assert(countevents(system.trace("export", 0, start)) == 0)
+	assert(countevents(system.trace("export", finish)) == 0)
+	assert(countevents(system.trace("export", start, finish)) == countevents(json))
+
+	system.trace("reset")
+	assert(countevents(system.trace()) == 0)
+
+	done()
+end
+
+newtest "usage" ----------------------------------------------------------------
+
+local function busywait(secs)
+	local start = system.time("updated")
+	repeat until system.time("updated")-start >= secs
+end
+
+do case "error messages"
+	asserterr("thread expected", pcall(system.usage))
+	asserterr("number expected", pcall(system.topusage))
+	asserterr("out of range", pcall(system.topusage, 0))
+	asserterr("invalid option 'none'", pcall(system.topusage, 1, "none"))
+
+	done()
+end
+
+do case "disabled"
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		system.suspend()
+		busywait(.01)
+	end)
+	assert(system.run() == false)
+	local wall, cpu, resumes = system.usage(garbage.thread)
+	assert(wall == 0)
+	assert(cpu == 0)
+	assert(resumes == 0)
+	assert(#system.topusage(10) == 0)
+
+	done()
+end
+
+do case "usage"
+	system.accounting(true)
+	local stage = 0
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		system.suspend()
+		busywait(.05)
+		system.suspend()
+		stage = 1
+	end)
+	assert(system.run() == false)
+	assert(stage == 1)
+	local wall, cpu, resumes = system.usage(garbage.thread, true)
+	assert(wall >= .04)
+	assert(cpu >= .01)
+	assert(cpu <= wall+.01)
+	assert(resumes == 2)
+	wall, cpu, resumes = system.usage(garbage.thread)
+	assert(wall == 0)
+	assert(cpu == 0)
+	assert(resumes == 0)
+	system.accounting(false)
+
+	done()
+end
+
+do case "top consumers"
+	system.accounting(true)
+	local spent = { .03, .01, .02, 0 }
+	local threads = {}
+	for i, secs in ipairs(spent) do
+		spawn(function ()
+			threads[i] = coroutine.running()
+			for _ = 1, i do
+				system.suspend()
+			end
+			busywait(secs)
+		end)
+	end
+	assert(system.run() == false)
+
+	local list = system.topusage(3)
+	assert(#list == 3)
+	assert(list[1].coroutine == threads[1])
+	assert(list[2].coroutine == threads[3])
+	assert(list[3].coroutine == threads[2])
+	for i = 2, #list do
+		assert(list[i-1].cpu >= list[i].cpu)
+	end
+	for _, record in ipairs(list) do
+		local wall, cpu, resumes = system.usage(record.coroutine)
+		assert(record.wall == wall)
+		assert(record.cpu == cpu)
+		assert(record.resumes == resumes)
+	end
+
+	list = system.topusage(2, "resumes")
+	assert(#list == 2)
+	assert(list[1].coroutine == threads[4])
+	assert(list[1].resumes == 4)
+	assert(list[2].coroutine == threads[3])
+
+	list = system.topusage(1, "wall")
+	assert(list[1].coroutine == threads[1])
+
+	system.accounting(false)
+	assert(#system.topusage(10) == 0)
+	threads, list = nil, nil
+
+	done()
+end
+
+newtest "profile" --------------------------------------------------------------
+
+do case "error messages"
+	asserterr("invalid option 'none'", pcall(system.profile, "none"))
+	asserterr("number expected", pcall(system.profile, "start", "none"))
+	asserterr("out of range", pcall(system.profile, "start", 0))
+	asserterr("out of range", pcall(system.profile, "start", -1))
+
+	done()
+end
+
+do case "folded stacks"
+	system.profile("reset")
+	assert(system.profile() == "")
+	assert(system.profile("start", .001) == true)
+	local function profiled()
+		busywait(.05)
+	end
+	spawn(function ()
+		system.suspend()
+		profiled()
+	end)
+	assert(system.run() == false)
+	system.profile("stop")
+
+	local folded = system.profile()
+	local total, found = 0, false
+	for stack, count in string.gmatch(folded, "([^\n]+) (%d+)\n") do
+		assert(string.match(stack, "^thread %d+;"))
+		if string.find(stack, "profiled (system.lua:", 1, true) then
+			found = true
+		end
+		total = total+tonumber(count)
+	end
+	assert(found)
+	assert(total > 0)
+
+	spawn(function ()
+		system.suspend()
+		busywait(.01)
+	end)
+	assert(system.run() == false)
+	assert(system.profile() == folded)
+
+	system.profile("reset")
+	assert(system.profile() == "")
+
+	done()
+end
+
+do case "keep debug hooks"
+	local function hook() end
+	local hooked
+	assert(system.profile("start", .001) == true)
+	spawn(function ()
+		debug.sethook(hook, "", 1e6)
+		system.suspend()
+		busywait(.01)
+		hooked = debug.gethook()
+		debug.sethook()
+	end)
+	assert(system.run() == false)
+	system.profile("stop")
+	assert(hooked == hook)
+
+	system.profile("reset")
+
+	done()
+end
+
+newtest "watchdog" -------------------------------------------------------------
+
+do case "error messages"
+	asserterr("number expected", pcall(system.watchdog, "none"))
+	asserterr("out of range", pcall(system.watchdog, -1))
+	asserterr("out of range", pcall(system.watchdog, 0))
+
+	done()
+end
+
+do case "record stalls"
+	system.stalls(true)
+	system.watchdog(.05)
+
+	local stalled
+	spawn(function ()
+		stalled = coroutine.running()
+		system.suspend()
+		busywait(.1)
+		system.suspend()
+	end)
+	spawn(function ()
+		system.suspend()
+		system.suspend()
+	end)
+
+	gc()
+	assert(system.run() == false)
+	local records, count = system.stalls()
+	assert(count == 1)
+	assert(#records == 1)
+	assert(records[1].coroutine == stalled)
+	assert(records[1].duration >= .09)
+	assert(string.find(records[1].traceback, "system.lua", 1, true))
+
+	records, count = system.stalls(true)
+	assert(count == 1)
+	assert(#records == 1)
+	records, count = system.stalls()
+	assert(count == 0)
+	assert(#records == 0)
+
+	system.watchdog()
+	spawn(function ()
+		system.suspend()
+		busywait(.1)
+	end)
+	gc()
+	assert(system.run() == false)
+	records, count = system.stalls()
+	assert(count == 0)
+	assert(#records == 0)
+
+	records, stalled = nil
+
+	done()
+end
+
+do case "bounded log"
+	system.watchdog(1e-9)
+
+	spawn(function ()
+		for i = 1, 100 do
+			system.suspend()
+		end
+	end)
+
+	gc()
+	assert(system.run() == false)
+	system.watchdog(nil)
+	local records, count = system.stalls(true)
+	assert(count == 100)
+	assert(#records < count)
+	for i = 2, #records do
+		assert(records[i-1].coroutine == records[i].coroutine)
+	end
+
+	records = nil
+
+	done()
+end
+
+newtest "awaitprio" -------------------------------------------------------------
+
+do case "error messages"
+	asserterr("thread expected", pcall(system.awaitprio))
+	asserterr("thread expected", pcall(system.awaitprio, 1, "high"))
+	asserterr("invalid option", pcall(system.awaitprio, coroutine.running(), "highest"))
+
+	done()
+end
+
+do case "set classes"
+	local co = coroutine.create(function () end)
+	assert(system.awaitprio(co) == "normal")
+	assert(system.awaitprio(co, "high") == "normal")
+	assert(system.awaitprio(co, "low") == "high")
+	assert(system.awaitprio(co) == "low")
+	assert(system.awaitprio(co, "normal") == "low")
+	assert(system.awaitprio(co) == "normal")
+
+	done()
+end
+
+do case "resume order"
+	local order = {}
+	local threads = {}
+	for _, class in ipairs{ "low", "normal", "high", "normal", "low" } do
+		spawn(function ()
+			threads[#threads+1] = coroutine.running()
+			system.awaitprio(coroutine.running(), class)
+			system.suspend()
+			order[#order+1] = class
+		end)
+	end
+
+	gc()
+	assert(system.run("step") == false)
+	assert(#order == 5)
+	assert(order[1] == "high")
+	assert(order[2] == "normal")
+	assert(order[3] == "normal")
+	assert(order[4] == "low")
+	assert(order[5] == "low")
+
+	for _, thread in ipairs(threads) do
+		system.awaitprio(thread, "normal")
+	end
+	threads = nil
+
+	done()
+end
+
+do case "highest class not parked"
+	local resumes = system.stats().resumes
+	local low
+	spawn(function ()
+		low = coroutine.running()
+		system.awaitprio(low, "low")
+		system.suspend(.01)
+		system.suspend(.01)
+	end)
+	spawn(function ()
+		system.suspend(.01)
+		system.suspend(.01)
+	end)
+
+	gc()
+	assert(system.run() == false)
+	assert(system.stats().resumes == resumes+6)  -- only 'low' is parked
+
+	system.awaitprio(low, "normal")
+	low = nil
+
+	done()
+end
+
+do case "collected classes"
+	system.awaitprio(coroutine.create(function () end), "high")
+	gc()
+	spawn(function ()
+		system.suspend(.01)
+		system.suspend(.01)
+	end)
+	local resumes = system.stats().resumes
+	assert(system.run() == false)
+	assert(system.stats().resumes == resumes+2)  -- not parked
+
+	done()
+end
+
+do case "cancel parked"
+	local stage = 0
+	local low
+	spawn(function ()
+		low = coroutine.running()
+		system.awaitprio(low, "low")
+		local res, extra = system.suspend()
+		assert(res == "canceled")
+		assert(extra == nil)
+		stage = stage+1
+	end)
+	spawn(function ()
+		system.awaitprio(coroutine.running(), "high")
+		system.suspend()
+		assert(stage == 0)
+		coroutine.resume(low, "canceled")
+		assert(stage == 1)
+		system.awaitprio(coroutine.running(), "normal")
+	end)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	system.awaitprio(low, "normal")
+	low = nil
+
+	done()
+end
+
+newtest "awaitany" -------------------------------------------------------------
+
+do case "error messages"
+	asserterr("table expected", pcall(system.awaitany))
+	asserterr("table expected", pcall(system.awaitany, system.suspend))
+	asserterr("table expected", pcall(system.awaitany, {system.suspend}, false))
+	asserterr("unable to yield", pcall(system.awaitany, {system.suspend}))
+	spawn(function ()
+		asserterr("function expected", pcall(system.awaitany, {system.suspend}, {}))
+	end)
+	assert(system.run() == false)
+
+	done()
+end
+
+do case "first completed"
+	local stage = 0
+	spawn(function ()
+		local i, res = system.awaitany({system.suspend, 3600},
+		                               {system.suspend, .01},
+		                               {system.suspend, 3600, "c"})
+		assert(i == 2)
+		assert(res == true)
+		stage = 1
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
+
+do case "completed without suspension"
+	local stage = 0
+	spawn(function ()
+		local i, a,b,c = system.awaitany({system.suspend, 3600},
+		                                 {function (...) return ... end, 1,nil,3, n=4},
+		                                 {system.suspend})
+		assert(i == 2)
+		assert(a == 1)
+		assert(b == nil)
+		assert(c == 3)
+		stage = 1
+	end)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+
+	done()
+end
+
+do case "reported errors"
+	local stage = 0
+	spawn(function ()
+		asserterr("oops!", pcall(system.awaitany, {system.suspend, 3600},
+		                                          {error, "oops!"}))
+		stage = 1
+		asserterr("unable to yield", pcall(system.awaitany, {system.suspend, 3600},
+		                                                    {function ()
+		                                                    	system.suspend()
+		                                                    	error("oops!")
+		                                                    end}))
+		stage = 2
+	end)
+	assert(stage == 2)
+
+	gc()
+	assert(system.run() == false)
+
+	done()
+end
+
+do case "cancel schedule"
+	local stage = 0
+	spawn(function ()
+		garbage.coro = coroutine.running()
+		local a,b,c = system.awaitany({system.suspend, 3600}, {system.suspend, 3600})
+		assert(a == true)
+		assert(b == nil)
+		assert(c == 3)
+		stage = 1
+		coroutine.yield()
+		stage = 2
+	end)
+	assert(stage == 0)
+
+	coroutine.resume(garbage.coro, true,nil,3)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
+
+do case "reschedule"
+	local stage = 0
+	spawn(function ()
+		for i = 1, 100 do
+			local expected = i%3+1
+			local calls = { {system.suspend, 3600}, {system.suspend, 3600}, {system.suspend, 3600} }
+			calls[expected][2] = 0
+			assert(system.awaitany(table.unpack(calls)) == expected)
+		end
+		stage = 1
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
+
+do case "resumed by scheduler"
+	system.accounting(true)
+	local stage = 0
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		local i, res = system.awaitany({system.suspend, 3600}, {system.suspend})
+		assert(i == 2)
+		assert(res == true)
+		stage = 1
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+	local _, _, resumes = system.usage(garbage.thread)
+	assert(resumes == 1)
+	system.accounting(false)
+
+	done()
+end
+
+do case "with deadline"
+	local stage = 0
+	spawn(function ()
+		asserterr("timeout", system.deadline(.01, system.awaitany,
+			{system.suspend, 3600},
+			{system.suspend, 3600, "c"}))
+		stage = 1
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end
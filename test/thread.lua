@@ -238,6 +238,275 @@ do case "yielding tasks"
 	done()
 end
 
+do case "memory limit"
+	local t = assert(threads.create(1))
+	assert(checkcount(t, "mc", 0, 0))
+	assert(t:memlimit(math.huge) == true)
+
+	local path = tempfilename()
+	assert(t:dofile(waitscript, "t", path, "yield") == true)
+	repeat until (t:count("c") > 0)
+	local memory, allocs = t:count("mc")
+	assert(memory > 0)
+	assert(allocs > 0)
+	sendsignal(path)
+	repeat until (checkcount(t, "n", 0))
+	assert(checkcount(t, "m", 0))
+	assert(t:count("c") >= allocs)
+
+	assert(t:memlimit(4*1024*1024) == true)
+	local code = string.format([[%s
+		local ok, err = pcall(function ()
+			local t = {}
+			for i = 1, 1e6 do t[i] = {} end
+		end)
+		assert(ok == false and err == "not enough memory")
+		sendsignal(%q)
+	]], utilschunk, path)
+	assert(t:dostring(code) == true)
+	waitsignal(path)
+
+	assert(t:memlimit(0) == true)
+	asserterr("not enough memory", t:dostring("return"))
+
+	assert(t:memlimit() == true)
+	repeat until (checkcount(t, "n", 0))
+	allocs = t:count("c")
+	code = string.format("%s sendsignal(%q)", utilschunk, path)
+	assert(t:dostring(code) == true)
+	waitsignal(path)
+	repeat until (checkcount(t, "n", 0))
+	assert(checkcount(t, "mc", 0, allocs))
+
+	assert(t:memlimit(math.huge) == true)
+	code = string.format([[%s
+		local threads = require "coutil.threads"
+		local nested = assert(threads.create(0))
+		assert(nested:dostring("return") == true)
+		assert(nested:close() == true)
+		sendsignal(%q)
+	]], utilschunk, path)
+	assert(t:dostring(code) == true)
+	waitsignal(path)
+	repeat until (checkcount(t, "n", 0))
+	assert(checkcount(t, "m", 0))
+
+	asserterr("limit cannot be negative", pcall(t.memlimit, t, -1))
+
+	assert(t:close() == true)
+
+	done()
+end
+
+do case "arena allocator"
+	asserterr("invalid option 'other'", pcall(threads.create, 1, "other"))
+
+	local t = assert(threads.create(2, "arena"))
+	assert(t:memlimit(math.huge) == true)
+	local code = [[
+		local coroutine = require "coroutine"
+		local string = require "string"
+		local list = {}
+		for i = 1, 1e4 do
+			list[i%100+1] = string.rep("x", i%1000)..i
+			if i%100 == 0 then coroutine.yield() end
+		end
+		local threads = require "coutil.threads"
+		local nested = assert(threads.create(0))
+		assert(nested:dostring("return") == true)
+		assert(nested:close() == true)
+	]]
+	for i = 1, 4 do
+		assert(t:dostring(code) == true)
+	end
+	repeat until (checkcount(t, "n", 0))
+	assert(checkcount(t, "m", 0))
+	assert(t:count("c") > 0)
+
+	assert(t:close() == true)
+
+	done()
+end
+
+do case "thread options"
+	asserterr("table expected", pcall(threads.create, 1, "parent", true))
+	asserterr("bad field stacksize (non-negative integer expected)",
+		pcall(threads.create, 1, "parent", { stacksize = -1 }))
+	asserterr("bad field cpus (table expected)",
+		pcall(threads.create, 1, "parent", { cpus = true }))
+	asserterr("bad field cpus (invalid CPU -1)",
+		pcall(threads.create, 1, "parent", { cpus = { -1 } }))
+
+	local t = assert(threads.create(1, "parent", {
+		stacksize = 1<<20,
+		cpus = { 0 },
+		numa = true,
+		sticky = true,
+	}))
+	local m = 10
+	for i = 1, m do
+		local name = "thread options "..i
+		assert(t:dostring([[
+			local coroutine = require "coroutine"
+			local name = ...
+			for i = 1, 10 do
+				assert(coroutine.yield(name, "out", i) == true)
+			end
+		]], nil, "t", name) == true)
+		assert(t:dostring([[
+			local coroutine = require "coroutine"
+			local name = ...
+			for i = 1, 10 do
+				local ok, value = coroutine.yield(name, "in")
+				assert(ok == true and value == i)
+			end
+		]], nil, "t", name) == true)
+	end
+	assert(t:resize(3, true, { sticky = true }) == true)
+	repeat until (checkcount(t, "n", 0))
+	assert(checkcount(t, "ea", 3, 3))
+	assert(t:resize(2, false, { numa = true }) == true)
+	assert(t:close() == true)
+
+	done()
+end
+
+do case "task priorities"
+	local t = assert(threads.create(0))
+	asserterr("conflicting priority classes", pcall(t.dostring, t, "", nil, "hl"))
+	asserterr("conflicting priority classes", pcall(t.dofile, t, nil, "lth"))
+	asserterr("attempt to load a text chunk (mode is 'bh')",
+	          t:dostring("return", nil, "bh"))
+
+	local name = "task priorities"
+	local code = [[
+		local coroutine = require "coroutine"
+		local name, class = ...
+		assert(coroutine.yield(name, "out", class) == true)
+	]]
+	local modes = { low = "tl", normal = "t", high = "h" }
+	for _, class in ipairs{ "low", "normal", "high", "low", "high" } do
+		assert(t:dostring(code, nil, modes[class], name, class) == true)
+	end
+	assert(checkcount(t, "np", 5, 5))
+
+	local classes = {}
+	spawn(function ()
+		local ch = channel.create(name)
+		for i = 1, 5 do
+			local ok, class = system.awaitch(ch, "in")
+			assert(ok == true)
+			classes[i] = class
+		end
+	end)
+	assert(t:resize(1) == true)
+	assert(system.run() == false)
+	assert(table.concat(classes, " ") == "high high normal low low")
+
+	repeat until (checkcount(t, "n", 0))
+	assert(t:close() == true)
+
+	done()
+end
+
+do case "pending limit"
+	local t = assert(threads.create(0))
+	asserterr("number expected", pcall(t.pendlimit, t, "other"))
+	asserterr("limit cannot be negative", pcall(t.pendlimit, t, -1))
+
+	assert(t:pendlimit(2) == true)
+	assert(t:dostring("return") == true)
+	assert(t:dostring("return") == true)
+	asserterr("resource temporarily unavailable", t:dostring("return"))
+	asserterr("resource temporarily unavailable", t:dofile("nonexistent.lua"))
+	assert(checkcount(t, "np", 2, 2))
+
+	assert(t:pendlimit(2, true) == true)
+	local added = 0
+	spawn(function ()
+		for i = 1, 10 do
+			assert(t:dostring("return") == true)
+			added = added+1
+		end
+	end)
+	assert(added == 0)
+	spawn(function ()
+		garbage.thread = coroutine.running()
+		local a, b, c = t:dostring("return")
+		assert(a == nil)
+		assert(b == "cancel")
+		assert(c == nil)
+		added = added+1
+	end)
+	coroutine.resume(garbage.thread, nil, "cancel")
+	assert(added == 1)
+	assert(t:resize(1, true) == true)
+	assert(system.run() == false)
+	assert(added == 11)
+	repeat until (checkcount(t, "n", 0))
+
+	assert(t:resize(0) == true)
+	repeat until (checkcount(t, "a", 0))
+	assert(t:dostring("return") == true)
+	assert(t:dostring("return") == true)
+	spawn(function ()
+		assert(t:dostring("return") == true)
+		added = added+1
+	end)
+	assert(t:pendlimit() == true)
+	assert(system.run() == false)
+	assert(added == 12)
+	assert(checkcount(t, "np", 3, 3))
+	assert(t:close() == true)
+
+	done()
+end
+
+do case "warm states"
+	local t = assert(threads.create(0))
+	asserterr("number expected", pcall(t.warmstates, t, "other"))
+	asserterr("size cannot be negative", pcall(t.warmstates, t, -1))
+	asserterr("refill cannot be negative", pcall(t.warmstates, t, 1, -1))
+	assert(t:warmstates(3, 1) == true)
+
+	package.preload["module"] = function ()
+		return {name = "module"}
+	end
+	local name = "warm states"
+	local code = [[
+		local coroutine = require "coroutine"
+		local package = require "package"
+		package.path = ""
+		package.cpath = ""
+		local name, i = ...
+		assert(coroutine.yield(name, "out", require("module").name, i) == true)
+	]]
+	for i = 1, 5 do
+		assert(t:dostring(code, nil, "t", name, i) == true)
+	end
+	package.preload["module"] = nil
+	assert(checkcount(t, "np", 5, 5))
+
+	local values = {}
+	spawn(function ()
+		local ch = channel.create(name)
+		for i = 1, 5 do
+			local ok, module, index = system.awaitch(ch, "in")
+			assert(ok == true and module == "module")
+			values[index] = true
+		end
+	end)
+	assert(t:resize(1) == true)
+	assert(system.run() == false)
+	assert(#values == 5)
+
+	repeat until (checkcount(t, "n", 0))
+	assert(t:warmstates() == true)
+	assert(t:close() == true)
+
+	done()
+end
+
 if standard == "posix" then
 do case "many threads, even more tasks"
 	local path = {}
@@ -292,6 +561,44 @@ do case "many threads, even more tasks"
 end
 end
 
+do case "tasks resumed by other tasks"
+	local m, n = 20, 4
+	local t = assert(threads.create(n))
+	local channels = {}
+	for i = 1, m do
+		local name = "tasks resumed by other tasks "..i
+		channels[i] = channel.create(name)
+		assert(t:dostring([[
+			local coroutine = require "coroutine"
+			local name, count = ...
+			for i = 1, count do
+				assert(coroutine.yield(name, "out", i) == true)
+			end
+		]], nil, "t", name, 100) == true)
+		assert(t:dostring([[
+			local coroutine = require "coroutine"
+			local name, count = ...
+			for i = 1, count do
+				local ok, value = coroutine.yield(name, "in")
+				assert(ok == true and value == i)
+				coroutine.yield()
+			end
+		]], nil, "t", name, 100) == true)
+	end
+
+	repeat
+		local tasks, running, pending, suspended = t:count("nrps")
+		assert(running <= n)
+		assert(pending >= 0)
+		assert(suspended >= 0)
+		assert(tasks == running+pending+suspended)
+	until tasks == 0
+	assert(checkcount(t, "nrpsea", 0, 0, 0, 0, n, n))
+	assert(t:close() == true)
+
+	done()
+end
+
 do case "pending tasks"
 	local t = assert(threads.create(1))
 	local path1 = tempfilename()
@@ -58,6 +58,7 @@ do case "error messages"
 	asserterr("unable to yield", pcall(system.suspend))
 	asserterr("out of range", pcall(system.suspend, math.maxinteger, "~"))
 	asserterr("out of range", pcall(system.suspend, 0x1p64/999.9))
+	asserterr("unknown mode char", pcall(system.suspend, 1, "x"))
 
 	done()
 end
@@ -334,6 +335,75 @@ do case "ignore errors after cancel"
 	done()
 end
 
+do case "many scheduled"
+	local count = 20000
+	local resumed = 0
+	for i = 1, count do
+		spawn(function ()
+			system.suspend()
+			resumed = resumed+1
+			system.suspend()
+			resumed = resumed+1
+		end)
+	end
+	assert(resumed == 0)
+	assert(system.run() == false)
+	assert(resumed == 2*count)
+
+	done()
+end
+
+do case "coarse schedule"
+	local delays = { .7, .01, .3, .05, .2, .65, .03 }
+	local order = {}
+	local started = system.time()
+	for _, delay in ipairs(delays) do
+		spawn(function ()
+			assert(system.suspend(delay, "c") == true)
+			local elapsed = (system.time()-started)*1e3
+			assert(elapsed >= delay*1e3-.5)
+			assert(elapsed < delay*1e3+500)
+			table.insert(order, delay)
+		end)
+	end
+	assert(#order == 0)
+	gc()
+	assert(system.run() == false)
+	table.sort(delays)
+	assert(#order == #delays)
+	for i, delay in ipairs(delays) do
+		assert(order[i] == delay)
+	end
+
+	done()
+end
+
+do case "cancel coarse schedule"
+	local stage = 0
+	spawn(function ()
+		garbage.coro = coroutine.running()
+		local a,b,c = system.suspend(3600, "c")
+		assert(a == true)
+		assert(b == nil)
+		assert(c == 3)
+		stage = 1
+		assert(system.suspend(.01, "c") == true)
+		stage = 2
+		assert(system.suspend(.02) == true)
+		stage = 3
+	end)
+	assert(stage == 0)
+
+	coroutine.resume(garbage.coro, true,nil,3)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 3)
+
+	done()
+end
+
 do case "terminate scheduled"
 	dostring(utilschunk..[[
 		local system = require "coutil.system"
@@ -341,3 +411,144 @@ do case "terminate scheduled"
 	]])
 	done()
 end
+
+newtest "deadline" -------------------------------------------------------------
+
+do case "error messages"
+	asserterr("number expected", pcall(system.deadline))
+	asserterr("number expected", pcall(system.deadline, false, print))
+	asserterr("value expected", pcall(system.deadline, 1))
+	asserterr("out of range", pcall(system.deadline, 0x1p64/999.9, print))
+	asserterr("unable to yield", pcall(system.deadline, 1, system.suspend))
+
+	done()
+end
+
+do case "returned values"
+	local stage = 0
+	spawn(function ()
+		assertnone(system.deadline(1, function () end))
+		local a,b,c = system.deadline(3600, function (...) return ... end, 1,nil,3)
+		assert(a == 1)
+		assert(b == nil)
+		assert(c == 3)
+		stage = 1
+		assert(system.deadline(3600, system.suspend, .01) == true)
+		stage = 2
+	end)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 2)
+
+	done()
+end
+
+do case "raised errors"
+	local stage = 0
+	spawn(function ()
+		asserterr("oops!", pcall(system.deadline, 3600, error, "oops!"))
+		stage = 1
+		asserterr("oops!", pcall(system.deadline, 3600, function ()
+			system.suspend()
+			error("oops!")
+		end))
+		stage = 2
+	end)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 2)
+
+	done()
+end
+
+do case "expired"
+	local stage = 0
+	spawn(function ()
+		asserterr("timeout", system.deadline(.01, system.suspend, 3600))
+		stage = 1
+		asserterr("timeout", system.deadline(.01, system.suspend, 3600, "c"))
+		stage = 2
+		asserterr("timeout", system.deadline(0, system.suspend, 1))
+		stage = 3
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 3)
+
+	done()
+end
+
+do case "expired while not awaiting"
+	local stage = 0
+	spawn(function ()
+		garbage.coro = coroutine.running()
+		local res, errmsg = system.deadline(.01, function ()
+			assert(coroutine.yield() == "resumed")
+			stage = 1
+			return system.suspend(3600)
+		end)
+		asserterr("timeout", res, errmsg)
+		stage = 2
+	end)
+	assert(stage == 0)
+
+	assert(system.run() == false)
+	assert(stage == 0)
+	coroutine.resume(garbage.coro, "resumed")
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 2)
+
+	done()
+end
+
+do case "expired in nested calls"
+	local stage = 0
+	spawn(function ()
+		local res, errmsg = system.deadline(3600, system.deadline, .01, system.suspend, 3600)
+		asserterr("timeout", res, errmsg)
+		stage = 1
+		local res, errmsg = system.deadline(.01, system.deadline, 3600, system.suspend, 3600)
+		asserterr("timeout", res, errmsg)
+		stage = 2
+	end)
+	assert(stage == 0)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 2)
+
+	done()
+end
+
+do case "cancel schedule"
+	local stage = 0
+	spawn(function ()
+		garbage.coro = coroutine.running()
+		local a,b,c = system.deadline(.01, system.suspend, 3600)
+		assert(a == true)
+		assert(b == nil)
+		assert(c == 3)
+		stage = 1
+		coroutine.yield()
+		stage = 2
+	end)
+	assert(stage == 0)
+
+	coroutine.resume(garbage.coro, true,nil,3)
+	assert(stage == 1)
+
+	gc()
+	assert(system.run() == false)
+	assert(stage == 1)
+
+	done()
+end